@@ -0,0 +1,461 @@
+// Microbenchmarks for the search kernels, the chunk loop and the inflate
+// backends, plus end-to-end runs of SearchInFile over a stored and a
+// deflated zip entry. Every benchmark runs over a synthetic corpus and, if
+// SEARCH_BENCH_CORPUS names a wordlist, over (up to 256 MB of) that too.
+//
+//   search_bench --benchmark_filter=FindAll
+//   SEARCH_BENCH_CORPUS=rockyou2024.txt search_bench
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <random>
+
+#include "../src/Search.cc"
+
+namespace
+{
+
+    constexpr size_t kSyntheticSize = 32 * 1024 * 1024;  // 32 MB, inflated in one call when possible
+    constexpr size_t kMaxCorpusSize = 256 * 1024 * 1024; // 256 MB
+    constexpr const char *kRareNeedle = "dragon2024";    // a few hundred hits
+    constexpr const char *kCommonNeedle = "a";           // a hit every few lines
+
+    struct Corpus
+    {
+        std::string name;
+        std::string text;
+        std::string compressed; // raw deflate of text
+        std::vector<std::string> sample; // lines for multi-pattern runs
+    };
+
+    // Password-like lines of 6 to 16 printable bytes, with the rare needle
+    // mixed in every few thousand lines.
+    std::string MakeSyntheticCorpus()
+    {
+        static constexpr std::string_view kAlphabet =
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%&*._-";
+        std::mt19937_64 random(2024);
+        std::string text;
+        text.reserve(kSyntheticSize + 64);
+        for (uint64_t line = 0; text.size() < kSyntheticSize; ++line)
+        {
+            if (line % 4096 == 0)
+            {
+                text += kRareNeedle;
+            }
+            else
+            {
+                const size_t length = 6 + random() % 11;
+                for (size_t i = 0; i < length; ++i)
+                {
+                    text += kAlphabet[random() % kAlphabet.size()];
+                }
+            }
+            text += '\n';
+        }
+        return text;
+    }
+
+    std::string ReadCorpus(const char *filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+        {
+            throw std::runtime_error(std::string("Error opening corpus: ") + filename);
+        }
+        std::string text(kMaxCorpusSize, '\0');
+        in.read(text.data(), static_cast<std::streamsize>(text.size()));
+        text.resize(static_cast<size_t>(in.gcount()));
+        text.resize(text.rfind('\n') + 1);
+        return text;
+    }
+
+    std::string DeflateRaw(std::string_view text)
+    {
+        z_stream stream{};
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            throw std::runtime_error("Error initializing deflate");
+        }
+        std::string compressed(deflateBound(&stream, static_cast<uLong>(text.size())), '\0');
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+        stream.avail_in = static_cast<uInt>(text.size());
+        stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+        stream.avail_out = static_cast<uInt>(compressed.size());
+        const int ret = deflate(&stream, Z_FINISH);
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+        if (ret != Z_STREAM_END)
+        {
+            throw std::runtime_error("Error deflating corpus");
+        }
+        return compressed;
+    }
+
+    Corpus MakeCorpus(std::string name, std::string text)
+    {
+        Corpus corpus{std::move(name), std::move(text), {}, {}};
+        corpus.compressed = DeflateRaw(corpus.text);
+        const size_t step = corpus.text.size() / 100;
+        for (size_t offset = step; corpus.sample.size() < 100 && offset < corpus.text.size(); offset += step)
+        {
+            const size_t start = corpus.text.rfind('\n', offset) + 1;
+            const size_t length = corpus.text.find('\n', start) - start;
+            if (length >= 4)
+                corpus.sample.push_back(corpus.text.substr(start, length));
+        }
+        return corpus;
+    }
+
+    // A minimal archive writer, just enough for the end-to-end runs: one
+    // stored and one deflated copy of the corpus, without Zip64.
+    class ZipWriter
+    {
+    public:
+        explicit ZipWriter(const std::string &filename) : out_(filename, std::ios::binary)
+        {
+            if (!out_)
+            {
+                throw std::runtime_error("Error creating " + filename);
+            }
+        }
+
+        void Add(const std::string &name, std::string_view text, std::string_view compressed, int method)
+        {
+            const std::string_view data = (method == 0) ? text : compressed;
+            if (data.size() > UINT32_MAX || text.size() > UINT32_MAX)
+            {
+                throw std::runtime_error("Corpus too large for a zip without Zip64");
+            }
+            Entry entry{name, static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(text.data()),
+                                                         static_cast<uInt>(text.size()))),
+                        static_cast<uint32_t>(data.size()), static_cast<uint32_t>(text.size()),
+                        static_cast<uint32_t>(out_.tellp()), static_cast<uint16_t>(method)};
+            Put32(0x04034b50);
+            PutCommon(entry);
+            Put16(0); // extra field length
+            out_ << name << data;
+            entries_.push_back(entry);
+        }
+
+        ~ZipWriter()
+        {
+            const auto directory_offset = static_cast<uint32_t>(out_.tellp());
+            for (const Entry &entry : entries_)
+            {
+                Put32(0x02014b50);
+                Put16(20); // made by
+                PutCommon(entry);
+                for (int field = 0; field < 4; ++field)
+                    Put16(0); // extra and comment length, disk, internal attributes
+                Put32(0);     // external attributes
+                Put32(entry.offset);
+                out_ << entry.name;
+            }
+            const auto directory_size = static_cast<uint32_t>(out_.tellp()) - directory_offset;
+            Put32(0x06054b50);
+            Put32(0); // disk numbers
+            Put16(static_cast<uint16_t>(entries_.size()));
+            Put16(static_cast<uint16_t>(entries_.size()));
+            Put32(directory_size);
+            Put32(directory_offset);
+            Put16(0); // comment length
+        }
+
+    private:
+        struct Entry
+        {
+            std::string name;
+            uint32_t crc;
+            uint32_t compressed_size;
+            uint32_t size;
+            uint32_t offset;
+            uint16_t method;
+        };
+
+        void Put16(uint16_t value)
+        {
+            const char bytes[] = {static_cast<char>(value), static_cast<char>(value >> 8)};
+            out_.write(bytes, sizeof(bytes));
+        }
+
+        void Put32(uint32_t value)
+        {
+            Put16(static_cast<uint16_t>(value));
+            Put16(static_cast<uint16_t>(value >> 16));
+        }
+
+        // The fields local and central headers share, from "version needed"
+        // to the file name length.
+        void PutCommon(const Entry &entry)
+        {
+            Put16(20);     // version needed
+            Put16(0);      // flags
+            Put16(entry.method);
+            Put16(0);      // time
+            Put16(0x21);   // date: 1980-01-01
+            Put32(entry.crc);
+            Put32(entry.compressed_size);
+            Put32(entry.size);
+            Put16(static_cast<uint16_t>(entry.name.size()));
+        }
+
+        std::ofstream out_;
+        std::vector<Entry> entries_;
+    };
+
+    void SetThroughput(benchmark::State &state, size_t bytes)
+    {
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+    }
+
+    void BenchBoyerMoore(benchmark::State &state, const Corpus &corpus)
+    {
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(Search::BoyerMoore(corpus.text, kRareNeedle, false));
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    void BenchFindAll(benchmark::State &state, const Corpus &corpus, bool fold)
+    {
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(Search::FindAll(corpus.text, kRareNeedle, fold));
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    // The generic SIMD filter on the same needle, for comparison with the
+    // length-specialized kernel FindAll picks for it.
+    void BenchFindAllGeneric(benchmark::State &state, const Corpus &corpus)
+    {
+        const Search::FindFunction generic = Search::SelectFindKernels().generic;
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(generic(corpus.text, kRareNeedle, false));
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    void BenchPatternSet(benchmark::State &state, const Corpus &corpus)
+    {
+        const Search::PatternSet patterns(corpus.sample);
+        for (auto _ : state)
+        {
+            size_t hits = 0;
+            patterns.ForEachMatch(corpus.text, [&](size_t, size_t, size_t)
+                                  { hits++; });
+            benchmark::DoNotOptimize(hits);
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    void BenchCountNewlines(benchmark::State &state, const Corpus &corpus)
+    {
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(Search::CountNewlines(corpus.text));
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    // The chunk loop as SearchInFile runs it: StreamWindows copies the
+    // corpus in kChunkSize pieces and ChunkScanner carries the overlap and
+    // works out lines and columns. The common needle stresses the latter.
+    template <typename Matcher>
+    void BenchChunkScanner(benchmark::State &state, const Corpus &corpus, const Matcher &matcher, bool whole_line)
+    {
+        for (auto _ : state)
+        {
+            Search::HitCounter hits(0);
+            Search::SearchResult result("corpus");
+            Search::ChunkScanner<Matcher> scanner(matcher, Search::ScanOptions{whole_line}, result, hits, true);
+            size_t position = 0;
+            Search::StreamWindows([&](char *destination, size_t capacity)
+            {
+                const size_t bytes = std::min(capacity, corpus.text.size() - position);
+                std::memcpy(destination, corpus.text.data() + position, bytes);
+                position += bytes;
+                return bytes;
+            }, [&](std::string_view window, size_t carried)
+            { return scanner.Scan(window, carried); });
+            benchmark::DoNotOptimize(result.Count());
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    // Output bytes per second of each inflate backend over the same stream.
+    void BenchInflateZlib(benchmark::State &state, const Corpus &corpus)
+    {
+        std::string inflated(corpus.text.size(), '\0');
+        for (auto _ : state)
+        {
+            z_stream stream{};
+            inflateInit2(&stream, -MAX_WBITS);
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(corpus.compressed.data()));
+            stream.avail_in = static_cast<uInt>(corpus.compressed.size());
+            stream.next_out = reinterpret_cast<Bytef *>(inflated.data());
+            stream.avail_out = static_cast<uInt>(inflated.size());
+            if (inflate(&stream, Z_FINISH) != Z_STREAM_END)
+                state.SkipWithError("inflate failed");
+            inflateEnd(&stream);
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+#ifdef SEARCH_HAVE_LIBDEFLATE
+    void BenchInflateLibdeflate(benchmark::State &state, const Corpus &corpus)
+    {
+        std::string inflated(corpus.text.size(), '\0');
+        for (auto _ : state)
+        {
+            Search::InflateWithLibdeflate(corpus.compressed, inflated.data(), inflated.size());
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+#endif
+
+#ifdef SEARCH_HAVE_ISAL
+    void BenchInflateIsal(benchmark::State &state, const Corpus &corpus)
+    {
+        std::string inflated(corpus.text.size(), '\0');
+        for (auto _ : state)
+        {
+            Search::InflateWithIsal(corpus.compressed, inflated.data(), inflated.size());
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+#endif
+
+    // Lines hashed per second by the multi-buffer digests of build-index
+    // --hashes.
+    void BenchLineDigester(benchmark::State &state, const Corpus &corpus, Search::DigestAlgorithm algorithm)
+    {
+        for (auto _ : state)
+        {
+            Search::LineDigester digester(algorithm);
+            uint64_t checksum = 0;
+            auto emit = [&](const uint8_t *digest, uint64_t)
+            { checksum += digest[0]; };
+            uint64_t number = 0;
+            for (size_t begin = 0; begin < corpus.text.size();)
+            {
+                const size_t end = std::min(corpus.text.find('\n', begin), corpus.text.size());
+                digester.Add(std::string_view(corpus.text).substr(begin, end - begin), number++, emit);
+                begin = end + 1;
+            }
+            digester.Flush(emit);
+            benchmark::DoNotOptimize(checksum);
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    void BenchSearchInFile(benchmark::State &state, const Corpus &corpus, const std::string &zip_filename,
+                           const std::string &entry_name)
+    {
+        const Search::KeywordMatcher matcher(kRareNeedle);
+        const Search::ZipIndex index = Search::CreateZipIndex(zip_filename);
+        const auto entry = std::find_if(index.begin(), index.end(), [&](const Search::ZipEntry &e)
+                                        { return e.name == entry_name; });
+        Search::ZipArchive archive(zip_filename);
+        for (auto _ : state)
+        {
+            Search::HitCounter hits(0);
+            benchmark::DoNotOptimize(Search::SearchInFile(archive, entry->name, entry->info, matcher, {}, hits).Count());
+        }
+        SetThroughput(state, corpus.text.size());
+    }
+
+    void Register(const Corpus &corpus, const std::string &zip_filename)
+    {
+        const std::string suffix = "/" + corpus.name;
+        auto add = [&](const std::string &name, auto fn)
+        {
+            benchmark::RegisterBenchmark((name + suffix).c_str(), fn)->Unit(benchmark::kMillisecond);
+        };
+
+        add("BoyerMoore", [&](benchmark::State &s) { BenchBoyerMoore(s, corpus); });
+        add("FindAll", [&](benchmark::State &s) { BenchFindAll(s, corpus, false); });
+        add("FindAllFolded", [&](benchmark::State &s) { BenchFindAll(s, corpus, true); });
+        add("FindAllGeneric", [&](benchmark::State &s) { BenchFindAllGeneric(s, corpus); });
+        add("PatternSet100", [&](benchmark::State &s) { BenchPatternSet(s, corpus); });
+        add("CountNewlines", [&](benchmark::State &s) { BenchCountNewlines(s, corpus); });
+        add("ChunkScannerRare", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::KeywordMatcher(kRareNeedle), false); });
+        add("ChunkScannerCommon", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::KeywordMatcher(kCommonNeedle), false); });
+        add("ChunkScannerWholeLine", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::KeywordMatcher(kCommonNeedle), true); });
+        // With and without a literal the SIMD kernel can prefilter on.
+        add("RegexLiteral", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::RegexMatcher("^dragon20[0-9]{2}$"), false); });
+        add("RegexDfa", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::RegexMatcher("[0-9]{4}!"), false); });
+        // Split into line spans; the length filter rejects most lines unread.
+        add("LinePrefix", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::LineMatcher("dragon", Search::LineMatch::Prefix), false); });
+        add("LineLength", [&](benchmark::State &s)
+            { BenchChunkScanner(s, corpus, Search::LineMatcher("", Search::LineMatch::Prefix, 32, 40), false); });
+        add("InflateZlib", [&](benchmark::State &s) { BenchInflateZlib(s, corpus); });
+#ifdef SEARCH_HAVE_LIBDEFLATE
+        add("InflateLibdeflate", [&](benchmark::State &s) { BenchInflateLibdeflate(s, corpus); });
+#endif
+#ifdef SEARCH_HAVE_ISAL
+        add("InflateIsal", [&](benchmark::State &s) { BenchInflateIsal(s, corpus); });
+#endif
+        for (const Search::DigestAlgorithm algorithm : Search::kDigestAlgorithms)
+        {
+            add("Digest/" + std::string(Search::DigestName(algorithm)), [&corpus, algorithm](benchmark::State &s)
+                { BenchLineDigester(s, corpus, algorithm); });
+        }
+        add("SearchInFileStored", [&](benchmark::State &s)
+            { BenchSearchInFile(s, corpus, zip_filename, corpus.name + ".stored"); });
+        add("SearchInFileDeflated", [&](benchmark::State &s)
+            { BenchSearchInFile(s, corpus, zip_filename, corpus.name + ".deflated"); });
+    }
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    try
+    {
+        std::vector<Corpus> corpora;
+        corpora.push_back(MakeCorpus("synthetic", MakeSyntheticCorpus()));
+        if (const char *filename = std::getenv("SEARCH_BENCH_CORPUS"))
+        {
+            corpora.push_back(MakeCorpus("real", ReadCorpus(filename)));
+        }
+
+        const std::string zip_filename = (std::filesystem::temp_directory_path() / "search_bench.zip").string();
+        {
+            ZipWriter zip(zip_filename);
+            for (const Corpus &corpus : corpora)
+            {
+                zip.Add(corpus.name + ".stored", corpus.text, corpus.compressed, 0);
+                zip.Add(corpus.name + ".deflated", corpus.text, corpus.compressed, Z_DEFLATED);
+            }
+        }
+        for (const Corpus &corpus : corpora)
+        {
+            Register(corpus, zip_filename);
+        }
+
+        benchmark::RunSpecifiedBenchmarks();
+        benchmark::Shutdown();
+        std::filesystem::remove(zip_filename);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,989 @@
+// The search command line: its flags, and the output of what libsearch
+// finds in the --format they ask for.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "SearchInternal.h"
+
+namespace Search
+{
+
+    bool case_insensitive = false;
+    bool whole_line = false;
+
+    enum class OutputFormat
+    {
+        Text,
+        Jsonl,
+        Tsv,
+        CountOnly,
+    };
+    OutputFormat output_format = OutputFormat::Text;
+    uint64_t checkpoint_span = 0; // 0 searches every entry with a single thread
+    uint64_t max_count = 0;       // 0 reports every occurrence
+    bool exists_only = false;
+    bool print_stats = false;
+    size_t prefetch_blocks = 0; // reads of kPrefetchBlockSize kept ahead of inflate, 0 for none
+    size_t thread_count = 0; // 0 runs one worker per allowed CPU
+    bool pin_threads = false;
+    bool verify_inputs = false;
+    bool count_unique = false; // --unique: also count the distinct matching lines
+    constexpr size_t kOutputBatchSize = 1024 * 1024; // formatted bytes handed to stdout at once
+
+    void PrintHeader()
+    {
+        const char *kAsciiArt = R"(
+ ____   ___   ____ _  ____   __ ___  _   _ ____   ___ ____  _  _
+|  _ \ / _ \ / ___| |/ /\ \ / // _ \| | | |___ \ / _ \___ \| || |
+| |_) | | | | |   | ' /  \ V /| | | | | | | __) | | | |__) | || |_
+|  _ <| |_| | |___| . \   | | | |_| | |_| |/ __/| |_| / __/|__   _|
+|_| \_\\___/ \____|_|\_\  |_|  \___/ \___/|_____|\___/_____|  |_|
+
+© 2024 Volker Schwaberow <volker@schwaberow.de>
+Based on rockyou2024 cpp by Mike Madden
+
+)";
+
+        std::cout << "\033[1;34m"; // Set text color to bright blue
+        for (size_t i = 0; kAsciiArt[i] != '\0'; ++i)
+        {
+            std::cout << kAsciiArt[i] << std::flush;
+            std::this_thread::sleep_for(std::chrono::milliseconds(3));
+        }
+        std::cout << "\033[0m";
+        std::cout << "Press Enter to continue...";
+        std::cin.get();
+    }
+
+    void PrintUsage(const char *program_name)
+    {
+        std::cout << "Usage: " << program_name << " <input>... <keyword> [-i]\n"
+                  << "  or:  " << program_name << " <input>... <regex> --regex [-i]\n"
+                  << "  or:  " << program_name << " <input>... --patterns-file <file> [-i]\n"
+                  << "  or:  " << program_name << " <input>... <keyword> --line=exact|prefix|suffix\n"
+                  << "                   [--min-len <n>] [--max-len <n>] [-i]\n"
+                  << "  or:  " << program_name << " --interactive\n"
+                  << "  or:  " << program_name << " build-index <zip_file> [index_file] [--fpr=<rate>] [--trigrams]\n"
+                  << "                   [--hashes=ntlm,md5,sha1]\n"
+                  << "  or:  " << program_name << " convert <zip_file> [store_file]\n"
+                  << "  or:  " << program_name << " lookup <index_file|store_file> <password>\n"
+                  << "  or:  " << program_name << " lookup <index_file|store_file> --batch <file> [--threads <n>]\n"
+                  << "  or:  " << program_name << " lookup <index_file> --hash <hex_digest>\n"
+                  << "  or:  " << program_name << " find <index_file> <text>\n"
+                  << "  or:  " << program_name << " serve <index_file> [socket_path] [--threads <n>] [--pin]\n\n"
+                  << "Inputs are zip archives or text files, plain, gzip or zstd compressed;\n"
+                  << "'*' and '?' in a file name match the files of its directory.\n\n"
+                  << "Options:\n"
+                  << "  --interactive    Run in interactive mode\n"
+                  << "  --patterns-file  Search for every line of <file> in a single pass\n"
+                  << "  --checkpoints[=MB]\n"
+                  << "                   Split large deflated entries at inflate checkpoints\n"
+                  << "                   (default every 32 MB, cached in <zip_file>.ckpt) and\n"
+                  << "                   search the pieces in parallel\n"
+                  << "  --whole-line     Print the whole matching line instead of its surroundings\n"
+                  << "  --regex          Treat the keyword as an extended regular expression,\n"
+                  << "                   matched against each line\n"
+                  << "  --line=<mode>    Match lines that equal (exact), start with (prefix) or\n"
+                  << "                   end with (suffix) the keyword, which may be empty\n"
+                  << "  --min-len <n>    With --line, only match lines of at least <n> bytes\n"
+                  << "  --max-len <n>    With --line, only match lines of at most <n> bytes\n"
+                  << "  --unique         Also count the distinct lines that hold a match\n"
+                  << "  --format=<fmt>   Output as text (default), jsonl, tsv or count-only; the\n"
+                  << "                   machine-readable formats print the summary to stderr\n"
+                  << "  --fpr=<rate>     False-positive rate of the filter build-index writes to\n"
+                  << "                   <index_file>.bloom (default 0.01)\n"
+                  << "  --trigrams       Also write a trigram index to <index_file>.tri, which\n"
+                  << "                   find uses to answer substring queries\n"
+                  << "  --batch <file>   Look up every line of <file>, printing those found\n"
+                  << "  --hashes=<list>  Also write NTLM, MD5 or SHA-1 digest tables of every indexed\n"
+                  << "                   line to <index_file>.<algorithm>, for lookup --hash\n"
+                  << "  --max-count <n>  Stop after <n> occurrences\n"
+                  << "  --exists         Print nothing; exit with 0 if the keyword occurs, else 1\n"
+                  << "  --stats          Print per-worker timings and counters after the search\n"
+                  << "  --threads <n>    Search with <n> worker threads (default: one per CPU the\n"
+                  << "                   process may use); also for serve, lookup and build-index\n"
+                  << "  --pin            Bind each worker to one CPU, filling a NUMA node first\n"
+                  << "  --prefetch[=MB]  Read compressed archive data ahead of inflate with io_uring\n"
+                  << "                   or a readahead thread (default 16 MB per worker)\n"
+                  << "  --verify         Check each input against <input>.b3sum with BLAKE3 while\n"
+                  << "                   searching; exit with 2 on a mismatch\n"
+                  << "  -i               Perform case-insensitive search\n"
+                  << "  --               Treat every later argument as an input or the keyword,\n"
+                  << "                   or for lookup as a password, even if it starts with '-'\n"
+                  << "  --help           Display this help message\n";
+    }
+
+    // Whether an argument no option matched was meant as one: a long option
+    // such as "--name" or "--name=value", or a dash and a single letter.
+    // Other arguments starting with '-', such as "-1" or "-password-", are
+    // keywords or file names.
+    bool LooksLikeOption(std::string_view arg)
+    {
+        auto is_letter = [](char c)
+        { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); };
+        if (arg.starts_with("--"))
+            return arg.size() > 2 && is_letter(arg[2]);
+        return arg.size() == 2 && arg[0] == '-' && is_letter(arg[1]);
+    }
+
+    // Progress and summary lines go to stderr when stdout carries records.
+    std::ostream &StatusStream()
+    {
+        return (output_format == OutputFormat::Text) ? std::cout : std::cerr;
+    }
+
+    size_t ParseThreadCount(const std::string &text)
+    {
+        const unsigned long long count = std::stoull(text);
+        if (count == 0 || count > 4096)
+        {
+            throw std::runtime_error("--threads must be between 1 and 4096");
+        }
+        return static_cast<size_t>(count);
+    }
+
+    // The text format prints the count of an entry before its matches, so
+    // only the others can report an entry before all of it is searched.
+    ScanOptions CommandLineScanOptions()
+    {
+        const bool streamed = output_format == OutputFormat::Jsonl || output_format == OutputFormat::Tsv;
+        return {whole_line, output_format == OutputFormat::CountOnly, max_count, count_unique, prefetch_blocks, streamed};
+    }
+
+
+    // Writes pre-formatted buffers to stdout from a dedicated thread, so
+    // workers never wait for the terminal. Producers push onto a lock-free
+    // stack; the writer takes the whole stack in one exchange, restores the
+    // push order and writes it out in large batches. Producers only wait
+    // when kMaxQueuedBytes are already queued, which bounds the memory a
+    // slow reader of stdout can tie up.
+    class OutputSink
+    {
+    public:
+        OutputSink()
+        {
+            std::cout.flush();
+            writer_ = std::thread([this]
+                                  { Run(); });
+        }
+
+        ~OutputSink()
+        {
+            Close();
+        }
+
+        OutputSink(const OutputSink &) = delete;
+        OutputSink &operator=(const OutputSink &) = delete;
+
+        void Push(std::string buffer)
+        {
+            for (size_t queued; (queued = queued_.load(std::memory_order_acquire)) > kMaxQueuedBytes;)
+            {
+                queued_.wait(queued, std::memory_order_acquire);
+            }
+            queued_.fetch_add(buffer.size(), std::memory_order_relaxed);
+            Node *node = new Node{std::move(buffer), head_.load(std::memory_order_relaxed)};
+            while (!head_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                std::memory_order_relaxed))
+            {
+            }
+            head_.notify_one();
+        }
+
+        // Writes everything pushed so far and stops the writer.
+        void Close()
+        {
+            if (!writer_.joinable())
+                return;
+            closed_.store(true, std::memory_order_release);
+            Push({}); // wakes the writer if it is waiting
+            writer_.join();
+        }
+
+        // Only meaningful once the sink is closed.
+        uint64_t BytesWritten() const { return bytes_written_; }
+        double WriteSeconds() const { return write_seconds_; }
+
+    private:
+        static constexpr size_t kBatchSize = 1024 * 1024;
+        static constexpr size_t kMaxQueuedBytes = 64 * 1024 * 1024;
+
+        struct Node
+        {
+            std::string data;
+            Node *next;
+        };
+
+        void Run()
+        {
+            std::string batch;
+            batch.reserve(kBatchSize);
+            while (true)
+            {
+                Node *list = head_.exchange(nullptr, std::memory_order_acquire);
+                if (!list)
+                {
+                    if (closed_.load(std::memory_order_acquire))
+                        break;
+                    head_.wait(nullptr, std::memory_order_acquire);
+                    continue;
+                }
+
+                const auto write_start = std::chrono::steady_clock::now();
+                Node *ordered = nullptr;
+                size_t taken = 0;
+                while (list)
+                {
+                    taken += list->data.size();
+                    Node *next = list->next;
+                    list->next = ordered;
+                    ordered = list;
+                    list = next;
+                }
+                while (ordered)
+                {
+                    if (batch.size() + ordered->data.size() > kBatchSize)
+                    {
+                        WriteAll(batch);
+                        batch.clear();
+                    }
+                    if (ordered->data.size() > kBatchSize)
+                        WriteAll(ordered->data);
+                    else
+                        batch += ordered->data;
+                    delete std::exchange(ordered, ordered->next);
+                }
+                WriteAll(batch);
+                batch.clear();
+                bytes_written_ += taken;
+                write_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - write_start).count();
+                queued_.fetch_sub(taken, std::memory_order_release);
+                queued_.notify_all();
+            }
+        }
+
+        static void WriteAll(std::string_view data)
+        {
+            while (!data.empty())
+            {
+#ifdef _WIN32
+                const int written = _write(1, data.data(), static_cast<unsigned int>(std::min<size_t>(data.size(), INT_MAX)));
+#else
+                const ssize_t written = ::write(STDOUT_FILENO, data.data(), data.size());
+#endif
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return; // stdout is gone; there is nobody left to tell
+                }
+                data.remove_prefix(static_cast<size_t>(written));
+            }
+        }
+
+        std::atomic<Node *> head_{nullptr};
+        std::atomic<size_t> queued_{0}; // bytes pushed but not yet written
+        std::atomic<bool> closed_{false};
+        std::thread writer_;
+        uint64_t bytes_written_ = 0; // owned by the writer thread
+        double write_seconds_ = 0;
+    };
+
+    // Quotes a string for JSON. Bytes above 0x7F are passed through as they
+    // are, since the wordlists are not guaranteed to be UTF-8.
+    void AppendJsonString(std::string &out, std::string_view text)
+    {
+        out += '"';
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                    out += escaped;
+                }
+                else
+                {
+                    out += c;
+                }
+            }
+        }
+        out += '"';
+    }
+
+    // Escapes the field separators of TSV with backslash sequences.
+    void AppendTsvField(std::string &out, std::string_view text)
+    {
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                out += c;
+            }
+        }
+    }
+
+    // Starts the output of an entry with `count` occurrences: the header
+    // line of the text format, or the whole record of count-only.
+    void AppendEntryHeader(std::string &out, std::string_view filename, uint64_t count)
+    {
+        switch (output_format)
+        {
+        case OutputFormat::Text:
+            out += "Occurrences in \"";
+            out += filename;
+            out += "\": " + std::to_string(count) + '\n';
+            break;
+        case OutputFormat::CountOnly:
+            AppendTsvField(out, filename);
+            out += '\t' + std::to_string(count) + '\n';
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Renders one occurrence in the selected output format.
+    void AppendOccurrence(std::string &out, std::string_view filename, const Occurrence &occurrence,
+                          std::string_view context, const QueryMatcher &matcher)
+    {
+        const std::string_view pattern = matcher.Pattern(occurrence.pattern);
+        switch (output_format)
+        {
+        case OutputFormat::Text:
+            out += "  Line " + std::to_string(occurrence.line) + ", Column " + std::to_string(occurrence.col);
+            if (matcher.PatternCount() > 1)
+            {
+                out += " [";
+                out += pattern;
+                out += ']';
+            }
+            out += ": ";
+            out += context;
+            out += '\n';
+            break;
+        case OutputFormat::Jsonl:
+            out += "{\"file\":";
+            AppendJsonString(out, filename);
+            out += ",\"line\":" + std::to_string(occurrence.line) + ",\"column\":" + std::to_string(occurrence.col) +
+                   ",\"pattern\":";
+            AppendJsonString(out, pattern);
+            out += ",\"context\":";
+            AppendJsonString(out, context);
+            out += "}\n";
+            break;
+        case OutputFormat::Tsv:
+            AppendTsvField(out, filename);
+            out += '\t' + std::to_string(occurrence.line) + '\t' + std::to_string(occurrence.col) + '\t';
+            AppendTsvField(out, pattern);
+            out += '\t';
+            AppendTsvField(out, context);
+            out += '\n';
+            break;
+        case OutputFormat::CountOnly:
+            break;
+        }
+    }
+
+    // Peak resident set size of the process so far, or 0 if unknown.
+    uint64_t PeakRssBytes()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return counters.PeakWorkingSetSize;
+        return 0;
+#else
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+#ifdef __APPLE__
+        return static_cast<uint64_t>(usage.ru_maxrss); // bytes on macOS
+#else
+        return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // kilobytes elsewhere
+#endif
+#endif
+    }
+
+    // Prints the --stats table: one row per worker thread, then the total,
+    // then the output thread and the process as a whole.
+    void PrintStats(std::ostream &status, const std::vector<WorkerStats> &workers, const OutputSink &sink,
+                    double wall_time)
+    {
+        constexpr double kMiB = 1024.0 * 1024.0;
+        auto print_row = [&](const std::string &name, const WorkerStats &stats)
+        {
+            status << std::left << std::setw(8) << name << std::right
+                   << std::setw(7) << stats.tasks << std::setw(9) << stats.entries
+                   << std::fixed << std::setprecision(1)
+                   << std::setw(12) << stats.bytes_inflated / kMiB << std::setw(12) << stats.bytes_scanned / kMiB
+                   << std::setprecision(3)
+                   << std::setw(10) << stats.inflate_seconds << std::setw(10) << stats.search_seconds
+                   << std::setw(10) << stats.output_seconds << std::setw(10) << stats.lock_wait_seconds << '\n'
+                   << std::defaultfloat << std::setprecision(6);
+        };
+
+        status << "Worker    tasks  entries  read (MiB)  scan (MiB) inflate s  search s  output s    lock s\n";
+        WorkerStats total;
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            const WorkerStats &stats = workers[i];
+            print_row(std::to_string(i), stats);
+            total.tasks += stats.tasks;
+            total.entries += stats.entries;
+            total.bytes_inflated += stats.bytes_inflated;
+            total.bytes_scanned += stats.bytes_scanned;
+            total.inflate_seconds += stats.inflate_seconds;
+            total.search_seconds += stats.search_seconds;
+            total.output_seconds += stats.output_seconds;
+            total.lock_wait_seconds += stats.lock_wait_seconds;
+        }
+        print_row("total", total);
+        status << std::fixed << std::setprecision(3)
+               << "Output thread: " << sink.BytesWritten() / kMiB << " MiB written in " << sink.WriteSeconds()
+               << " s\n"
+               << "Scan rate: " << (wall_time > 0 ? total.bytes_scanned / kMiB / wall_time : 0.0) << " MiB/s\n"
+               << "Peak RSS: " << PeakRssBytes() / kMiB << " MiB\n"
+               << std::defaultfloat << std::setprecision(6);
+    }
+
+    // Searches every entry of the archives among `filenames`, and every
+    // text input as a whole, prints the occurrences in the --format and a
+    // summary, and returns how many occurrences were reported.
+    uint64_t SearchInputs(const std::vector<std::string> &filenames, const QueryMatcher &matcher,
+                          InputScanner &scanner)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        const ScanOptions options = CommandLineScanOptions();
+        std::vector<std::atomic<uint64_t>> pattern_counts(matcher.PatternCount());
+        const bool multi_pattern = matcher.PatternCount() > 1;
+
+        std::vector<WorkerStats> stats(print_stats ? scanner.WorkerCount() : 0);
+        OutputSink sink;
+
+        // Streams each entry out in batches.
+        auto print_entry = [&](const EntryReport &entry)
+        {
+            if (exists_only)
+                return;
+            std::string out;
+            AppendEntryHeader(out, entry.Name(), entry.Count());
+            entry.ForEachOccurrence([&](const Occurrence &occurrence, std::string_view context)
+            {
+                pattern_counts[occurrence.pattern].fetch_add(1, std::memory_order_relaxed);
+                AppendOccurrence(out, entry.Name(), occurrence, context, matcher);
+                if (out.size() >= kOutputBatchSize)
+                    sink.Push(std::exchange(out, {}));
+            });
+            if (!out.empty())
+                sink.Push(std::move(out));
+        };
+        auto print_error = [](const std::string &file_name, const std::exception &e)
+        {
+            std::cerr << "Error processing file \"" << file_name << "\": " << e.what() << '\n';
+        };
+        const ScanSummary summary = scanner.Scan(filenames, matcher, options, checkpoint_span, StatusStream(), stats,
+                                                 print_entry, print_error);
+        const uint64_t reported = summary.reported;
+        sink.Close();
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double> wall_time = end_time - start_time;
+
+        if (exists_only)
+            return reported;
+
+        std::ostream &status = StatusStream();
+        if (multi_pattern)
+        {
+            for (size_t i = 0; i < pattern_counts.size(); ++i)
+            {
+                if (pattern_counts[i] > 0)
+                    status << "Occurrences of \"" << matcher.Pattern(i) << "\": " << pattern_counts[i] << '\n';
+            }
+        }
+        status << "Search complete. Total occurrences: " << reported;
+        if (summary.stopped)
+            status << " (stopped at --max-count " << max_count << ')';
+        status << '\n';
+        if (count_unique)
+            status << "Unique matching lines: " << summary.unique_lines << '\n';
+        status << "Time taken: " << wall_time.count() << " seconds\n";
+        if (print_stats)
+            PrintStats(status, stats, sink, wall_time.count());
+        return reported;
+    }
+
+    // Prints every line of a sorted index containing `needle` through the
+    // usual result output.
+    uint64_t PrintIndexMatches(const std::string &index_filename, const std::string &needle)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        const QueryMatcher matcher(needle, {});
+        const uint64_t count = FindInIndex(index_filename, needle, [&](const EntryReport &entry)
+        {
+            std::string out;
+            AppendEntryHeader(out, entry.Name(), entry.Count());
+            entry.ForEachOccurrence([&](const Occurrence &occurrence, std::string_view context)
+            {
+                AppendOccurrence(out, entry.Name(), occurrence, context, matcher);
+                if (out.size() >= kOutputBatchSize)
+                {
+                    std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+                    out.clear();
+                }
+            });
+            std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+        });
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double, std::milli> elapsed = end_time - start_time;
+        StatusStream() << "Time taken: " << elapsed.count() << " ms\n";
+        return count;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        if (argc >= 3 && std::strcmp(argv[1], "build-index") == 0)
+        {
+            std::vector<std::string> arguments;
+            double false_positive_rate = Search::kDefaultFalsePositiveRate;
+            bool build_trigrams = false;
+            std::vector<Search::DigestAlgorithm> digest_algorithms;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string_view arg = argv[i];
+                if (arg.starts_with("--fpr="))
+                {
+                    false_positive_rate = std::stod(std::string(arg.substr(6)));
+                    if (!(false_positive_rate > 0 && false_positive_rate < 1))
+                    {
+                        throw std::runtime_error("False-positive rate must be between 0 and 1");
+                    }
+                }
+                else if (arg == "--trigrams")
+                    build_trigrams = true;
+                else if (arg == "--threads" && i + 1 < argc)
+                    Search::thread_count = Search::ParseThreadCount(argv[++i]);
+                else if (arg == "--pin")
+                    Search::pin_threads = true;
+                else if (arg.starts_with("--hashes="))
+                {
+                    for (size_t begin = 9; begin <= arg.size();)
+                    {
+                        const size_t end = std::min(arg.find(',', begin), arg.size());
+                        digest_algorithms.push_back(Search::ParseDigestAlgorithm(arg.substr(begin, end - begin)));
+                        begin = end + 1;
+                    }
+                }
+                else
+                    arguments.emplace_back(arg);
+            }
+            if (arguments.empty() || arguments.size() > 2)
+            {
+                Search::PrintUsage(argv[0]);
+                return 1;
+            }
+
+            const std::string &zip_filename = arguments[0];
+            if (!std::filesystem::exists(zip_filename))
+            {
+                throw std::runtime_error("File does not exist: " + zip_filename);
+            }
+            const std::string index_filename = arguments.size() == 2 ? arguments[1] : zip_filename + ".idx";
+            Search::BuildIndex(zip_filename, index_filename, false_positive_rate, build_trigrams);
+            if (!digest_algorithms.empty())
+                Search::BuildDigestTables(index_filename, digest_algorithms, Search::thread_count, Search::pin_threads);
+            return 0;
+        }
+        if (argc >= 3 && argc <= 4 && std::strcmp(argv[1], "convert") == 0)
+        {
+            const std::string zip_filename = argv[2];
+            if (!std::filesystem::exists(zip_filename))
+            {
+                throw std::runtime_error("File does not exist: " + zip_filename);
+            }
+            Search::ConvertToStore(zip_filename, argc == 4 ? argv[3] : Search::StoreFilename(zip_filename));
+            return 0;
+        }
+        if (argc >= 4 && std::strcmp(argv[1], "lookup") == 0)
+        {
+            std::vector<std::string> arguments;
+            std::string batch_filename;
+            std::string digest;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string_view arg = argv[i];
+                if (arg == "--")
+                {
+                    arguments.insert(arguments.end(), argv + i + 1, argv + argc);
+                    break;
+                }
+                if (arg == "--batch" && i + 1 < argc)
+                    batch_filename = argv[++i];
+                else if (arg == "--hash" && i + 1 < argc)
+                    digest = argv[++i];
+                else if (arg == "--threads" && i + 1 < argc)
+                    Search::thread_count = Search::ParseThreadCount(argv[++i]);
+                else if (arg == "--pin")
+                    Search::pin_threads = true;
+                else
+                    arguments.emplace_back(arg);
+            }
+            if (!batch_filename.empty() && digest.empty() && arguments.size() == 1)
+                return Search::LookupBatch(arguments[0], batch_filename, Search::thread_count, Search::pin_threads) > 0
+                           ? 0
+                           : 1;
+            if (!digest.empty() && batch_filename.empty() && arguments.size() == 1)
+                return Search::LookupDigest(arguments[0], digest) ? 0 : 1;
+            if (!batch_filename.empty() || !digest.empty() || arguments.size() != 2)
+            {
+                Search::PrintUsage(argv[0]);
+                return 1;
+            }
+            if (Search::IsPasswordStore(arguments[0]))
+                return Search::LookupInStore(arguments[0], arguments[1]) ? 0 : 1;
+            return Search::LookupInIndex(arguments[0], arguments[1]) ? 0 : 1;
+        }
+        if (argc == 4 && std::strcmp(argv[1], "find") == 0)
+        {
+            return Search::PrintIndexMatches(argv[2], argv[3]) > 0 ? 0 : 1;
+        }
+        if (argc >= 3 && std::strcmp(argv[1], "serve") == 0)
+        {
+            std::vector<std::string> arguments;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string_view arg = argv[i];
+                if (arg == "--threads" && i + 1 < argc)
+                    Search::thread_count = Search::ParseThreadCount(argv[++i]);
+                else if (arg == "--pin")
+                    Search::pin_threads = true;
+                else
+                    arguments.emplace_back(arg);
+            }
+            if (arguments.empty() || arguments.size() > 2)
+            {
+                Search::PrintUsage(argv[0]);
+                return 1;
+            }
+            Search::Serve(arguments[0], arguments.size() == 2 ? arguments[1] : arguments[0] + ".sock",
+                          Search::thread_count, Search::pin_threads);
+            return 0;
+        }
+
+        std::string keyword;
+        std::vector<std::string> filenames;
+        std::string patterns_filename;
+        bool interactive = false;
+        bool regex = false;
+        bool line_mode = false;
+        Search::QueryKind line_kind = Search::QueryKind::LineExact;
+        size_t min_length = 0;
+        size_t max_length = SIZE_MAX;
+        std::vector<std::string> positional;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (arg == "--")
+            {
+                // Everything after it is an input or the keyword.
+                positional.insert(positional.end(), argv + i + 1, argv + argc);
+                break;
+            }
+            if (arg == "--interactive")
+            {
+                interactive = true;
+            }
+            else if (arg == "-i")
+            {
+                Search::case_insensitive = true;
+            }
+            else if (arg == "--whole-line")
+            {
+                Search::whole_line = true;
+            }
+            else if (arg == "--regex")
+            {
+                regex = true;
+            }
+            else if (arg.starts_with("--line="))
+            {
+                const std::string_view mode = arg.substr(7);
+                if (mode == "exact")
+                    line_kind = Search::QueryKind::LineExact;
+                else if (mode == "prefix")
+                    line_kind = Search::QueryKind::LinePrefix;
+                else if (mode == "suffix")
+                    line_kind = Search::QueryKind::LineSuffix;
+                else
+                    throw std::runtime_error("Unknown line match: " + std::string(mode));
+                line_mode = true;
+            }
+            else if (arg == "--min-len" && i + 1 < argc)
+            {
+                min_length = std::stoull(argv[++i]);
+            }
+            else if (arg == "--max-len" && i + 1 < argc)
+            {
+                max_length = std::stoull(argv[++i]);
+            }
+            else if (arg == "--unique")
+            {
+                Search::count_unique = true;
+            }
+            else if (arg.starts_with("--format="))
+            {
+                const std::string_view format = arg.substr(9);
+                if (format == "text")
+                    Search::output_format = Search::OutputFormat::Text;
+                else if (format == "jsonl")
+                    Search::output_format = Search::OutputFormat::Jsonl;
+                else if (format == "tsv")
+                    Search::output_format = Search::OutputFormat::Tsv;
+                else if (format == "count-only")
+                    Search::output_format = Search::OutputFormat::CountOnly;
+                else
+                    throw std::runtime_error("Unknown output format: " + std::string(format));
+            }
+            else if (arg == "--patterns-file" && i + 1 < argc)
+            {
+                patterns_filename = argv[++i];
+            }
+            else if (arg == "--max-count" && i + 1 < argc)
+            {
+                Search::max_count = std::stoull(argv[++i]);
+                if (Search::max_count == 0)
+                {
+                    throw std::runtime_error("--max-count must be at least 1");
+                }
+            }
+            else if (arg == "--exists")
+            {
+                Search::exists_only = true;
+            }
+            else if (arg == "--stats")
+            {
+                Search::print_stats = true;
+            }
+            else if (arg == "--threads" && i + 1 < argc)
+            {
+                Search::thread_count = Search::ParseThreadCount(argv[++i]);
+            }
+            else if (arg == "--pin")
+            {
+                Search::pin_threads = true;
+            }
+            else if (arg == "--verify")
+            {
+#ifndef SEARCH_HAVE_BLAKE3
+                throw std::runtime_error("--verify needs a build with -DSEARCH_BLAKE3=ON");
+#endif
+                Search::verify_inputs = true;
+            }
+            else if (arg == "--prefetch")
+            {
+                Search::prefetch_blocks = Search::kDefaultPrefetchSize / Search::kPrefetchBlockSize;
+            }
+            else if (arg.starts_with("--prefetch="))
+            {
+                const uint64_t size = std::stoull(std::string(arg.substr(11))) * 1024 * 1024;
+                Search::prefetch_blocks = std::max<uint64_t>(size / Search::kPrefetchBlockSize, 1);
+            }
+            else if (arg == "--checkpoints")
+            {
+                Search::checkpoint_span = Search::kDefaultCheckpointSpan;
+            }
+            else if (arg.starts_with("--checkpoints="))
+            {
+                Search::checkpoint_span = std::stoull(std::string(arg.substr(14))) * 1024 * 1024;
+                if (Search::checkpoint_span == 0)
+                {
+                    throw std::runtime_error("Checkpoint span must be at least 1 MB");
+                }
+            }
+            else if (Search::LooksLikeOption(arg))
+            {
+                Search::PrintUsage(argv[0]);
+                return 1;
+            }
+            else
+            {
+                positional.emplace_back(arg);
+            }
+        }
+
+        if ((min_length > 0 || max_length != SIZE_MAX) && !line_mode)
+        {
+            throw std::runtime_error("--min-len and --max-len need --line");
+        }
+        if (line_mode && (regex || !patterns_filename.empty()))
+        {
+            throw std::runtime_error("--line cannot be combined with --regex or --patterns-file");
+        }
+
+        // --exists only needs the first occurrence and answers with the
+        // exit code.
+        if (Search::exists_only)
+        {
+            Search::max_count = 1;
+        }
+
+        // Machine-readable output is meant for pipes, so skip the banner
+        // and its prompt.
+        if (Search::output_format == Search::OutputFormat::Text && !Search::exists_only)
+        {
+            Search::PrintHeader();
+        }
+
+        if (interactive && positional.empty() && patterns_filename.empty())
+        {
+            std::cout << "Enter the keyword to search: ";
+            std::getline(std::cin, keyword);
+
+            std::cout << "Enter the zip filename to search in: ";
+            std::getline(std::cin, filenames.emplace_back());
+
+            std::cout << "Case-insensitive search? (y/n): ";
+            std::string response;
+            std::getline(std::cin, response);
+            Search::case_insensitive = (response == "y" || response == "Y");
+        }
+        else if (!interactive && positional.size() >= (patterns_filename.empty() ? 2 : 1))
+        {
+            // Every positional argument but the keyword is an input.
+            if (patterns_filename.empty())
+            {
+                keyword = positional.back();
+                positional.pop_back();
+            }
+            filenames = std::move(positional);
+        }
+        else
+        {
+            Search::PrintUsage(argv[0]);
+            return 1;
+        }
+        filenames = Search::ExpandInputs(filenames);
+
+        // One set of workers serves every query of the process.
+        Search::InputScanner scanner(Search::thread_count, Search::pin_threads);
+        auto search = [&](const std::string &query)
+        {
+            if (!patterns_filename.empty())
+            {
+                return Search::SearchInputs(
+                    filenames,
+                    Search::QueryMatcher(Search::ReadPatternsFile(patterns_filename), Search::case_insensitive),
+                    scanner);
+            }
+            Search::QueryOptions options{.case_insensitive = Search::case_insensitive};
+            if (regex)
+                options.kind = Search::QueryKind::Regex;
+            if (line_mode)
+            {
+                options.kind = line_kind;
+                options.min_length = min_length;
+                options.max_length = max_length;
+            }
+            return Search::SearchInputs(filenames, Search::QueryMatcher(query, options), scanner);
+        };
+#ifdef SEARCH_HAVE_BLAKE3
+        // The inputs are hashed while the first search reads them.
+        std::unique_ptr<Search::InputVerifier> verifier;
+        if (Search::verify_inputs)
+            verifier = std::make_unique<Search::InputVerifier>(filenames);
+#endif
+        uint64_t found = search(keyword);
+#ifdef SEARCH_HAVE_BLAKE3
+        if (verifier && !verifier->Finish(Search::exists_only ? nullptr : &Search::StatusStream()))
+            return 2;
+#endif
+
+        // Interactive mode keeps asking for keywords to search the same
+        // files for, until an empty line or the end of input.
+        while (interactive)
+        {
+            std::cout << "\nEnter the next keyword to search (empty to quit): ";
+            if (!std::getline(std::cin, keyword) || keyword.empty())
+                break;
+            found = search(keyword);
+        }
+        if (Search::exists_only)
+        {
+            return found > 0 ? 0 : 1;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
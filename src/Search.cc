@@ -1,393 +1,8037 @@
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <bitset>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <cmath>
+#include <compare>
+#include <csignal>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <list>
 #include <map>
+#include <numeric>
+#include <memory>
 #include <mutex>
+#include <queue>
 #include <span>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_set>
+#include <utility>
+#include <variant>
 #include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if __has_include(<linux/io_uring.h>)
+#define SEARCH_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SEARCH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SEARCH_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Lets a single function use instructions beyond the build's baseline ISA;
+// callers must check CPU support first. MSVC accepts intrinsics without it.
+#if defined(__GNUC__) || defined(__clang__)
+#define SEARCH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SEARCH_TARGET(isa)
+#endif
+
+// Forces a helper into its caller, so that it is compiled for the caller's
+// SEARCH_TARGET too.
+#if defined(__GNUC__) || defined(__clang__)
+#define SEARCH_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define SEARCH_ALWAYS_INLINE inline
+#endif
+
+#include "SearchInternal.h"
 #include "unzip.h"
 #include "zlib.h"
 
+#ifdef SEARCH_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef SEARCH_HAVE_ISAL
+#include <isa-l/igzip_lib.h>
+#endif
+#ifdef SEARCH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SEARCH_HAVE_BLAKE3
+#include <blake3.h>
+#endif
+#if defined(SEARCH_HAVE_LIBDEFLATE) || defined(SEARCH_HAVE_ISAL)
+#define SEARCH_HAVE_WHOLE_INFLATE 1
+#endif
+
 namespace Search
 {
 
-    bool case_insensitive = false;
     constexpr size_t kChunkSize = 1024 * 1024;               // 1 MB
     constexpr size_t kMinFileSizeForMmap = 10 * 1024 * 1024; // 10 MB
     constexpr int kContextSize = 20;
+    constexpr size_t kIndexRunBudget = 512 * 1024 * 1024;    // 512 MB per sorted run
+    constexpr uint64_t kFenceInterval = 256;                 // lines per fence pointer
+    constexpr std::array<char, 8> kIndexMagic = {'R', 'Y', '2', '4', 'I', 'D', 'X', '1'};
+    constexpr size_t kDeflateWindowSize = 32 * 1024;
+    constexpr uint64_t kStoredRangeSize = 32 * 1024 * 1024;       // 32 MB
+    constexpr std::array<char, 8> kCheckpointMagic = {'R', 'Y', '2', '4', 'C', 'K', 'P', '2'};
+    constexpr std::array<char, 8> kBloomMagic = {'R', 'Y', '2', '4', 'B', 'L', 'M', '1'};
+    constexpr std::array<char, 8> kTrigramMagic = {'R', 'Y', '2', '4', 'T', 'R', 'I', '1'};
+    constexpr size_t kMaxWholeInflateSize = 64 * 1024 * 1024; // 64 MB per worker
+    constexpr size_t kResultBufferSize = 4 * 1024 * 1024;     // 4 MB of occurrences in memory per result
+    constexpr size_t kTrigramSegmentPairs = 64 * 1024 * 1024; // (trigram, line) pairs per segment, 512 MB
+    constexpr std::array<char, 8> kStoreMagic = {'R', 'Y', '2', '4', 'S', 'T', 'R', '1'};
+    constexpr size_t kStoreBlockSize = 64 * 1024;             // front-coded bytes per block before compression
+    constexpr std::array<char, 8> kDigestTableMagic = {'R', 'Y', '2', '4', 'H', 'S', 'H', '1'};
+    constexpr std::array<char, 8> kVerifiedMagic = {'R', 'Y', '2', '4', 'V', 'F', 'Y', '1'};
+    constexpr size_t kDigestSize = 32; // BLAKE3 digests in .b3sum files
 
     struct FileInfo
     {
         size_t offset;
         size_t size;
+        size_t compressed_size = 0;
+        int compression_method = Z_DEFLATED;
+        bool encrypted = false;
     };
 
-    struct SearchResult
+    // Temporary file of one result, which moves its buffered occurrences
+    // there once they outgrow kResultBufferSize. It is created in the temp
+    // directory ($TMPDIR, else /tmp) and unlinked at once, so its space is
+    // freed along with the result. Blocks are appended and read back by
+    // offset.
+    class SpillFile
     {
-        std::string filename;
-        std::vector<std::tuple<int, int, std::string>> occurrences;
-    };
+    public:
+        SpillFile()
+        {
+#ifdef _WIN32
+            file_ = std::tmpfile();
+#else
+            std::string path = (std::filesystem::temp_directory_path() / "search.XXXXXX").string();
+            if (const int fd = mkstemp(path.data()); fd >= 0)
+            {
+                unlink(path.c_str());
+                if (!(file_ = fdopen(fd, "w+b")))
+                    close(fd);
+            }
+#endif
+            if (!file_)
+            {
+                throw std::runtime_error("Error creating temporary file for results");
+            }
+        }
 
-    using ZipIndex = std::map<std::string, FileInfo>;
+        ~SpillFile()
+        {
+            std::fclose(file_);
+        }
 
-    void PrintHeader()
-    {
-        const char *kAsciiArt = R"(
- ____   ___   ____ _  ____   __ ___  _   _ ____   ___ ____  _  _
-|  _ \ / _ \ / ___| |/ /\ \ / // _ \| | | |___ \ / _ \___ \| || |
-| |_) | | | | |   | ' /  \ V /| | | | | | | __) | | | |__) | || |_
-|  _ <| |_| | |___| . \   | | | |_| | |_| |/ __/| |_| / __/|__   _|
-|_| \_\\___/ \____|_|\_\  |_|  \___/ \___/|_____|\___/_____|  |_|
+        SpillFile(const SpillFile &) = delete;
+        SpillFile &operator=(const SpillFile &) = delete;
 
-© 2024 Volker Schwaberow <volker@schwaberow.de>
-Based on rockyou2024 cpp by Mike Madden
+        // Writes `first` and then `second` and returns the offset of `first`.
+        uint64_t Append(std::string_view first, std::string_view second)
+        {
+            const uint64_t offset = size_;
+            Seek(offset);
+            if (std::fwrite(first.data(), 1, first.size(), file_) != first.size() ||
+                std::fwrite(second.data(), 1, second.size(), file_) != second.size())
+            {
+                throw std::runtime_error("Error writing temporary file for results");
+            }
+            size_ += first.size() + second.size();
+            return offset;
+        }
 
-)";
+        void Read(uint64_t offset, char *destination, size_t size)
+        {
+            Seek(offset);
+            if (std::fread(destination, 1, size, file_) != size)
+            {
+                throw std::runtime_error("Error reading temporary file for results");
+            }
+        }
 
-        std::cout << "\033[1;34m"; // Set text color to bright blue
-        for (size_t i = 0; kAsciiArt[i] != '\0'; ++i)
+    private:
+        void Seek(uint64_t offset)
         {
-            std::cout << kAsciiArt[i] << std::flush;
-            std::this_thread::sleep_for(std::chrono::milliseconds(3));
+#ifdef _WIN32
+            const int ret = _fseeki64(file_, static_cast<__int64>(offset), SEEK_SET);
+#else
+            const int ret = fseeko(file_, static_cast<off_t>(offset), SEEK_SET);
+#endif
+            if (ret != 0)
+            {
+                throw std::runtime_error("Error seeking in temporary file for results");
+            }
         }
-        std::cout << "\033[0m";
-        std::cout << "Press Enter to continue...";
-        std::cin.get();
-    }
 
-    void PrintUsage(const char *program_name)
-    {
-        std::cout << "Usage: " << program_name << " <zip_file> <keyword> [-i]\n"
-                  << "  or:  " << program_name << " --interactive\n\n"
-                  << "Options:\n"
-                  << "  --interactive    Run in interactive mode\n"
-                  << "  -i               Perform case-insensitive search\n"
-                  << "  --help           Display this help message\n";
-    }
+        std::FILE *file_ = nullptr;
+        uint64_t size_ = 0;
+    };
 
-    ZipIndex CreateZipIndex(const std::string &filename)
+    // The occurrences found in one entry, or in one range of it. At most
+    // kResultBufferSize bytes of occurrences and contexts are held in
+    // memory; older ones are moved to a spill file of the result's own, so
+    // memory use does not grow with the number of hits.
+    class SearchResult
     {
-        ZipIndex index;
-        unzFile zip_file = unzOpen(filename.c_str());
-        if (!zip_file)
+    public:
+        SearchResult() = default;
+
+        explicit SearchResult(std::string file_name) : filename(std::move(file_name))
         {
-            throw std::runtime_error("Error opening zip file: " + filename);
         }
 
-        unz_global_info global_info;
-        if (unzGetGlobalInfo(zip_file, &global_info) != UNZ_OK)
+        std::string filename;
+        uint64_t line_count = 0; // lines searched, to number the lines of the next part
+        bool truncated = false;  // stopped early at --max-count
+
+        uint64_t Count() const
         {
-            unzClose(zip_file);
-            throw std::runtime_error("Error reading zip file info");
+            return spilled_count_ + occurrences_.size() + unrecorded_;
         }
 
-        for (uLong i = 0; i < global_info.number_entry; ++i)
+        void Add(uint64_t line, uint64_t col, std::string_view context, size_t pattern)
         {
-            char filename_inzip[256];
-            unz_file_info file_info;
-            if (unzGetCurrentFileInfo(zip_file, &file_info, filename_inzip,
-                                      sizeof(filename_inzip), nullptr, 0, nullptr,
-                                      0) != UNZ_OK)
-            {
-                unzClose(zip_file);
-                throw std::runtime_error("Error getting file info");
-            }
+            if ((occurrences_.size() + 1) * sizeof(Occurrence) + contexts_.size() + context.size() > kResultBufferSize)
+                Spill();
+            occurrences_.push_back({line, col, static_cast<uint32_t>(contexts_.size()),
+                                    static_cast<uint32_t>(context.size()), static_cast<uint32_t>(pattern)});
+            contexts_.append(context);
+        }
 
-            uLong file_offset = unzGetOffset(zip_file);
-            if (file_offset == 0)
-            {
-                std::cerr << "Warning: Unable to get offset for file: " << filename_inzip
-                          << std::endl;
-            }
+        // Counts a hit nobody needs the details of.
+        void AddUnrecorded()
+        {
+            unrecorded_++;
+        }
 
-            index[filename_inzip] = {file_offset, file_info.uncompressed_size};
+        // Moves the buffered occurrences to the spill file.
+        void Spill()
+        {
+            if (occurrences_.empty())
+                return;
+            if (!spill_)
+                spill_ = std::make_unique<SpillFile>();
+            const std::string_view records(reinterpret_cast<const char *>(occurrences_.data()),
+                                           occurrences_.size() * sizeof(Occurrence));
+            spilled_.push_back({spill_->Append(records, contexts_), occurrences_.size(), contexts_.size()});
+            spilled_count_ += occurrences_.size();
+            occurrences_.clear();
+            contexts_.clear();
+        }
 
-            if (i + 1 < global_info.number_entry && unzGoToNextFile(zip_file) != UNZ_OK)
+        // Calls handler(occurrence, context) for the first `limit` recorded
+        // occurrences in the order they were added.
+        template <typename OccurrenceHandler>
+        void ForEachOccurrence(uint64_t limit, OccurrenceHandler &&handler) const
+        {
+            auto visit = [&](const std::vector<Occurrence> &occurrences, std::string_view contexts)
             {
-                unzClose(zip_file);
-                throw std::runtime_error("Error moving to next file in zip");
+                for (size_t i = 0; i < occurrences.size() && limit > 0; ++i, --limit)
+                {
+                    const Occurrence &occurrence = occurrences[i];
+                    handler(occurrence, contexts.substr(occurrence.context_offset, occurrence.context_length));
+                }
+            };
+
+            std::vector<Occurrence> occurrences;
+            std::string contexts;
+            for (const SpilledBlock &block : spilled_)
+            {
+                if (limit == 0)
+                    return;
+                occurrences.resize(block.count);
+                contexts.resize(block.contexts_size);
+                spill_->Read(block.offset, reinterpret_cast<char *>(occurrences.data()), block.count * sizeof(Occurrence));
+                spill_->Read(block.offset + block.count * sizeof(Occurrence), contexts.data(), contexts.size());
+                visit(occurrences, contexts);
             }
+            visit(occurrences_, contexts_);
         }
 
-        unzClose(zip_file);
-        return index;
-    }
+    private:
+        struct SpilledBlock
+        {
+            uint64_t offset;
+            size_t count;
+            size_t contexts_size;
+        };
 
-    std::vector<size_t> BoyerMoore(std::string_view text, std::string_view pattern)
-    {
-        std::vector<size_t> results;
-        int m = pattern.length();
-        int n = text.length();
+        std::unique_ptr<SpillFile> spill_;
+        std::vector<Occurrence> occurrences_;
+        std::string contexts_; // the bytes the buffered occurrences point into
+        std::vector<SpilledBlock> spilled_;
+        uint64_t spilled_count_ = 0;
+        uint64_t unrecorded_ = 0;
+    };
 
-        if (m == 0 || n == 0 || m > n)
-            return results;
+    // A set of lines that all workers insert into at once. It is split into
+    // shards by hash, each behind its own lock, so two inserts rarely wait
+    // for each other.
+    class ConcurrentLineSet
+    {
+    public:
+        void Insert(std::string_view line)
+        {
+            const size_t hash = std::hash<std::string_view>()(line);
+            Shard &shard = shards_[hash % kShardCount];
+            std::lock_guard lock(shard.mutex);
+            if (!shard.lines.contains(line))
+                shard.lines.emplace(line);
+        }
 
-        std::array<int, 256> bad_char;
-        bad_char.fill(-1);
+        uint64_t Size() const
+        {
+            uint64_t size = 0;
+            for (const Shard &shard : shards_)
+            {
+                std::lock_guard lock(shard.mutex);
+                size += shard.lines.size();
+            }
+            return size;
+        }
 
-        for (int i = 0; i < m; i++)
-            bad_char[pattern[i]] = i;
+    private:
+        static constexpr size_t kShardCount = 64;
 
-        for (int s = 0; s <= (n - m);)
+        struct LineHash
         {
-            int j = m - 1;
-            while (j >= 0 && pattern[j] == text[s + j])
-                j--;
+            using is_transparent = void;
 
-            if (j < 0)
-            {
-                results.push_back(s);
-                s += (s + m < n) ? m - bad_char[text[s + m]] : 1;
-            }
-            else
+            size_t operator()(std::string_view line) const
             {
-                s += std::max(1, j - bad_char[text[s + j]]);
+                return std::hash<std::string_view>()(line);
             }
-        }
+        };
 
-        return results;
-    }
+        struct alignas(64) Shard
+        {
+            mutable std::mutex mutex;
+            std::unordered_set<std::string, LineHash, std::equal_to<>> lines;
+        };
 
-    SearchResult SearchInFile(const std::string &zip_filename,
-                              const std::string &file_name,
-                              const FileInfo &file_info,
-                              const std::string &keyword)
+        std::array<Shard, kShardCount> shards_;
+    };
+
+    // Occurrences found so far by every scanner of one search, so that all
+    // of them stop once --max-count is reached. Scanners add their hits once
+    // per window, which keeps the shared counter off the hot path. With
+    // `count_lines` it also collects the distinct lines of the hits.
+    class HitCounter
     {
-        unzFile zip_file = unzOpen(zip_filename.c_str());
-        if (!zip_file)
+    public:
+        explicit HitCounter(uint64_t limit, bool count_lines = false)
+            : limit_(limit == 0 ? UINT64_MAX : limit),
+              lines_(count_lines ? std::make_unique<ConcurrentLineSet>() : nullptr)
         {
-            throw std::runtime_error("Error opening zip file: " + zip_filename);
         }
 
-        auto cleanup = [&]()
+        bool CountsLines() const
         {
-            unzCloseCurrentFile(zip_file);
-            unzClose(zip_file);
-        };
+            return lines_ != nullptr;
+        }
 
-        if (file_info.offset != 0 && unzSetOffset(zip_file, file_info.offset) != UNZ_OK)
+        void AddLine(std::string_view line)
         {
-            std::cerr << "Warning: Unable to set offset for file: " << file_name
-                      << ". Trying to locate file by name." << std::endl;
-            if (unzLocateFile(zip_file, file_name.c_str(), 0) != UNZ_OK)
-            {
-                cleanup();
-                throw std::runtime_error("Error locating file in zip: " + file_name);
-            }
+            lines_->Insert(line);
         }
 
-        if (unzOpenCurrentFile(zip_file) != UNZ_OK)
+        uint64_t LineCount() const
         {
-            cleanup();
-            throw std::runtime_error("Error opening file in zip: " + file_name);
+            return lines_ ? lines_->Size() : 0;
         }
 
-        SearchResult result;
-        result.filename = file_name;
+        void Add(uint64_t hits)
+        {
+            if (limit_ != UINT64_MAX && hits > 0)
+                found_.fetch_add(hits, std::memory_order_relaxed);
+        }
 
-        if (file_info.size >= kMinFileSizeForMmap)
+        bool Reached() const
         {
-            std::vector<char> buffer(file_info.size);
-            if (unzReadCurrentFile(zip_file, buffer.data(),
-                                   static_cast<unsigned int>(buffer.size())) !=
-                static_cast<int>(file_info.size))
-            {
-                cleanup();
-                throw std::runtime_error("Error reading file content");
-            }
-            std::string_view content(buffer.data(), buffer.size());
-            auto positions = BoyerMoore(content, keyword);
+            return stopped_.load(std::memory_order_relaxed) || found_.load(std::memory_order_relaxed) >= limit_;
+        }
 
-            int line = 1, col = 1;
-            for (size_t pos : positions)
-            {
-                size_t line_start = pos;
-                while (line_start > 0 && content[line_start - 1] != '\n')
-                {
-                    line_start--;
-                    col++;
-                }
+        // Stops the search as if the limit had been reached.
+        void Stop()
+        {
+            stopped_.store(true, std::memory_order_relaxed);
+        }
 
-                size_t context_start = (pos > kContextSize) ? pos - kContextSize : 0;
-                size_t context_end = std::min(pos + keyword.length() + kContextSize, content.length());
-                std::string context(content.substr(context_start, context_end - context_start));
+    private:
+        const uint64_t limit_;
+        std::atomic<uint64_t> found_ = 0;
+        std::atomic<bool> stopped_ = false;
+        std::unique_ptr<ConcurrentLineSet> lines_;
+    };
 
-                result.occurrences.emplace_back(line, col, std::move(context));
+    // Stats of the worker on this thread; null unless --stats collects them.
+    thread_local WorkerStats *worker_stats = nullptr;
 
-                line += std::count(content.begin() + line_start, content.begin() + pos, '\n');
-                col = pos - line_start + 1;
-            }
+    void AddStat(uint64_t WorkerStats::*counter, uint64_t value)
+    {
+        if (worker_stats)
+            worker_stats->*counter += value;
+    }
+
+    // Adds the time until it goes out of scope to one of the calling
+    // worker's stats.
+    class StageTimer
+    {
+    public:
+        explicit StageTimer(double WorkerStats::*counter) : stats_(worker_stats), counter_(counter)
+        {
+            if (stats_)
+                start_ = std::chrono::steady_clock::now();
         }
-        else
+
+        ~StageTimer()
         {
-            std::vector<char> buffer(kChunkSize);
-            std::string overlap;
-            int bytes_read;
-            size_t total_read = 0;
-            int line = 1, col = 1;
-            while ((bytes_read = unzReadCurrentFile(zip_file, buffer.data(),
-                                                    static_cast<unsigned int>(buffer.size()))) > 0)
-            {
-                std::string_view chunk(buffer.data(), static_cast<size_t>(bytes_read));
-                std::string search_text = overlap + std::string(chunk);
+            if (stats_)
+                stats_->*counter_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        }
 
-                auto positions = BoyerMoore(search_text, keyword);
-                for (size_t pos : positions)
-                {
-                    size_t line_start = pos;
-                    while (line_start > 0 && search_text[line_start - 1] != '\n')
-                    {
-                        line_start--;
-                    }
+        StageTimer(const StageTimer &) = delete;
+        StageTimer &operator=(const StageTimer &) = delete;
 
-                    size_t context_start = (pos > kContextSize) ? pos - kContextSize : 0;
-                    size_t context_end = std::min(pos + keyword.length() + kContextSize, search_text.length());
-                    std::string context = search_text.substr(context_start, context_end - context_start);
+    private:
+        WorkerStats *stats_;
+        double WorkerStats::*counter_;
+        std::chrono::steady_clock::time_point start_;
+    };
 
-                    result.occurrences.emplace_back(line, pos - line_start + 1, std::move(context));
+    struct ZipEntry
+    {
+        std::string name;
+        FileInfo info;
+    };
 
-                    line += std::count(search_text.begin() + line_start, search_text.begin() + pos, '\n');
-                }
+    // Entries ordered by decreasing uncompressed size, so the largest ones
+    // are started first and small ones fill in the gaps at the end.
+    using ZipIndex = std::vector<ZipEntry>;
+
+    // On-disk layout of a sorted index: this header, the sorted unique lines
+    // (each terminated by '\n'), then one uint64_t data offset for every
+    // kFenceInterval-th line. Integers are stored in host byte order.
+    struct IndexHeader
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t fence_interval;
+        uint64_t line_count;
+        uint64_t data_offset;
+        uint64_t data_size;
+        uint64_t fence_offset;
+        uint64_t fence_count;
+        uint64_t stamp; // identifies this build to the files derived from it
+    };
+
+    static_assert(sizeof(IndexHeader) == 64, "IndexHeader must stay 64 bytes");
+
+    // On-disk layout of a Bloom filter: this header, then block_count blocks
+    // of 512 bits.
+    struct BloomHeader
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t hash_count;
+        uint64_t block_count;
+        uint64_t key_count;
+        uint64_t index_stamp; // of the index the filter was filled from
+        uint64_t reserved[3];
+    };
+
+    static_assert(sizeof(BloomHeader) == 64, "BloomHeader must stay 64 bytes");
+
+    // On-disk layout of a trigram index: this header, the segments, and a
+    // table with the file offset of every segment. A segment covers a run
+    // of consecutive index lines and holds a TrigramSegment, its directory
+    // sorted by trigram, and the postings of all its trigrams.
+    struct TrigramHeader
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t reserved0;
+        uint64_t line_count;
+        uint64_t segment_count;
+        uint64_t segment_table_offset;
+        uint64_t index_data_size; // of the index the trigrams were taken from
+        uint64_t index_stamp;
+        uint64_t reserved;
+    };
+
+    struct TrigramSegment
+    {
+        uint64_t first_line;
+        uint64_t line_count;
+        uint64_t entry_count;
+        uint64_t postings_size;
+    };
+
+    // Postings of a trigram are the line numbers containing it, relative to
+    // the segment, as varint-encoded gaps.
+    struct TrigramEntry
+    {
+        uint32_t trigram;
+        uint32_t count;
+        uint64_t offset; // into the segment's postings
+    };
+
+    static_assert(sizeof(TrigramHeader) == 64, "TrigramHeader must stay 64 bytes");
+
+    // How the blocks of a password store are compressed.
+    enum class StoreCodec : uint32_t
+    {
+        Deflate = 1,
+        Zstd = 2,
+    };
+
+    // On-disk layout of a password store: this header, the compressed
+    // blocks, a table with a StoreBlock for every block, and the first line
+    // of every block, concatenated. A block decompresses to its lines in
+    // sorted order, each as the varint length of the prefix it shares with
+    // the line before it in the block, the varint length of the rest, and
+    // the rest.
+    struct StoreHeader
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        StoreCodec codec;
+        uint64_t line_count;
+        uint64_t block_count;
+        uint64_t block_table_offset;
+        uint64_t key_offset;
+        uint64_t key_size;
+        uint64_t reserved;
+    };
 
-                total_read += bytes_read;
-                overlap = (search_text.length() >= keyword.length())
-                              ? search_text.substr(search_text.length() - keyword.length() + 1)
-                              : "";
+    struct StoreBlock
+    {
+        uint64_t offset;
+        uint32_t compressed_size;
+        uint32_t size;
+        uint64_t key_offset; // of the block's first line, into the keys
+        uint32_t key_length;
+        uint32_t line_count;
+    };
+
+    static_assert(sizeof(StoreHeader) == 64, "StoreHeader must stay 64 bytes");
+    static_assert(sizeof(StoreBlock) == 32, "StoreBlock must stay 32 bytes");
+
+    // On-disk layout of a digest table: this header, the records sorted by
+    // digest, each the digest followed by the uint64_t number of its line in
+    // the index, then (1 << prefix_bits) + 1 uint64_t record numbers that
+    // start the buckets of digests sharing their leading prefix_bits bits,
+    // like the ranges of Have I Been Pwned. Integers are in host byte order.
+    struct DigestTableHeader
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t algorithm; // a DigestAlgorithm
+        uint32_t digest_size;
+        uint32_t prefix_bits;
+        uint64_t record_count;
+        uint64_t record_offset;
+        uint64_t bucket_offset;
+        uint64_t reserved[2];
+    };
+
+    static_assert(sizeof(DigestTableHeader) == 64, "DigestTableHeader must stay 64 bytes");
+
+    // Read-only memory mapping of a whole file or of a byte range within it.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string &filename, bool random_access = false)
+            : MappedFile(filename, 0, SIZE_MAX, random_access)
+        {
+        }
+
+        MappedFile(const std::string &filename, uint64_t offset, size_t length,
+                   bool random_access = false)
+        {
+#ifdef _WIN32
+            file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, random_access ? FILE_FLAG_RANDOM_ACCESS : FILE_FLAG_SEQUENTIAL_SCAN,
+                                nullptr);
+            if (file_ == INVALID_HANDLE_VALUE)
+            {
+                throw std::runtime_error("Error opening file: " + filename);
+            }
+            LARGE_INTEGER file_size;
+            GetFileSizeEx(file_, &file_size);
+            SYSTEM_INFO system_info;
+            GetSystemInfo(&system_info);
+            if (!Resolve(static_cast<uint64_t>(file_size.QuadPart), offset, length,
+                         system_info.dwAllocationGranularity))
+            {
+                Release();
+                throw std::runtime_error("Mapping range is outside of file: " + filename);
             }
+            if (map_size_ == 0)
+            {
+                return;
+            }
+            uint64_t map_offset = offset - (map_size_ - size_);
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping_ ||
+                !(map_base_ = MapViewOfFile(mapping_, FILE_MAP_READ, static_cast<DWORD>(map_offset >> 32),
+                                            static_cast<DWORD>(map_offset), map_size_)))
+            {
+                Release();
+                throw std::runtime_error("Error mapping file: " + filename);
+            }
+#else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Error opening file: " + filename);
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0)
+            {
+                close(fd);
+                throw std::runtime_error("Error reading file size: " + filename);
+            }
+            if (!Resolve(static_cast<uint64_t>(st.st_size), offset, length,
+                         static_cast<uint64_t>(sysconf(_SC_PAGESIZE))))
+            {
+                close(fd);
+                throw std::runtime_error("Mapping range is outside of file: " + filename);
+            }
+            if (map_size_ == 0)
+            {
+                close(fd);
+                return;
+            }
+            uint64_t map_offset = offset - (map_size_ - size_);
+            void *address = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(map_offset));
+            close(fd);
+            if (address == MAP_FAILED)
+            {
+                throw std::runtime_error("Error mapping file: " + filename);
+            }
+            madvise(address, map_size_, random_access ? MADV_RANDOM : MADV_SEQUENTIAL);
+            map_base_ = address;
+#endif
+            data_ = static_cast<const char *>(map_base_) + (map_size_ - size_);
         }
 
-        cleanup();
-        return result;
-    }
+        ~MappedFile()
+        {
+            Release();
+        }
 
-    void SearchInZip(const std::string &filename, const std::string &keyword)
-    {
-        auto index = CreateZipIndex(filename);
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
 
-        const auto start_time = std::chrono::high_resolution_clock::now();
+        std::string_view View() const
+        {
+            return {data_, size_};
+        }
 
-        std::atomic<int> total_count = 0;
-        std::mutex cout_mutex;
+    private:
+        // Clamps the requested range to the file and widens the mapping down
+        // to the previous multiple of `granularity`, as mmap requires.
+        bool Resolve(uint64_t file_size, uint64_t offset, size_t length, uint64_t granularity)
+        {
+            if (offset > file_size)
+                return false;
+            size_ = static_cast<size_t>(std::min<uint64_t>(length, file_size - offset));
+            map_size_ = size_ == 0 ? 0 : size_ + static_cast<size_t>(offset % granularity);
+            return length == SIZE_MAX || size_ == length;
+        }
 
-        unsigned int num_threads = std::thread::hardware_concurrency();
-        if (num_threads == 0)
+        void Release()
         {
-            num_threads = 4; // Default to 4 threads if hardware_concurrency() fails
+#ifdef _WIN32
+            if (map_base_)
+                UnmapViewOfFile(map_base_);
+            if (mapping_)
+                CloseHandle(mapping_);
+            if (file_ != INVALID_HANDLE_VALUE)
+                CloseHandle(file_);
+#else
+            if (map_base_)
+                munmap(map_base_, map_size_);
+#endif
         }
 
-        std::vector<std::thread> threads;
-        std::vector<SearchResult> results;
-        results.reserve(index.size());
+        void *map_base_ = nullptr;
+        size_t map_size_ = 0;
+        const char *data_ = nullptr;
+        size_t size_ = 0;
+#ifdef _WIN32
+        HANDLE file_ = INVALID_HANDLE_VALUE;
+        HANDLE mapping_ = nullptr;
+#endif
+    };
 
-        std::atomic<size_t> next_file_index(0);
+#ifndef _WIN32
+#ifdef SEARCH_HAVE_IO_URING
+    // Just enough of io_uring, through the raw system calls, to keep a few
+    // reads of one file in flight: readv requests tagged with a pointer
+    // and their completions.
+    class IoUring
+    {
+    public:
+        // Returns nullptr if the kernel has no io_uring or it is blocked,
+        // as it is in many containers.
+        static std::unique_ptr<IoUring> Create(unsigned entries)
+        {
+            io_uring_params params{};
+            const int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0)
+                return nullptr;
+            return std::unique_ptr<IoUring>(new IoUring(fd, params));
+        }
 
-        auto worker = [&]()
+        ~IoUring()
         {
-            while (true)
-            {
-                size_t i = next_file_index.fetch_add(1, std::memory_order_relaxed);
-                if (i >= index.size())
-                    break;
+            if (sqes_ != MAP_FAILED)
+                munmap(sqes_, sqes_size_);
+            if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+                munmap(cq_ring_, cq_ring_size_);
+            if (sq_ring_ != MAP_FAILED)
+                munmap(sq_ring_, sq_ring_size_);
+            close(fd_);
+        }
 
-                auto it = std::next(index.begin(), i);
-                const auto &[file_name, file_info] = *it;
+        IoUring(const IoUring &) = delete;
+        IoUring &operator=(const IoUring &) = delete;
 
-                try
-                {
-                    SearchResult result = SearchInFile(filename, file_name, file_info, keyword);
-                    total_count += result.occurrences.size();
+        bool Valid() const
+        {
+            return sq_ring_ != MAP_FAILED && cq_ring_ != MAP_FAILED && sqes_ != MAP_FAILED;
+        }
 
-                    std::lock_guard<std::mutex> lock(cout_mutex);
-                    std::cout << "Occurrences in \"" << file_name << "\": " << result.occurrences.size() << '\n';
-                    for (const auto &[line, col, context] : result.occurrences)
-                    {
-                        std::cout << "  Line " << line << ", Column " << col << ": " << context << '\n';
-                    }
+        // Queues and submits one read; the caller keeps `iov` alive until
+        // its completion. Returns false if the submission queue is full.
+        bool SubmitRead(int file, const iovec *iov, uint64_t offset, uint64_t user_data)
+        {
+            const unsigned tail = *sq_tail_;
+            if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+                return false;
+            const unsigned index = tail & *sq_mask_;
+            io_uring_sqe &sqe = sqes_[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_READV;
+            sqe.fd = file;
+            sqe.addr = reinterpret_cast<uint64_t>(iov);
+            sqe.len = 1;
+            sqe.off = offset;
+            sqe.user_data = user_data;
+            sq_array_[index] = index;
+            __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+            while (syscall(__NR_io_uring_enter, fd_, 1, 0, 0, nullptr, 0) < 0)
+            {
+                if (errno != EINTR)
+                    return false;
+            }
+            return true;
+        }
 
-                    results.push_back(std::move(result));
+        // Waits for the next completion.
+        void WaitCompletion(uint64_t &user_data, int &result)
+        {
+            while (true)
+            {
+                const unsigned head = *cq_head_;
+                if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+                {
+                    const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+                    user_data = cqe.user_data;
+                    result = cqe.res;
+                    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+                    return;
                 }
-                catch (const std::exception &e)
+                if (syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                    errno != EINTR)
                 {
-                    std::lock_guard<std::mutex> lock(cout_mutex);
-                    std::cerr << "Error processing file \"" << file_name << "\": " << e.what() << '\n';
+                    throw std::runtime_error("Error waiting for io_uring completion");
                 }
             }
-        };
-
-        for (unsigned int i = 0; i < num_threads; ++i)
-        {
-            threads.emplace_back(worker);
         }
 
-        for (auto &thread : threads)
+    private:
+        IoUring(int fd, const io_uring_params &params) : fd_(fd), sq_entries_(params.sq_entries)
         {
-            thread.join();
-        }
+            sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap)
+                sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+            sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_SQ_RING);
+            if (sq_ring_ == MAP_FAILED)
+                return;
+            cq_ring_ = single_mmap ? sq_ring_
+                                   : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          fd, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED)
+                return;
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                              IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+                return;
+            sqes_ = static_cast<io_uring_sqe *>(sqes);
 
-        const auto end_time = std::chrono::high_resolution_clock::now();
-        const std::chrono::duration<double> cpu_time_used = end_time - start_time;
+            char *sq = static_cast<char *>(sq_ring_);
+            char *cq = static_cast<char *>(cq_ring_);
+            sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        }
 
-        std::cout << "Search complete. Total occurrences: " << total_count << '\n';
-        std::cout << "Time taken: " << cpu_time_used.count() << " seconds\n";
-    }
-}
+        int fd_;
+        unsigned sq_entries_;
+        size_t sq_ring_size_ = 0;
+        size_t cq_ring_size_ = 0;
+        size_t sqes_size_ = 0;
+        void *sq_ring_ = MAP_FAILED;
+        void *cq_ring_ = MAP_FAILED;
+        io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+        unsigned *sq_head_ = nullptr;
+        unsigned *sq_tail_ = nullptr;
+        unsigned *sq_mask_ = nullptr;
+        unsigned *sq_array_ = nullptr;
+        unsigned *cq_head_ = nullptr;
+        unsigned *cq_tail_ = nullptr;
+        unsigned *cq_mask_ = nullptr;
+        io_uring_cqe *cqes_ = nullptr;
+    };
+#endif
 
-int main(int argc, char *argv[])
-{
-    try
+    // Reads a file for minizip and, once the reads turn sequential, keeps
+    // `depth` reads of kPrefetchBlockSize in flight ahead of the position,
+    // so that inflate does not wait on slow storage. The reads go through
+    // io_uring where it is built in and allowed, else through a readahead
+    // thread. A read elsewhere in the file, such as of the central
+    // directory, first drops the blocks read ahead.
+    class PrefetchingFile
     {
-        Search::PrintHeader();
-
-        std::string keyword;
-        std::string filename;
+    public:
+        PrefetchingFile(const std::string &filename, size_t depth)
+            : depth_(std::max<size_t>(depth, 1)), file_(open(filename.c_str(), O_RDONLY))
+        {
+            if (file_ < 0)
+            {
+                throw std::runtime_error("Error opening file: " + filename);
+            }
+            struct stat st;
+            if (fstat(file_, &st) != 0)
+            {
+                close(file_);
+                throw std::runtime_error("Error reading file size: " + filename);
+            }
+            size_ = static_cast<uint64_t>(st.st_size);
+#ifdef SEARCH_HAVE_IO_URING
+            ring_ = IoUring::Create(static_cast<unsigned>(std::bit_ceil(depth_)));
+            if (ring_ && !ring_->Valid())
+                ring_.reset();
+            if (!ring_)
+#endif
+                thread_ = std::thread([this]
+                                      { ReadAheadLoop(); });
+        }
 
-        if (argc == 2 && (std::strcmp(argv[1], "--interactive") == 0))
+        ~PrefetchingFile()
         {
-            std::cout << "Enter the keyword to search: ";
-            std::getline(std::cin, keyword);
+            DropBlocks();
+            if (thread_.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stopping_ = true;
+                }
+                wake_.notify_all();
+                thread_.join();
+            }
+            close(file_);
+        }
 
-            std::cout << "Enter the zip filename to search in: ";
-            std::getline(std::cin, filename);
+        PrefetchingFile(const PrefetchingFile &) = delete;
+        PrefetchingFile &operator=(const PrefetchingFile &) = delete;
 
-            std::cout << "Case-insensitive search? (y/n): ";
-            std::string response;
-            std::getline(std::cin, response);
-            Search::case_insensitive = (response == "y" || response == "Y");
-        }
-        else if (argc >= 3 && argc <= 4)
+        // Copies up to `size` bytes at the position; returns fewer at the end
+        // of the file and 0 on a read error.
+        size_t Read(char *buffer, size_t size)
         {
-            filename = argv[1];
-            keyword = argv[2];
-            if (argc == 4 && std::strcmp(argv[3], "-i") == 0)
+            try
+            {
+                return ReadFromBlocks(buffer, size);
+            }
+            catch (const std::exception &)
             {
-                Search::case_insensitive = true;
+                failed_ = true;
+                return 0;
             }
         }
-        else
+
+        uint64_t Tell() const
         {
-            Search::PrintUsage(argv[0]);
-            return 1;
+            return position_;
         }
-        if (!std::filesystem::exists(filename))
+
+        bool Seek(int64_t offset, int origin)
         {
-            throw std::runtime_error("File does not exist: " + filename);
+            const int64_t base = (origin == ZLIB_FILEFUNC_SEEK_SET)   ? 0
+                                 : (origin == ZLIB_FILEFUNC_SEEK_CUR) ? static_cast<int64_t>(position_)
+                                                                      : static_cast<int64_t>(size_);
+            if (base + offset < 0)
+                return false;
+            position_ = static_cast<uint64_t>(base + offset);
+            return true;
         }
 
-        Search::SearchInZip(filename, keyword);
-    }
-    catch (const std::exception &e)
-    {
-        std::cerr << "Error: " << e.what() << '\n';
-        return 1;
-    }
+        bool Failed() const
+        {
+            return failed_;
+        }
 
-    return 0;
-}
\ No newline at end of file
+    private:
+        struct Block
+        {
+            uint64_t offset;
+            uint64_t end;
+            std::unique_ptr<char[]> data;
+            iovec iov;
+            bool done = false;
+            bool failed = false;
+        };
+
+        size_t ReadFromBlocks(char *buffer, size_t size)
+        {
+            const bool sequential = position_ == last_read_end_;
+            size_t copied = 0;
+            while (copied < size && position_ < size_)
+            {
+                if (!blocks_.empty() && (position_ < blocks_.front()->offset || position_ >= blocks_.back()->end))
+                    DropBlocks();
+                if (blocks_.empty())
+                {
+                    if (!sequential)
+                    {
+                        const size_t bytes = ReadAt(buffer + copied, size - copied, position_, failed_);
+                        if (failed_)
+                            return 0;
+                        copied += bytes;
+                        position_ += bytes;
+                        break;
+                    }
+                    while (blocks_.size() < depth_ && Prefetch())
+                    {
+                    }
+                }
+
+                Block &block = *blocks_.front();
+                if (position_ >= block.end)
+                {
+                    blocks_.pop_front();
+                    Prefetch();
+                    continue;
+                }
+                WaitFor(block);
+                if (failed_)
+                    return 0;
+                const size_t bytes = static_cast<size_t>(std::min<uint64_t>(size - copied, block.end - position_));
+                std::memcpy(buffer + copied, block.data.get() + (position_ - block.offset), bytes);
+                copied += bytes;
+                position_ += bytes;
+            }
+            last_read_end_ = position_;
+            return copied;
+        }
+
+        // Starts reading the block after the last one, or at the position.
+        bool Prefetch()
+        {
+            const uint64_t offset = blocks_.empty() ? position_ : blocks_.back()->end;
+            if (offset >= size_)
+                return false;
+            auto block = std::make_unique<Block>();
+            block->offset = offset;
+            block->end = std::min<uint64_t>(offset + kPrefetchBlockSize, size_);
+            block->data = std::make_unique_for_overwrite<char[]>(static_cast<size_t>(block->end - offset));
+            block->iov = {block->data.get(), static_cast<size_t>(block->end - offset)};
+            Block *submitted = block.get();
+            blocks_.push_back(std::move(block));
+#ifdef SEARCH_HAVE_IO_URING
+            if (ring_)
+            {
+                if (ring_->SubmitRead(file_, &submitted->iov, submitted->offset, reinterpret_cast<uint64_t>(submitted)))
+                    in_flight_++;
+                else
+                    CompleteSynchronously(*submitted);
+                return true;
+            }
+#endif
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queue_.push_back(submitted);
+            }
+            wake_.notify_all();
+            return true;
+        }
+
+        void WaitFor(Block &block)
+        {
+#ifdef SEARCH_HAVE_IO_URING
+            if (ring_)
+            {
+                while (!block.done)
+                    ReapCompletion();
+                failed_ |= block.failed;
+                return;
+            }
+#endif
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [&]
+                       { return block.done; });
+            failed_ |= block.failed;
+        }
+
+        // Forgets the blocks read ahead, once no read still writes to them.
+        void DropBlocks()
+        {
+#ifdef SEARCH_HAVE_IO_URING
+            while (ring_ && in_flight_ > 0)
+                ReapCompletion();
+#endif
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queue_.clear();
+                done_.wait(lock, [&]
+                           { return busy_ == nullptr; });
+            }
+            blocks_.clear();
+        }
+
+#ifdef SEARCH_HAVE_IO_URING
+        void ReapCompletion()
+        {
+            uint64_t user_data;
+            int result;
+            ring_->WaitCompletion(user_data, result);
+            in_flight_--;
+            Block &block = *reinterpret_cast<Block *>(user_data);
+            const size_t length = static_cast<size_t>(block.end - block.offset);
+            if (result < 0)
+                block.failed = true;
+            else if (static_cast<size_t>(result) < length)
+            {
+                // Finish a short read the plain way.
+                if (ReadAt(block.data.get() + result, length - result, block.offset + result, block.failed) !=
+                    length - result)
+                    block.failed = true;
+            }
+            block.done = true;
+        }
+
+        void CompleteSynchronously(Block &block)
+        {
+            const size_t length = static_cast<size_t>(block.end - block.offset);
+            if (ReadAt(block.data.get(), length, block.offset, block.failed) != length)
+                block.failed = true;
+            block.done = true;
+        }
+#endif
+
+        void ReadAheadLoop()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true)
+            {
+                wake_.wait(lock, [&]
+                           { return stopping_ || !queue_.empty(); });
+                if (stopping_)
+                    return;
+                busy_ = queue_.front();
+                queue_.pop_front();
+                lock.unlock();
+                const size_t length = static_cast<size_t>(busy_->end - busy_->offset);
+                bool failed = false;
+                if (ReadAt(busy_->data.get(), length, busy_->offset, failed) != length)
+                    failed = true;
+                lock.lock();
+                busy_->failed = failed;
+                busy_->done = true;
+                busy_ = nullptr;
+                done_.notify_all();
+            }
+        }
+
+        // pread until `size` bytes or the end of the file; sets `failed` on
+        // an error.
+        size_t ReadAt(char *buffer, size_t size, uint64_t offset, bool &failed) const
+        {
+            size_t total = 0;
+            while (total < size)
+            {
+                const ssize_t bytes = pread(file_, buffer + total, size - total, static_cast<off_t>(offset + total));
+                if (bytes < 0 && errno == EINTR)
+                    continue;
+                if (bytes < 0)
+                    failed = true;
+                if (bytes <= 0)
+                    break;
+                total += static_cast<size_t>(bytes);
+            }
+            return total;
+        }
+
+        const size_t depth_;
+        int file_;
+        uint64_t size_ = 0;
+        uint64_t position_ = 0;
+        uint64_t last_read_end_ = UINT64_MAX;
+        bool failed_ = false;
+        std::deque<std::unique_ptr<Block>> blocks_;
+#ifdef SEARCH_HAVE_IO_URING
+        std::unique_ptr<IoUring> ring_;
+        size_t in_flight_ = 0;
+#endif
+        std::thread thread_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+        std::deque<Block *> queue_;
+        Block *busy_ = nullptr;
+        bool stopping_ = false;
+    };
+
+    // minizip's I/O hooks over PrefetchingFile; the opaque pointer carries
+    // the prefetch depth.
+    zlib_filefunc64_def PrefetchingFileFunctions(size_t *depth)
+    {
+        zlib_filefunc64_def functions{};
+        functions.zopen64_file = [](void *opaque, const void *filename, int mode) -> void *
+        {
+            if ((mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER) != ZLIB_FILEFUNC_MODE_READ)
+                return nullptr;
+            try
+            {
+                return new PrefetchingFile(static_cast<const char *>(filename), *static_cast<size_t *>(opaque));
+            }
+            catch (const std::exception &)
+            {
+                return nullptr;
+            }
+        };
+        functions.zread_file = [](void *, void *stream, void *buffer, unsigned long size) -> unsigned long
+        {
+            return static_cast<unsigned long>(static_cast<PrefetchingFile *>(stream)->Read(static_cast<char *>(buffer), size));
+        };
+        functions.zwrite_file = [](void *, void *, const void *, unsigned long) -> unsigned long
+        {
+            return 0;
+        };
+        functions.ztell64_file = [](void *, void *stream) -> ZPOS64_T
+        {
+            return static_cast<PrefetchingFile *>(stream)->Tell();
+        };
+        functions.zseek64_file = [](void *, void *stream, ZPOS64_T offset, int origin) -> long
+        {
+            return static_cast<PrefetchingFile *>(stream)->Seek(static_cast<int64_t>(offset), origin) ? 0 : -1;
+        };
+        functions.zclose_file = [](void *, void *stream) -> int
+        {
+            delete static_cast<PrefetchingFile *>(stream);
+            return 0;
+        };
+        functions.zerror_file = [](void *, void *stream) -> int
+        {
+            return static_cast<PrefetchingFile *>(stream)->Failed() ? 1 : 0;
+        };
+        functions.opaque = depth;
+        return functions;
+    }
+#endif
+
+    // An open zip archive. Opening one reads the whole central directory,
+    // so every worker opens the archive once and reuses the handle for all
+    // entries it processes.
+    class ZipArchive
+    {
+    public:
+        // With `prefetch_blocks`, as --prefetch sets them, minizip reads
+        // the archive through a PrefetchingFile instead of stdio.
+        explicit ZipArchive(const std::string &filename, size_t prefetch_blocks = 0)
+            : filename_(filename), prefetch_blocks_(prefetch_blocks), zip_file_(Open(filename, &prefetch_blocks_))
+        {
+            if (!zip_file_)
+            {
+                throw std::runtime_error("Error opening zip file: " + filename);
+            }
+        }
+
+        ~ZipArchive()
+        {
+            unzClose(zip_file_);
+        }
+
+        ZipArchive(const ZipArchive &) = delete;
+        ZipArchive &operator=(const ZipArchive &) = delete;
+
+        const std::string &Filename() const
+        {
+            return filename_;
+        }
+
+        unzFile Handle() const
+        {
+            return zip_file_;
+        }
+
+    private:
+        // The I/O hooks keep `prefetch_blocks`, so it points at the member.
+        static unzFile Open(const std::string &filename, size_t *prefetch_blocks)
+        {
+#ifndef _WIN32
+            if (*prefetch_blocks > 0)
+            {
+                zlib_filefunc64_def functions = PrefetchingFileFunctions(prefetch_blocks);
+                return unzOpen2_64(filename.c_str(), &functions);
+            }
+#else
+            static_cast<void>(prefetch_blocks);
+#endif
+            return unzOpen(filename.c_str());
+        }
+
+        std::string filename_;
+        size_t prefetch_blocks_;
+        unzFile zip_file_;
+    };
+
+    ZipIndex CreateZipIndex(const std::string &filename)
+    {
+        ZipIndex index;
+        ZipArchive archive(filename);
+        unzFile zip_file = archive.Handle();
+
+        unz_global_info global_info;
+        if (unzGetGlobalInfo(zip_file, &global_info) != UNZ_OK)
+        {
+            throw std::runtime_error("Error reading zip file info");
+        }
+
+        for (uLong i = 0; i < global_info.number_entry; ++i)
+        {
+            char filename_inzip[256];
+            unz_file_info file_info;
+            if (unzGetCurrentFileInfo(zip_file, &file_info, filename_inzip,
+                                      sizeof(filename_inzip), nullptr, 0, nullptr,
+                                      0) != UNZ_OK)
+            {
+                throw std::runtime_error("Error getting file info");
+            }
+
+            uLong file_offset = unzGetOffset(zip_file);
+            if (file_offset == 0)
+            {
+                std::cerr << "Warning: Unable to get offset for file: " << filename_inzip
+                          << std::endl;
+            }
+
+            index.push_back({filename_inzip,
+                             {file_offset, file_info.uncompressed_size, file_info.compressed_size,
+                              static_cast<int>(file_info.compression_method), (file_info.flag & 1) != 0}});
+
+            if (i + 1 < global_info.number_entry && unzGoToNextFile(zip_file) != UNZ_OK)
+            {
+                throw std::runtime_error("Error moving to next file in zip");
+            }
+        }
+
+        std::stable_sort(index.begin(), index.end(), [](const ZipEntry &a, const ZipEntry &b)
+                         { return a.info.size > b.info.size; });
+        return index;
+    }
+
+    // Streams data through one fixed buffer. `fill(destination, capacity)`
+    // produces up to kChunkSize new bytes and returns 0 at the end. Then
+    // `handler(window, carried)` sees everything in the buffer: the first
+    // `carried` bytes are the tail kept from the previous window and the
+    // rest is new. The handler returns how many trailing bytes to keep (at
+    // most kChunkSize), and those are moved to the front before the next
+    // fill, so nothing is copied anywhere else. At the end, any kept bytes
+    // are handed over once more as a window without new bytes.
+    template <typename Fill, typename WindowHandler>
+    void StreamWindows(Fill &&fill, WindowHandler &&handler)
+    {
+        std::vector<char> buffer(2 * kChunkSize);
+        size_t carried = 0;
+        while (true)
+        {
+            size_t bytes;
+            {
+                StageTimer timer(&WorkerStats::inflate_seconds);
+                bytes = fill(buffer.data() + carried, kChunkSize);
+            }
+            if (bytes == 0)
+                break;
+            AddStat(&WorkerStats::bytes_inflated, bytes);
+            AddStat(&WorkerStats::bytes_scanned, bytes);
+
+            StageTimer timer(&WorkerStats::search_seconds);
+            const size_t window_size = carried + bytes;
+            const size_t keep = std::min({static_cast<size_t>(handler(std::string_view(buffer.data(), window_size), carried)),
+                                          window_size, kChunkSize});
+            std::memmove(buffer.data(), buffer.data() + window_size - keep, keep);
+            carried = keep;
+        }
+        if (carried > 0)
+        {
+            StageTimer timer(&WorkerStats::search_seconds);
+            handler(std::string_view(buffer.data(), carried), carried);
+        }
+    }
+
+    // The same protocol over bytes that are already in memory: windows of up
+    // to kChunkSize new bytes are cut straight out of `content`, the carried
+    // ones being the end of the previous window. Before each window
+    // `wanted()` caps how many new bytes it gets, and 0 stops.
+    template <typename Wanted, typename WindowHandler>
+    void MappedWindows(std::string_view content, Wanted &&wanted, WindowHandler &&handler)
+    {
+        size_t position = 0;
+        size_t carried = 0;
+        while (position < content.size())
+        {
+            const size_t bytes = static_cast<size_t>(std::min<uint64_t>({content.size() - position, kChunkSize, wanted()}));
+            if (bytes == 0)
+                break;
+            AddStat(&WorkerStats::bytes_scanned, bytes);
+            StageTimer timer(&WorkerStats::search_seconds);
+            const std::string_view window = content.substr(position - carried, carried + bytes);
+            carried = std::min(static_cast<size_t>(handler(window, carried)), window.size());
+            position += bytes;
+        }
+        if (carried > 0)
+        {
+            StageTimer timer(&WorkerStats::search_seconds);
+            handler(content.substr(position - carried, carried), carried);
+        }
+    }
+
+#ifdef SEARCH_HAVE_LIBDEFLATE
+    // Inflates a whole raw deflate stream into `destination`, which holds
+    // exactly its uncompressed size, in one libdeflate call.
+    void InflateWithLibdeflate(std::string_view compressed, char *destination, size_t size)
+    {
+        std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)> decompressor(
+            libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+        if (!decompressor)
+        {
+            throw std::runtime_error("Error initializing libdeflate");
+        }
+        size_t inflated = 0;
+        if (libdeflate_deflate_decompress(decompressor.get(), compressed.data(), compressed.size(), destination, size,
+                                          &inflated) != LIBDEFLATE_SUCCESS ||
+            inflated != size)
+        {
+            throw std::runtime_error("Error inflating entry with libdeflate");
+        }
+    }
+#endif
+
+#ifdef SEARCH_HAVE_ISAL
+    // The same with ISA-L's igzip decoder.
+    void InflateWithIsal(std::string_view compressed, char *destination, size_t size)
+    {
+        if (compressed.size() > UINT32_MAX || size > UINT32_MAX)
+        {
+            throw std::runtime_error("Entry too large for a single ISA-L call");
+        }
+        inflate_state state;
+        isal_inflate_init(&state);
+        state.crc_flag = ISAL_DEFLATE;
+        state.next_in = reinterpret_cast<uint8_t *>(const_cast<char *>(compressed.data()));
+        state.avail_in = static_cast<uint32_t>(compressed.size());
+        state.next_out = reinterpret_cast<uint8_t *>(destination);
+        state.avail_out = static_cast<uint32_t>(size);
+        if (isal_inflate(&state) != ISAL_DECOMP_OK || state.total_out != size)
+        {
+            throw std::runtime_error("Error inflating entry with ISA-L");
+        }
+    }
+#endif
+
+#ifdef SEARCH_HAVE_WHOLE_INFLATE
+    // Whole-buffer decoders skip zlib's sliding window and its copies; ISA-L
+    // is preferred when both are built in, for its hand-tuned x86 loops.
+    void InflateWhole(std::string_view compressed, char *destination, size_t size)
+    {
+#ifdef SEARCH_HAVE_ISAL
+        InflateWithIsal(compressed, destination, size);
+#else
+        InflateWithLibdeflate(compressed, destination, size);
+#endif
+    }
+#endif
+
+    // Opens a single entry of an open archive for reading and closes it
+    // again when it goes out of scope. With the central directory offset
+    // from CreateZipIndex this is a seek rather than a directory scan.
+    class ZipEntryReader
+    {
+    public:
+        ZipEntryReader(ZipArchive &archive, const std::string &file_name, const FileInfo &file_info)
+            : zip_filename_(archive.Filename()), file_info_(file_info), zip_file_(archive.Handle())
+        {
+            if (file_info.offset == 0 || unzSetOffset(zip_file_, file_info.offset) != UNZ_OK)
+            {
+                if (file_info.offset != 0)
+                {
+                    std::cerr << "Warning: Unable to set offset for file: " << file_name
+                              << ". Trying to locate file by name." << std::endl;
+                }
+                if (unzLocateFile(zip_file_, file_name.c_str(), 0) != UNZ_OK)
+                {
+                    throw std::runtime_error("Error locating file in zip: " + file_name);
+                }
+            }
+
+            if (unzOpenCurrentFile(zip_file_) != UNZ_OK)
+            {
+                throw std::runtime_error("Error opening file in zip: " + file_name);
+            }
+        }
+
+        ~ZipEntryReader()
+        {
+            unzCloseCurrentFile(zip_file_);
+        }
+
+        ZipEntryReader(const ZipEntryReader &) = delete;
+        ZipEntryReader &operator=(const ZipEntryReader &) = delete;
+
+        int Read(char *buffer, size_t size)
+        {
+            return unzReadCurrentFile(zip_file_, buffer, static_cast<unsigned int>(size));
+        }
+
+        // Entries stored without compression are byte-for-byte identical in
+        // the archive, so large ones are mapped straight out of the zip file
+        // instead of being copied through unzReadCurrentFile. Returns nullptr
+        // for compressed, encrypted or small entries.
+        std::unique_ptr<MappedFile> MapStoredEntry() const
+        {
+            if (file_info_.compression_method != 0 || file_info_.encrypted ||
+                file_info_.size < kMinFileSizeForMmap)
+            {
+                return nullptr;
+            }
+            uint64_t data_offset = DataOffset();
+            if (data_offset == 0)
+            {
+                return nullptr;
+            }
+            return std::make_unique<MappedFile>(zip_filename_, data_offset, file_info_.size);
+        }
+
+        // Position of the entry's first compressed byte in the archive, or 0
+        // if minizip cannot tell.
+        uint64_t DataOffset() const
+        {
+            int64_t data_offset = unzGetCurrentFileZStreamPos64(zip_file_);
+            return data_offset > 0 ? static_cast<uint64_t>(data_offset) : 0;
+        }
+
+        // Streams the entry through StreamWindows, or through MappedWindows
+        // straight from the mapping for mapped stored entries. Deflated
+        // entries up to kMaxWholeInflateSize are inflated in one call when a
+        // whole-buffer decoder is built in. Before each read `wanted()` caps
+        // how many more bytes are read, and 0 stops.
+        template <typename Wanted, typename WindowHandler>
+        void ForEachChunk(Wanted &&wanted, WindowHandler &&handler)
+        {
+            if (auto mapped = MapStoredEntry())
+            {
+                MappedWindows(mapped->View(), wanted, handler);
+                return;
+            }
+#ifdef SEARCH_HAVE_WHOLE_INFLATE
+            if (file_info_.compression_method == Z_DEFLATED && !file_info_.encrypted && file_info_.size > 0 &&
+                file_info_.size <= kMaxWholeInflateSize)
+            {
+                if (const uint64_t data_offset = DataOffset(); data_offset != 0)
+                {
+                    MappedFile compressed(zip_filename_, data_offset, file_info_.compressed_size);
+                    auto inflated = std::make_unique_for_overwrite<char[]>(file_info_.size);
+                    {
+                        StageTimer timer(&WorkerStats::inflate_seconds);
+                        InflateWhole(compressed.View(), inflated.get(), file_info_.size);
+                    }
+                    AddStat(&WorkerStats::bytes_inflated, file_info_.size);
+                    MappedWindows(std::string_view(inflated.get(), file_info_.size), wanted, handler);
+                    return;
+                }
+            }
+#endif
+
+            StreamWindows([&](char *destination, size_t capacity)
+            {
+                const uint64_t max_read = wanted();
+                if (max_read == 0)
+                    return size_t{0};
+                int bytes_read = Read(destination, static_cast<size_t>(std::min<uint64_t>(capacity, max_read)));
+                if (bytes_read < 0)
+                {
+                    throw std::runtime_error("Error reading file content");
+                }
+                return static_cast<size_t>(bytes_read);
+            }, handler);
+        }
+
+    private:
+        const std::string &zip_filename_;
+        FileInfo file_info_;
+        unzFile zip_file_;
+    };
+
+    // What a search input holds: a zip archive, or text that is plain,
+    // gzip-compressed or zstd-compressed. Told apart by the first bytes, so
+    // the file names do not matter.
+    enum class InputFormat
+    {
+        Zip,
+        Plain,
+        Gzip,
+        Zstd,
+    };
+
+    InputFormat DetectInputFormat(const std::string &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Error opening file: " + filename);
+        }
+        std::array<unsigned char, 4> magic{};
+        file.read(reinterpret_cast<char *>(magic.data()), magic.size());
+        const size_t size = static_cast<size_t>(file.gcount());
+
+        // Local file header, or the end of central directory of an empty
+        // archive.
+        if (size == 4 && magic[0] == 'P' && magic[1] == 'K' &&
+            ((magic[2] == 3 && magic[3] == 4) || (magic[2] == 5 && magic[3] == 6)))
+            return InputFormat::Zip;
+        if (size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+            return InputFormat::Gzip;
+        // A zstd frame, or a skippable frame in front of one.
+        if (size == 4 && ((magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) ||
+                          ((magic[0] & 0xf0) == 0x50 && magic[1] == 0x2a && magic[2] == 0x4d && magic[3] == 0x18)))
+            return InputFormat::Zstd;
+        return InputFormat::Plain;
+    }
+
+    // Whether `name` matches a pattern in which '*' stands for any run of
+    // characters and '?' for any single one.
+    bool MatchesWildcard(std::string_view pattern, std::string_view name)
+    {
+        size_t p = 0, n = 0;
+        size_t star = std::string_view::npos, resume = 0;
+        while (n < name.size())
+        {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n]))
+            {
+                ++p;
+                ++n;
+            }
+            else if (p < pattern.size() && pattern[p] == '*')
+            {
+                star = p++;
+                resume = n;
+            }
+            else if (star != std::string_view::npos)
+            {
+                p = star + 1;
+                n = ++resume;
+            }
+            else
+                return false;
+        }
+        while (p < pattern.size() && pattern[p] == '*')
+            ++p;
+        return p == pattern.size();
+    }
+
+    // Whether `name` is one of the files this tool writes next to an input:
+    // checkpoints, checksums, indexes with their filters, trigrams and
+    // digest tables, stores and sockets, and the numbered runs and
+    // partitions build-index leaves behind if it is interrupted.
+    bool IsArtifactFilename(std::string_view name)
+    {
+        static constexpr std::string_view kSuffixes[] = {".ckpt", ".b3ok", ".b3sum", ".idx", ".bloom", ".tri",
+                                                         ".store", ".sock", ".ntlm", ".md5", ".sha1"};
+        for (const std::string_view suffix : kSuffixes)
+        {
+            if (name.ends_with(suffix))
+                return true;
+        }
+        const size_t dot = name.rfind('.');
+        if (dot == std::string_view::npos)
+            return false;
+        const std::string_view extension = name.substr(dot + 1);
+        for (const std::string_view numbered : {std::string_view("part"), std::string_view("run")})
+        {
+            if (extension.size() > numbered.size() && extension.starts_with(numbered) &&
+                extension.find_first_not_of("0123456789", numbered.size()) == std::string_view::npos)
+                return true;
+        }
+        return false;
+    }
+
+    // Replaces every input whose file name holds a wildcard by the matching
+    // regular files in its directory, in sorted order, for shells that pass
+    // quoted or unexpanded globs through. The tool's own artifacts are left
+    // out unless the pattern asks for them, as `*.idx` does.
+    std::vector<std::string> ExpandInputs(const std::vector<std::string> &inputs)
+    {
+        std::vector<std::string> filenames;
+        for (const std::string &input : inputs)
+        {
+            const std::filesystem::path path(input);
+            const std::string pattern = path.filename().string();
+            if (pattern.find_first_of("*?") == std::string::npos)
+            {
+                if (!std::filesystem::exists(path))
+                {
+                    throw std::runtime_error("File does not exist: " + input);
+                }
+                filenames.push_back(input);
+                continue;
+            }
+
+            const std::filesystem::path directory = path.has_parent_path() ? path.parent_path() : ".";
+            const bool skip_artifacts = !IsArtifactFilename(pattern);
+            std::vector<std::string> matches;
+            for (const auto &file : std::filesystem::directory_iterator(directory))
+            {
+                const std::string name = file.path().filename().string();
+                if (file.is_regular_file() && MatchesWildcard(pattern, name) &&
+                    !(skip_artifacts && IsArtifactFilename(name)))
+                    matches.push_back(path.has_parent_path() ? file.path().string() : name);
+            }
+            if (matches.empty())
+            {
+                throw std::runtime_error("No files match: " + input);
+            }
+            std::sort(matches.begin(), matches.end());
+            filenames.insert(filenames.end(), matches.begin(), matches.end());
+        }
+        return filenames;
+    }
+
+    uint32_t ReadLittleEndian32(const char *bytes)
+    {
+        const auto *b = reinterpret_cast<const unsigned char *>(bytes);
+        return uint32_t{b[0]} | uint32_t{b[1]} << 8 | uint32_t{b[2]} << 16 | uint32_t{b[3]} << 24;
+    }
+
+    // Feeds `compressed` to zlib in pieces small enough for its 32-bit
+    // avail_in; leaves avail_in at 0 once the input is exhausted.
+    void RefillInflateInput(z_stream &stream, std::string_view compressed, uint64_t &in_position)
+    {
+        if (in_position >= compressed.size())
+            return;
+        const size_t piece = std::min<uint64_t>(compressed.size() - in_position, 1u << 30);
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data() + in_position));
+        stream.avail_in = static_cast<uInt>(piece);
+        in_position += piece;
+    }
+
+    // Streams the members of a gzip file through StreamWindows. Before each
+    // read `wanted()` caps how many more bytes are inflated, and 0 stops.
+    class GzipReader
+    {
+    public:
+        explicit GzipReader(const std::string &filename) : compressed_(filename)
+        {
+        }
+
+        template <typename Wanted, typename WindowHandler>
+        void ForEachChunk(Wanted &&wanted, WindowHandler &&handler)
+        {
+            const std::string_view compressed = compressed_.View();
+            z_stream stream{};
+            if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+            {
+                throw std::runtime_error("Error initializing inflate");
+            }
+
+            uint64_t in_position = 0;
+            bool finished = false;
+            auto fill = [&](char *destination, size_t capacity) -> size_t
+            {
+                const uint64_t max_output = wanted();
+                stream.next_out = reinterpret_cast<Bytef *>(destination);
+                stream.avail_out = static_cast<uInt>(std::min<uint64_t>(capacity, max_output));
+                // Members end within a window, which is still filled up.
+                while (!finished && stream.avail_out > 0)
+                {
+                    if (stream.avail_in == 0)
+                        RefillInflateInput(stream, compressed, in_position);
+                    const int ret = inflate(&stream, Z_NO_FLUSH);
+                    if (ret == Z_STREAM_END)
+                    {
+                        // Concatenated members form one stream, as for gunzip;
+                        // anything else after a member is ignored.
+                        const uint64_t next = in_position - stream.avail_in;
+                        finished = compressed.size() - next < 2 || compressed[next] != '\x1f' ||
+                                   compressed[next + 1] != '\x8b';
+                        if (!finished)
+                            inflateReset(&stream);
+                    }
+                    else if (ret != Z_OK)
+                    {
+                        throw std::runtime_error(ret == Z_BUF_ERROR ? "Unexpected end of gzip stream"
+                                                                    : "Error inflating gzip stream");
+                    }
+                }
+                return static_cast<size_t>(reinterpret_cast<char *>(stream.next_out) - destination);
+            };
+
+            try
+            {
+                StreamWindows(fill, handler);
+            }
+            catch (...)
+            {
+                inflateEnd(&stream);
+                throw;
+            }
+            inflateEnd(&stream);
+        }
+
+    private:
+        MappedFile compressed_;
+    };
+
+    // Frame boundaries from the seek table of a seekable zstd file, the
+    // format of zstd's contrib/seekable_format: a skippable frame at the end
+    // with the compressed and decompressed size of every frame. Each list
+    // holds one offset per frame plus the total.
+    struct ZstdSeekTable
+    {
+        std::vector<uint64_t> compressed_offsets;
+        std::vector<uint64_t> decompressed_offsets;
+
+        size_t FrameCount() const
+        {
+            return compressed_offsets.empty() ? 0 : compressed_offsets.size() - 1;
+        }
+    };
+
+    // Reads the seek table at the end of `file`; returns an empty table if
+    // there is none, for a zstd file that can only be streamed.
+    ZstdSeekTable ReadZstdSeekTable(std::string_view file)
+    {
+        constexpr uint32_t kSkippableMagic = 0x184d2a5e;
+        constexpr uint32_t kSeekableMagic = 0x8f92eab1;
+        constexpr size_t kFooterSize = 9;
+        constexpr size_t kFrameHeaderSize = 8;
+
+        ZstdSeekTable table;
+        if (file.size() < kFrameHeaderSize + kFooterSize)
+            return table;
+        const char *footer = file.data() + file.size() - kFooterSize;
+        const uint64_t frame_count = ReadLittleEndian32(footer);
+        const auto descriptor = static_cast<unsigned char>(footer[4]);
+        if (ReadLittleEndian32(footer + 5) != kSeekableMagic || (descriptor & 0x7c) != 0)
+            return table;
+
+        const size_t entry_size = (descriptor & 0x80) ? 12 : 8;
+        const uint64_t table_size = kFrameHeaderSize + frame_count * entry_size + kFooterSize;
+        if (table_size > file.size())
+            return table;
+        const char *header = file.data() + file.size() - table_size;
+        if (ReadLittleEndian32(header) != kSkippableMagic ||
+            ReadLittleEndian32(header + 4) != table_size - kFrameHeaderSize)
+            return table;
+
+        table.compressed_offsets.reserve(frame_count + 1);
+        table.decompressed_offsets.reserve(frame_count + 1);
+        table.compressed_offsets.push_back(0);
+        table.decompressed_offsets.push_back(0);
+        for (uint64_t i = 0; i < frame_count; ++i)
+        {
+            const char *entry = header + kFrameHeaderSize + i * entry_size;
+            table.compressed_offsets.push_back(table.compressed_offsets.back() + ReadLittleEndian32(entry));
+            table.decompressed_offsets.push_back(table.decompressed_offsets.back() + ReadLittleEndian32(entry + 4));
+        }
+        if (table.compressed_offsets.back() != file.size() - table_size)
+            return {};
+        return table;
+    }
+
+#ifdef SEARCH_HAVE_ZSTD
+    // Streams the zstd frames in `compressed` through StreamWindows,
+    // passing over skippable frames such as a seek table. Before each read
+    // `wanted()` caps how many more bytes are decompressed, and 0 stops.
+    template <typename Wanted, typename WindowHandler>
+    void DecompressZstd(std::string_view compressed, Wanted &&wanted, WindowHandler &&handler)
+    {
+        std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+        if (!context)
+        {
+            throw std::runtime_error("Error initializing zstd");
+        }
+
+        ZSTD_inBuffer input{compressed.data(), compressed.size(), 0};
+        size_t pending = 0; // nonzero while a frame is incomplete
+        auto fill = [&](char *destination, size_t capacity) -> size_t
+        {
+            const uint64_t max_output = wanted();
+            ZSTD_outBuffer output{destination, static_cast<size_t>(std::min<uint64_t>(capacity, max_output)), 0};
+            while (output.size > 0 && output.pos == 0 && (input.pos < input.size || pending != 0))
+            {
+                const size_t input_before = input.pos;
+                pending = ZSTD_decompressStream(context.get(), &output, &input);
+                if (ZSTD_isError(pending))
+                {
+                    throw std::runtime_error(std::string("Error decompressing zstd stream: ") +
+                                             ZSTD_getErrorName(pending));
+                }
+                if (output.pos == 0 && input.pos == input_before && input.pos == input.size)
+                {
+                    throw std::runtime_error("Unexpected end of zstd stream");
+                }
+            }
+            return output.pos;
+        };
+        StreamWindows(fill, handler);
+    }
+
+    // Streams a zstd file through StreamWindows, all frames in one go.
+    class ZstdReader
+    {
+    public:
+        explicit ZstdReader(const std::string &filename) : compressed_(filename)
+        {
+        }
+
+        template <typename Wanted, typename WindowHandler>
+        void ForEachChunk(Wanted &&wanted, WindowHandler &&handler)
+        {
+            DecompressZstd(compressed_.View(), wanted, handler);
+        }
+
+    private:
+        MappedFile compressed_;
+    };
+#endif
+
+    // ASCII case folding; bytes outside A-Z are left alone.
+    char FoldCase(char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+    }
+
+    bool IsAsciiLetter(char c)
+    {
+        return FoldCase(c) >= 'a' && FoldCase(c) <= 'z';
+    }
+
+    bool EqualsFolded(const char *a, const char *b, size_t length)
+    {
+        for (size_t i = 0; i < length; ++i)
+        {
+            if (FoldCase(a[i]) != FoldCase(b[i]))
+                return false;
+        }
+        return true;
+    }
+
+    // With `fold` the bad-character table is filled for both cases of every
+    // pattern letter, so the shifts stay as long as in case-sensitive mode.
+    std::vector<size_t> BoyerMoore(std::string_view text, std::string_view pattern, bool fold)
+    {
+        std::vector<size_t> results;
+        int m = pattern.length();
+        int n = text.length();
+
+        if (m == 0 || n == 0 || m > n)
+            return results;
+
+        std::array<int, 256> bad_char;
+        bad_char.fill(-1);
+
+        for (int i = 0; i < m; i++)
+        {
+            bad_char[static_cast<unsigned char>(pattern[i])] = i;
+            if (fold && IsAsciiLetter(pattern[i]))
+            {
+                const char lower = FoldCase(pattern[i]);
+                bad_char[static_cast<unsigned char>(lower)] = i;
+                bad_char[static_cast<unsigned char>(lower - ('a' - 'A'))] = i;
+            }
+        }
+
+        for (int s = 0; s <= (n - m);)
+        {
+            int j = m - 1;
+            while (j >= 0 && (pattern[j] == text[s + j] || (fold && FoldCase(pattern[j]) == FoldCase(text[s + j]))))
+                j--;
+
+            if (j < 0)
+            {
+                results.push_back(s);
+                s += (s + m < n) ? m - bad_char[static_cast<unsigned char>(text[s + m])] : 1;
+            }
+            else
+            {
+                s += std::max(1, j - bad_char[static_cast<unsigned char>(text[s + j])]);
+            }
+        }
+
+        return results;
+    }
+
+    // Compares the bytes between the first and the last of a candidate
+    // match, which the SIMD filters have already checked.
+    bool MiddleMatches(const char *candidate, std::string_view pattern, bool fold)
+    {
+        const size_t m = pattern.length();
+        if (m <= 2)
+            return true;
+        return fold ? EqualsFolded(candidate + 1, pattern.data() + 1, m - 2)
+                    : std::memcmp(candidate + 1, pattern.data() + 1, m - 2) == 0;
+    }
+
+    // The SIMD filters OR 0x20 into text bytes compared against a pattern
+    // letter when folding, which maps exactly 'A'-'Z' onto 'a'-'z'.
+    char FoldMask(char c, bool fold)
+    {
+        return (fold && IsAsciiLetter(c)) ? 0x20 : 0;
+    }
+
+    // Positions where the first and last pattern bytes line up are verified
+    // with a compare of the bytes in between; this finishes the job for
+    // every starting position below text.size() - pattern.size() + 1 from
+    // `from` on.
+    void FindTail(std::string_view text, std::string_view pattern, size_t from, bool fold,
+                  std::vector<size_t> &results)
+    {
+        const size_t m = pattern.length();
+        const char first_mask = FoldMask(pattern[0], fold), last_mask = FoldMask(pattern[m - 1], fold);
+        for (size_t s = from; s + m <= text.length(); ++s)
+        {
+            if ((text[s] | first_mask) == (pattern[0] | first_mask) &&
+                (text[s + m - 1] | last_mask) == (pattern[m - 1] | last_mask) &&
+                MiddleMatches(text.data() + s, pattern, fold))
+            {
+                results.push_back(s);
+            }
+        }
+    }
+
+#if defined(SEARCH_X86)
+    // First-and-last-byte filter (W. Mula, "SIMD-friendly algorithms for
+    // substring searching"): compare 32 candidate positions at once against
+    // the first and the last pattern byte and only memcmp where both match.
+    SEARCH_TARGET("avx2")
+    std::vector<size_t> FindAvx2(std::string_view text, std::string_view pattern, bool fold)
+    {
+        std::vector<size_t> results;
+        const size_t m = pattern.length();
+        const size_t n = text.length();
+        if (m == 0 || n == 0 || m > n)
+            return results;
+
+        const __m256i first_mask = _mm256_set1_epi8(FoldMask(pattern[0], fold));
+        const __m256i last_mask = _mm256_set1_epi8(FoldMask(pattern[m - 1], fold));
+        const __m256i first = _mm256_or_si256(_mm256_set1_epi8(pattern[0]), first_mask);
+        const __m256i last = _mm256_or_si256(_mm256_set1_epi8(pattern[m - 1]), last_mask);
+        const char *data = text.data();
+
+        size_t i = 0;
+        for (; i + m - 1 + 32 <= n; i += 32)
+        {
+            const __m256i block_first = _mm256_or_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), first_mask);
+            const __m256i block_last = _mm256_or_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + m - 1)), last_mask);
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last))));
+            while (mask != 0)
+            {
+                const size_t pos = i + std::countr_zero(mask);
+                if (MiddleMatches(data + pos, pattern, fold))
+                    results.push_back(pos);
+                mask &= mask - 1;
+            }
+        }
+
+        FindTail(text, pattern, i, fold, results);
+        return results;
+    }
+
+    SEARCH_TARGET("sse2")
+    std::vector<size_t> FindSse2(std::string_view text, std::string_view pattern, bool fold)
+    {
+        std::vector<size_t> results;
+        const size_t m = pattern.length();
+        const size_t n = text.length();
+        if (m == 0 || n == 0 || m > n)
+            return results;
+
+        const __m128i first_mask = _mm_set1_epi8(FoldMask(pattern[0], fold));
+        const __m128i last_mask = _mm_set1_epi8(FoldMask(pattern[m - 1], fold));
+        const __m128i first = _mm_or_si128(_mm_set1_epi8(pattern[0]), first_mask);
+        const __m128i last = _mm_or_si128(_mm_set1_epi8(pattern[m - 1]), last_mask);
+        const char *data = text.data();
+
+        size_t i = 0;
+        for (; i + m - 1 + 16 <= n; i += 16)
+        {
+            const __m128i block_first = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)),
+                                                     first_mask);
+            const __m128i block_last = _mm_or_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + m - 1)), last_mask);
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last))));
+            while (mask != 0)
+            {
+                const size_t pos = i + std::countr_zero(mask);
+                if (MiddleMatches(data + pos, pattern, fold))
+                    results.push_back(pos);
+                mask &= mask - 1;
+            }
+        }
+
+        FindTail(text, pattern, i, fold, results);
+        return results;
+    }
+#elif defined(SEARCH_NEON)
+    std::vector<size_t> FindNeon(std::string_view text, std::string_view pattern, bool fold)
+    {
+        std::vector<size_t> results;
+        const size_t m = pattern.length();
+        const size_t n = text.length();
+        if (m == 0 || n == 0 || m > n)
+            return results;
+
+        const uint8x16_t first_mask = vdupq_n_u8(static_cast<uint8_t>(FoldMask(pattern[0], fold)));
+        const uint8x16_t last_mask = vdupq_n_u8(static_cast<uint8_t>(FoldMask(pattern[m - 1], fold)));
+        const uint8x16_t first = vorrq_u8(vdupq_n_u8(static_cast<uint8_t>(pattern[0])), first_mask);
+        const uint8x16_t last = vorrq_u8(vdupq_n_u8(static_cast<uint8_t>(pattern[m - 1])), last_mask);
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(text.data());
+
+        size_t i = 0;
+        for (; i + m - 1 + 16 <= n; i += 16)
+        {
+            const uint8x16_t eq = vandq_u8(vceqq_u8(first, vorrq_u8(vld1q_u8(data + i), first_mask)),
+                                           vceqq_u8(last, vorrq_u8(vld1q_u8(data + i + m - 1), last_mask)));
+            // NEON has no movemask; narrowing by 4 leaves one nibble per byte.
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            while (mask != 0)
+            {
+                const size_t pos = i + std::countr_zero(mask) / 4;
+                if (MiddleMatches(reinterpret_cast<const char *>(data) + pos, pattern, fold))
+                    results.push_back(pos);
+                mask &= ~(uint64_t{0xF} << ((pos - i) * 4));
+            }
+        }
+
+        FindTail(text, pattern, i, fold, results);
+        return results;
+    }
+#endif
+
+    // Patterns up to this long fit one 16-byte register, so the kernels
+    // below verify a candidate with a single compare instead of a memcmp.
+    constexpr size_t kMaxShortPattern = 16;
+
+    // The needle padded to 16 bytes, with the 0x20 fold bits of its letters.
+    struct ShortNeedle
+    {
+        alignas(16) char bytes[16] = {};
+        alignas(16) char fold_mask[16] = {};
+
+        ShortNeedle(std::string_view pattern, bool fold)
+        {
+            for (size_t i = 0; i < pattern.size(); ++i)
+            {
+                fold_mask[i] = FoldMask(pattern[i], fold);
+                bytes[i] = static_cast<char>(pattern[i] | fold_mask[i]);
+            }
+        }
+    };
+
+#if defined(SEARCH_X86)
+    // The same first-and-last-byte filter as FindAvx2 and FindSse2, for a
+    // pattern length fixed at compile time. Each candidate is verified by
+    // comparing 16 text bytes against the needle register; the main loops
+    // stop 15 bytes early so that load stays inside the text.
+    template <size_t M>
+    SEARCH_TARGET("avx2")
+    std::vector<size_t> FindShortAvx2(std::string_view text, std::string_view pattern, bool fold)
+    {
+        static_assert(M >= 2 && M <= kMaxShortPattern);
+        constexpr uint32_t kAllBytes = (uint32_t{1} << M) - 1;
+        std::vector<size_t> results;
+        const size_t n = text.length();
+        if (n < M)
+            return results;
+
+        const ShortNeedle short_needle(pattern, fold);
+        const __m128i needle = _mm_load_si128(reinterpret_cast<const __m128i *>(short_needle.bytes));
+        const __m128i needle_mask = _mm_load_si128(reinterpret_cast<const __m128i *>(short_needle.fold_mask));
+        const __m256i first_mask = _mm256_set1_epi8(short_needle.fold_mask[0]);
+        const __m256i last_mask = _mm256_set1_epi8(short_needle.fold_mask[M - 1]);
+        const __m256i first = _mm256_set1_epi8(short_needle.bytes[0]);
+        const __m256i last = _mm256_set1_epi8(short_needle.bytes[M - 1]);
+        const char *data = text.data();
+
+        size_t i = 0;
+        for (; i + 32 + 15 <= n; i += 32)
+        {
+            const __m256i block_first = _mm256_or_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), first_mask);
+            const __m256i block_last = _mm256_or_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + M - 1)), last_mask);
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last))));
+            while (mask != 0)
+            {
+                const size_t pos = i + std::countr_zero(mask);
+                const __m128i candidate = _mm_or_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos)), needle_mask);
+                if ((static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(candidate, needle))) & kAllBytes) ==
+                    kAllBytes)
+                    results.push_back(pos);
+                mask &= mask - 1;
+            }
+        }
+
+        FindTail(text, pattern, i, fold, results);
+        return results;
+    }
+
+    template <size_t M>
+    SEARCH_TARGET("sse2")
+    std::vector<size_t> FindShortSse2(std::string_view text, std::string_view pattern, bool fold)
+    {
+        static_assert(M >= 2 && M <= kMaxShortPattern);
+        constexpr uint32_t kAllBytes = (uint32_t{1} << M) - 1;
+        std::vector<size_t> results;
+        const size_t n = text.length();
+        if (n < M)
+            return results;
+
+        const ShortNeedle short_needle(pattern, fold);
+        const __m128i needle = _mm_load_si128(reinterpret_cast<const __m128i *>(short_needle.bytes));
+        const __m128i needle_mask = _mm_load_si128(reinterpret_cast<const __m128i *>(short_needle.fold_mask));
+        const __m128i first_mask = _mm_set1_epi8(short_needle.fold_mask[0]);
+        const __m128i last_mask = _mm_set1_epi8(short_needle.fold_mask[M - 1]);
+        const __m128i first = _mm_set1_epi8(short_needle.bytes[0]);
+        const __m128i last = _mm_set1_epi8(short_needle.bytes[M - 1]);
+        const char *data = text.data();
+
+        size_t i = 0;
+        for (; i + 16 + 15 <= n; i += 16)
+        {
+            const __m128i block_first = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)),
+                                                     first_mask);
+            const __m128i block_last = _mm_or_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + M - 1)), last_mask);
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last))));
+            while (mask != 0)
+            {
+                const size_t pos = i + std::countr_zero(mask);
+                const __m128i candidate = _mm_or_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos)), needle_mask);
+                if ((static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(candidate, needle))) & kAllBytes) ==
+                    kAllBytes)
+                    results.push_back(pos);
+                mask &= mask - 1;
+            }
+        }
+
+        FindTail(text, pattern, i, fold, results);
+        return results;
+    }
+#elif defined(SEARCH_NEON)
+    template <size_t M>
+    std::vector<size_t> FindShortNeon(std::string_view text, std::string_view pattern, bool fold)
+    {
+        static_assert(M >= 2 && M <= kMaxShortPattern);
+        std::vector<size_t> results;
+        const size_t n = text.length();
+        if (n < M)
+            return results;
+
+        const ShortNeedle short_needle(pattern, fold);
+        const uint8x16_t needle = vld1q_u8(reinterpret_cast<const uint8_t *>(short_needle.bytes));
+        const uint8x16_t needle_mask = vld1q_u8(reinterpret_cast<const uint8_t *>(short_needle.fold_mask));
+        // Lanes past the pattern compare as equal.
+        static constexpr auto kPadding = []
+        {
+            std::array<uint8_t, 16> padding{};
+            for (size_t lane = M; lane < 16; ++lane)
+                padding[lane] = 0xFF;
+            return padding;
+        }();
+        const uint8x16_t padding = vld1q_u8(kPadding.data());
+        const uint8x16_t first_mask = vdupq_n_u8(static_cast<uint8_t>(short_needle.fold_mask[0]));
+        const uint8x16_t last_mask = vdupq_n_u8(static_cast<uint8_t>(short_needle.fold_mask[M - 1]));
+        const uint8x16_t first = vdupq_n_u8(static_cast<uint8_t>(short_needle.bytes[0]));
+        const uint8x16_t last = vdupq_n_u8(static_cast<uint8_t>(short_needle.bytes[M - 1]));
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(text.data());
+
+        size_t i = 0;
+        for (; i + 16 + 15 <= n; i += 16)
+        {
+            const uint8x16_t eq = vandq_u8(vceqq_u8(first, vorrq_u8(vld1q_u8(data + i), first_mask)),
+                                           vceqq_u8(last, vorrq_u8(vld1q_u8(data + i + M - 1), last_mask)));
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            while (mask != 0)
+            {
+                const size_t pos = i + std::countr_zero(mask) / 4;
+                const uint8x16_t candidate = vorrq_u8(vld1q_u8(data + pos), needle_mask);
+                if (vminvq_u8(vorrq_u8(vceqq_u8(candidate, needle), padding)) == 0xFF)
+                    results.push_back(pos);
+                mask &= ~(uint64_t{0xF} << ((pos - i) * 4));
+            }
+        }
+
+        FindTail(text, pattern, i, fold, results);
+        return results;
+    }
+#endif
+
+    using FindFunction = std::vector<size_t> (*)(std::string_view, std::string_view, bool);
+    using ShortFindKernels = std::array<FindFunction, kMaxShortPattern + 1>;
+
+    // The short-pattern kernels for every length from 2 to kMaxShortPattern;
+    // single bytes and longer patterns are left to the generic kernel.
+#if defined(SEARCH_X86)
+    template <size_t... Lengths>
+    ShortFindKernels ShortKernelsAvx2(std::index_sequence<Lengths...>)
+    {
+        return {nullptr, nullptr, FindShortAvx2<Lengths + 2>...};
+    }
+
+    template <size_t... Lengths>
+    ShortFindKernels ShortKernelsSse2(std::index_sequence<Lengths...>)
+    {
+        return {nullptr, nullptr, FindShortSse2<Lengths + 2>...};
+    }
+#elif defined(SEARCH_NEON)
+    template <size_t... Lengths>
+    ShortFindKernels ShortKernelsNeon(std::index_sequence<Lengths...>)
+    {
+        return {nullptr, nullptr, FindShortNeon<Lengths + 2>...};
+    }
+#endif
+
+    struct CpuFeatures
+    {
+        bool sse2 = false;
+        bool avx2 = false;
+    };
+
+    CpuFeatures DetectCpuFeatures()
+    {
+        CpuFeatures features;
+#if defined(SEARCH_X86)
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        const int max_leaf = info[0];
+        __cpuid(info, 1);
+        const bool has_sse2 = (info[3] & (1 << 26)) != 0;
+        const bool has_osxsave = (info[2] & (1 << 27)) != 0;
+        bool has_avx2 = false;
+        if (max_leaf >= 7 && has_osxsave && (_xgetbv(0) & 0x6) == 0x6)
+        {
+            __cpuidex(info, 7, 0);
+            has_avx2 = (info[1] & (1 << 5)) != 0;
+        }
+#else
+        __builtin_cpu_init();
+        const bool has_sse2 = __builtin_cpu_supports("sse2");
+        const bool has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+        features.sse2 = has_sse2;
+        features.avx2 = has_avx2;
+#endif
+        return features;
+    }
+
+    struct FindKernels
+    {
+        FindFunction generic = BoyerMoore;
+        ShortFindKernels short_patterns{}; // indexed by pattern length
+    };
+
+    FindKernels SelectFindKernels()
+    {
+        FindKernels kernels;
+        [[maybe_unused]] constexpr auto kLengths = std::make_index_sequence<kMaxShortPattern - 1>();
+#if defined(SEARCH_X86)
+        const CpuFeatures features = DetectCpuFeatures();
+        if (features.avx2)
+            kernels = {FindAvx2, ShortKernelsAvx2(kLengths)};
+        else if (features.sse2)
+            kernels = {FindSse2, ShortKernelsSse2(kLengths)};
+#elif defined(SEARCH_NEON)
+        kernels = {FindNeon, ShortKernelsNeon(kLengths)};
+#endif
+        return kernels;
+    }
+
+    // The fastest kernel the CPU supports for patterns of this length:
+    // one specialized for the length if it is short, else the generic SIMD
+    // filter, falling back to BoyerMoore.
+    FindFunction SelectFindKernel(size_t length)
+    {
+        static const FindKernels kernels = SelectFindKernels();
+        if (length <= kMaxShortPattern && kernels.short_patterns[length])
+            return kernels.short_patterns[length];
+        return kernels.generic;
+    }
+
+    // Finds every (possibly overlapping) occurrence of pattern in text. With
+    // `fold` ASCII letters match regardless of case.
+    std::vector<size_t> FindAll(std::string_view text, std::string_view pattern, bool fold = false)
+    {
+        return SelectFindKernel(pattern.length())(text, pattern, fold);
+    }
+
+    size_t CountNewlinesScalar(std::string_view text)
+    {
+        return static_cast<size_t>(std::count(text.begin(), text.end(), '\n'));
+    }
+
+#if defined(SEARCH_X86)
+    // Subtracting each compare mask from a byte accumulator adds one per
+    // newline; the bytes are widened with a SAD before they can overflow.
+    SEARCH_TARGET("avx2")
+    size_t CountNewlinesAvx2(std::string_view text)
+    {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const char *data = text.data();
+        const size_t n = text.length();
+        __m256i totals = _mm256_setzero_si256();
+
+        size_t i = 0;
+        while (i + 32 <= n)
+        {
+            __m256i counts = _mm256_setzero_si256();
+            for (int round = 0; round < 255 && i + 32 <= n; ++round, i += 32)
+            {
+                const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+                counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(block, newline));
+            }
+            totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), totals);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + CountNewlinesScalar(text.substr(i));
+    }
+
+    SEARCH_TARGET("sse2")
+    size_t CountNewlinesSse2(std::string_view text)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        const char *data = text.data();
+        const size_t n = text.length();
+        __m128i totals = _mm_setzero_si128();
+
+        size_t i = 0;
+        while (i + 16 <= n)
+        {
+            __m128i counts = _mm_setzero_si128();
+            for (int round = 0; round < 255 && i + 16 <= n; ++round, i += 16)
+            {
+                const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(block, newline));
+            }
+            totals = _mm_add_epi64(totals, _mm_sad_epu8(counts, _mm_setzero_si128()));
+        }
+
+        alignas(16) uint64_t lanes[2];
+        _mm_store_si128(reinterpret_cast<__m128i *>(lanes), totals);
+        return lanes[0] + lanes[1] + CountNewlinesScalar(text.substr(i));
+    }
+#elif defined(SEARCH_NEON)
+    size_t CountNewlinesNeon(std::string_view text)
+    {
+        const uint8x16_t newline = vdupq_n_u8('\n');
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(text.data());
+        const size_t n = text.length();
+        uint64_t total = 0;
+
+        size_t i = 0;
+        while (i + 16 <= n)
+        {
+            uint8x16_t counts = vdupq_n_u8(0);
+            for (int round = 0; round < 255 && i + 16 <= n; ++round, i += 16)
+            {
+                counts = vsubq_u8(counts, vceqq_u8(vld1q_u8(data + i), newline));
+            }
+            total += vaddlvq_u8(counts);
+        }
+
+        return total + CountNewlinesScalar(text.substr(i));
+    }
+#endif
+
+    using CountFunction = size_t (*)(std::string_view);
+
+    CountFunction SelectCountKernel()
+    {
+#if defined(SEARCH_X86)
+        const CpuFeatures features = DetectCpuFeatures();
+        if (features.avx2)
+            return CountNewlinesAvx2;
+        if (features.sse2)
+            return CountNewlinesSse2;
+#elif defined(SEARCH_NEON)
+        return CountNewlinesNeon;
+#endif
+        return CountNewlinesScalar;
+    }
+
+    // Counts the '\n' bytes in text with the fastest kernel the CPU supports.
+    size_t CountNewlines(std::string_view text)
+    {
+        static const CountFunction kernel = SelectCountKernel();
+        return kernel(text);
+    }
+
+    // A line of a block as SplitLines finds it, without its newline. Blocks
+    // are at most kLineBlockSize bytes, so 32 bits hold both fields.
+    struct LineSpan
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    // Small enough that a block's spans stay in cache while they are matched.
+    constexpr size_t kLineBlockSize = 16 * 1024;
+
+    // Continues splitting at `from`, with the current line starting at
+    // `begin`, and returns the new span count.
+    size_t SplitLinesFrom(std::string_view text, size_t from, uint32_t begin, LineSpan *spans, size_t count)
+    {
+        const char *data = text.data();
+        while (const void *found = std::memchr(data + from, '\n', text.length() - from))
+        {
+            const uint32_t end = static_cast<uint32_t>(static_cast<const char *>(found) - data);
+            spans[count++] = {begin, end - begin};
+            begin = end + 1;
+            from = begin;
+        }
+        return count;
+    }
+
+    // Each kernel writes a span for every '\n'-terminated line of `text` to
+    // `spans`, which has room for text.length() of them, and returns how
+    // many. The bytes after the last newline are left to the caller.
+    size_t SplitLinesScalar(std::string_view text, LineSpan *spans)
+    {
+        return SplitLinesFrom(text, 0, 0, spans, 0);
+    }
+
+#if defined(SEARCH_X86)
+    SEARCH_TARGET("avx2")
+    size_t SplitLinesAvx2(std::string_view text, LineSpan *spans)
+    {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const char *data = text.data();
+        size_t count = 0;
+        uint32_t begin = 0;
+
+        size_t i = 0;
+        for (; i + 32 <= text.length(); i += 32)
+        {
+            const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+            while (mask != 0)
+            {
+                const uint32_t end = static_cast<uint32_t>(i + std::countr_zero(mask));
+                spans[count++] = {begin, end - begin};
+                begin = end + 1;
+                mask &= mask - 1;
+            }
+        }
+
+        return SplitLinesFrom(text, i, begin, spans, count);
+    }
+
+    SEARCH_TARGET("sse2")
+    size_t SplitLinesSse2(std::string_view text, LineSpan *spans)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        const char *data = text.data();
+        size_t count = 0;
+        uint32_t begin = 0;
+
+        size_t i = 0;
+        for (; i + 16 <= text.length(); i += 16)
+        {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+            while (mask != 0)
+            {
+                const uint32_t end = static_cast<uint32_t>(i + std::countr_zero(mask));
+                spans[count++] = {begin, end - begin};
+                begin = end + 1;
+                mask &= mask - 1;
+            }
+        }
+
+        return SplitLinesFrom(text, i, begin, spans, count);
+    }
+#elif defined(SEARCH_NEON)
+    size_t SplitLinesNeon(std::string_view text, LineSpan *spans)
+    {
+        const uint8x16_t newline = vdupq_n_u8('\n');
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(text.data());
+        size_t count = 0;
+        uint32_t begin = 0;
+
+        size_t i = 0;
+        for (; i + 16 <= text.length(); i += 16)
+        {
+            const uint8x16_t eq = vceqq_u8(vld1q_u8(data + i), newline);
+            // One nibble per byte as in FindAllNeon; keeping a single bit of
+            // each lets mask - 1 clear one newline at a time.
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) &
+                            0x8888888888888888ULL;
+            while (mask != 0)
+            {
+                const uint32_t end = static_cast<uint32_t>(i + std::countr_zero(mask) / 4);
+                spans[count++] = {begin, end - begin};
+                begin = end + 1;
+                mask &= mask - 1;
+            }
+        }
+
+        return SplitLinesFrom(text, i, begin, spans, count);
+    }
+#endif
+
+    using SplitFunction = size_t (*)(std::string_view, LineSpan *);
+
+    SplitFunction SelectSplitKernel()
+    {
+#if defined(SEARCH_X86)
+        const CpuFeatures features = DetectCpuFeatures();
+        if (features.avx2)
+            return SplitLinesAvx2;
+        if (features.sse2)
+            return SplitLinesSse2;
+#elif defined(SEARCH_NEON)
+        return SplitLinesNeon;
+#endif
+        return SplitLinesScalar;
+    }
+
+    // How a line must contain the keyword for --line.
+    enum class LineMatch
+    {
+        Exact,
+        Prefix,
+        Suffix,
+    };
+
+    // Matches the keyword against whole lines: a line matches if it equals,
+    // starts with or ends with it, and its length (without a trailing '\r')
+    // lies in [min_length, max_length]. The text is split into line spans a
+    // block at a time first, so lines of the wrong length are skipped
+    // without reading their bytes.
+    class LineMatcher
+    {
+    public:
+        static constexpr bool kLineOriented = true;
+
+        LineMatcher(std::string keyword, LineMatch mode, size_t min_length = 0, size_t max_length = SIZE_MAX,
+                    bool fold = false)
+            : keyword_(std::move(keyword)), mode_(mode), fold_(fold), split_(SelectSplitKernel())
+        {
+            // No shorter line can hold the keyword, and an exact match is
+            // exactly as long.
+            min_length_ = std::max(min_length, keyword_.length());
+            max_length_ = (mode == LineMatch::Exact) ? std::min(max_length, keyword_.length()) : max_length;
+        }
+
+        size_t PatternCount() const
+        {
+            return 1;
+        }
+
+        const std::string &Pattern(size_t) const
+        {
+            return keyword_;
+        }
+
+        // Bytes a window must share with the next one: none, since matches
+        // never cross a line and the scanner carries partial lines.
+        size_t OverlapLength() const
+        {
+            return 0;
+        }
+
+        // Reports the keyword's place in each matching line, in order;
+        // `text` is expected to hold whole lines.
+        template <typename MatchHandler>
+        void ForEachMatch(std::string_view text, MatchHandler &&on_match) const
+        {
+            thread_local std::vector<LineSpan> spans(kLineBlockSize);
+            size_t base = 0;
+            while (base < text.length())
+            {
+                const std::string_view block = text.substr(base, kLineBlockSize);
+                const size_t count = split_(block, spans.data());
+                for (size_t i = 0; i < count; ++i)
+                    MatchLine(text, base + spans[i].offset, spans[i].length, on_match);
+                if (count > 0)
+                {
+                    base += spans[count - 1].offset + spans[count - 1].length + 1;
+                    continue;
+                }
+                // The line runs past the block, or is the unterminated last one.
+                const size_t end = std::min(text.find('\n', base + block.length()), text.length());
+                MatchLine(text, base, end - base, on_match);
+                base = end + 1;
+            }
+        }
+
+    private:
+        template <typename MatchHandler>
+        void MatchLine(std::string_view text, size_t begin, size_t length, MatchHandler &on_match) const
+        {
+            // A '\r' can only make the line one byte longer than it counts.
+            if (length < min_length_ || (length > 0 && length - 1 > max_length_))
+                return;
+            const char *line = text.data() + begin;
+            if (length > 0 && line[length - 1] == '\r' && --length < min_length_)
+                return;
+            if (length > max_length_)
+                return;
+
+            const size_t offset = (mode_ == LineMatch::Suffix) ? length - keyword_.length() : 0;
+            const bool equal = fold_ ? EqualsFolded(line + offset, keyword_.data(), keyword_.length())
+                                     : std::memcmp(line + offset, keyword_.data(), keyword_.length()) == 0;
+            if (equal)
+                on_match(begin + offset, keyword_.length(), size_t{0});
+        }
+
+        std::string keyword_;
+        LineMatch mode_;
+        bool fold_;
+        size_t min_length_;
+        size_t max_length_;
+        SplitFunction split_;
+    };
+
+    // Matches a single keyword with the FindAll kernel for its length.
+    class KeywordMatcher
+    {
+    public:
+        static constexpr bool kLineOriented = false;
+
+        explicit KeywordMatcher(std::string keyword, bool fold = false)
+            : keyword_(std::move(keyword)), fold_(fold), find_(SelectFindKernel(keyword_.length()))
+        {
+        }
+
+        size_t PatternCount() const
+        {
+            return 1;
+        }
+
+        const std::string &Pattern(size_t) const
+        {
+            return keyword_;
+        }
+
+        // Bytes a window must share with the next one so that a match across
+        // their boundary is found: all of the keyword but its last byte.
+        size_t OverlapLength() const
+        {
+            return keyword_.empty() ? 0 : keyword_.length() - 1;
+        }
+
+        template <typename MatchHandler>
+        void ForEachMatch(std::string_view text, MatchHandler &&on_match) const
+        {
+            for (size_t pos : find_(text, keyword_, fold_))
+            {
+                on_match(pos, keyword_.length(), size_t{0});
+            }
+        }
+
+    private:
+        std::string keyword_;
+        bool fold_;
+        FindFunction find_; // picked once for the keyword's length
+    };
+
+    // Aho-Corasick automaton over a set of patterns, compiled into a dense
+    // DFA whose alphabet is reduced to the bytes that occur in any pattern,
+    // so a single pass over the text reports every occurrence of every
+    // pattern. With `fold` the patterns are lowercased and both cases of a
+    // letter share one byte class, which costs the scan nothing.
+    class PatternSet
+    {
+    public:
+        static constexpr bool kLineOriented = false;
+
+        explicit PatternSet(std::vector<std::string> patterns, bool fold = false)
+        {
+            for (auto &pattern : patterns)
+            {
+                if (fold)
+                    std::transform(pattern.begin(), pattern.end(), pattern.begin(), FoldCase);
+                if (!pattern.empty())
+                    patterns_.push_back(std::move(pattern));
+            }
+            std::sort(patterns_.begin(), patterns_.end());
+            patterns_.erase(std::unique(patterns_.begin(), patterns_.end()), patterns_.end());
+            if (patterns_.empty())
+            {
+                throw std::runtime_error("Pattern list is empty");
+            }
+
+            byte_class_.fill(0);
+            for (const auto &pattern : patterns_)
+            {
+                max_pattern_length_ = std::max(max_pattern_length_, pattern.length());
+                for (char c : pattern)
+                {
+                    auto &byte_class = byte_class_[static_cast<unsigned char>(c)];
+                    if (byte_class == 0)
+                        byte_class = static_cast<uint16_t>(class_count_++);
+                }
+            }
+            if (fold)
+            {
+                for (char c = 'A'; c <= 'Z'; ++c)
+                {
+                    byte_class_[static_cast<unsigned char>(c)] = byte_class_[static_cast<unsigned char>(FoldCase(c))];
+                }
+            }
+
+            // Build the trie; state 0 is the root and no trie edge points back
+            // to it, so 0 doubles as "no child" until the DFA is completed.
+            transitions_.assign(class_count_, 0);
+            output_.push_back(kNoPattern);
+            for (size_t p = 0; p < patterns_.size(); ++p)
+            {
+                uint32_t state = 0;
+                for (char c : patterns_[p])
+                {
+                    size_t slot = state * class_count_ + byte_class_[static_cast<unsigned char>(c)];
+                    if (transitions_[slot] == 0)
+                    {
+                        transitions_[slot] = static_cast<uint32_t>(output_.size());
+                        output_.push_back(kNoPattern);
+                        transitions_.resize(transitions_.size() + class_count_, 0);
+                    }
+                    state = transitions_[slot];
+                }
+                output_[state] = static_cast<uint32_t>(p);
+            }
+
+            // Breadth-first pass computing failure links, turning missing
+            // edges into DFA transitions and linking every state to the next
+            // state on its failure chain that ends a pattern.
+            const size_t state_count = output_.size();
+            std::vector<uint32_t> fail(state_count, 0);
+            std::vector<uint32_t> queue;
+            queue.reserve(state_count);
+            output_link_.assign(state_count, 0);
+
+            for (size_t c = 0; c < class_count_; ++c)
+            {
+                if (transitions_[c] != 0)
+                    queue.push_back(transitions_[c]);
+            }
+            for (size_t head = 0; head < queue.size(); ++head)
+            {
+                uint32_t state = queue[head];
+                for (size_t c = 0; c < class_count_; ++c)
+                {
+                    uint32_t &next = transitions_[state * class_count_ + c];
+                    uint32_t fallback = transitions_[fail[state] * class_count_ + c];
+                    if (next == 0)
+                    {
+                        next = fallback;
+                        continue;
+                    }
+                    fail[next] = fallback;
+                    output_link_[next] = (output_[fallback] != kNoPattern) ? fallback : output_link_[fallback];
+                    queue.push_back(next);
+                }
+            }
+
+            // Renumber states in breadth-first order. Scans spend nearly all of
+            // their time in the shallow states, which then share cache lines
+            // instead of being scattered across a table of many megabytes.
+            std::vector<uint32_t> renumbered(state_count, 0);
+            for (size_t i = 0; i < queue.size(); ++i)
+            {
+                renumbered[queue[i]] = static_cast<uint32_t>(i + 1);
+            }
+            std::vector<uint32_t> transitions(transitions_.size());
+            std::vector<uint32_t> output(state_count);
+            std::vector<uint32_t> output_link(state_count);
+            for (size_t s = 0; s < state_count; ++s)
+            {
+                uint32_t target = renumbered[s];
+                for (size_t c = 0; c < class_count_; ++c)
+                {
+                    transitions[target * class_count_ + c] = renumbered[transitions_[s * class_count_ + c]];
+                }
+                output[target] = output_[s];
+                output_link[target] = renumbered[output_link_[s]];
+            }
+            transitions_ = std::move(transitions);
+            output_ = std::move(output);
+            output_link_ = std::move(output_link);
+
+            // Store transitions as row offsets so the scan loop needs neither a
+            // multiply nor a second lookup: the top bit marks target states
+            // at which at least one pattern ends.
+            if (transitions_.size() > kRowMask)
+            {
+                throw std::runtime_error("Pattern list is too large for the automaton");
+            }
+            for (auto &next : transitions_)
+            {
+                bool reports = output_[next] != kNoPattern || output_link_[next] != 0;
+                next = static_cast<uint32_t>(next * class_count_) | (reports ? kReportFlag : 0);
+            }
+        }
+
+        size_t PatternCount() const
+        {
+            return patterns_.size();
+        }
+
+        const std::string &Pattern(size_t index) const
+        {
+            return patterns_[index];
+        }
+
+        // Bytes a window must share with the next one: all of the longest
+        // pattern but its last byte.
+        size_t OverlapLength() const
+        {
+            return max_pattern_length_ > 0 ? max_pattern_length_ - 1 : 0;
+        }
+
+        // Reports matches in order of their end position.
+        template <typename MatchHandler>
+        void ForEachMatch(std::string_view text, MatchHandler &&on_match) const
+        {
+            uint32_t row = 0;
+            for (size_t i = 0; i < text.length(); ++i)
+            {
+                uint32_t next = transitions_[row + byte_class_[static_cast<unsigned char>(text[i])]];
+                row = next & kRowMask;
+                if (!(next & kReportFlag))
+                    continue;
+                for (uint32_t s = static_cast<uint32_t>(row / class_count_); s != 0; s = output_link_[s])
+                {
+                    uint32_t pattern = output_[s];
+                    if (pattern == kNoPattern)
+                        continue;
+                    size_t length = patterns_[pattern].length();
+                    on_match(i + 1 - length, length, size_t{pattern});
+                }
+            }
+        }
+
+    private:
+        static constexpr uint32_t kNoPattern = UINT32_MAX;
+        static constexpr uint32_t kReportFlag = 0x80000000u;
+        static constexpr uint32_t kRowMask = 0x7fffffffu;
+
+        std::vector<std::string> patterns_;
+        size_t max_pattern_length_ = 0;
+        std::array<uint16_t, 256> byte_class_;
+        size_t class_count_ = 1; // class 0 holds every byte no pattern uses
+        std::vector<uint32_t> transitions_;
+        std::vector<uint32_t> output_;
+        std::vector<uint32_t> output_link_;
+    };
+
+    std::vector<std::string> ReadPatternsFile(const std::string &filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+        {
+            throw std::runtime_error("Error opening patterns file: " + filename);
+        }
+        std::vector<std::string> patterns;
+        for (std::string line; std::getline(in, line);)
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            patterns.push_back(std::move(line));
+        }
+        return patterns;
+    }
+
+    // Parsed form of a --regex pattern. Matching is line by line, as in
+    // grep: `.` and negated classes never match '\n', `^` and `$` only
+    // match at the start and end of a line.
+    struct RegexNode
+    {
+        enum class Kind
+        {
+            Empty,
+            Bytes, // one byte out of `bytes`
+            Concat,
+            Alternate,
+            Repeat, // `min` to `max` (kUnbounded) copies of children[0]
+            LineStart,
+            LineEnd,
+        };
+        static constexpr int kUnbounded = -1;
+
+        Kind kind = Kind::Empty;
+        std::bitset<256> bytes{};
+        std::vector<RegexNode> children{};
+        int min = 0;
+        int max = 0;
+    };
+
+    // Recursive-descent parser for the usual ERE syntax: literals, `.`,
+    // bracket classes with ranges, \d \w \s and their negations, groups,
+    // `|`, `* + ? {n} {n,} {n,m}` and the two anchors. With `fold` every
+    // letter matches both of its cases.
+    class RegexParser
+    {
+    public:
+        RegexParser(std::string_view pattern, bool fold) : pattern_(pattern), fold_(fold)
+        {
+        }
+
+        RegexNode Parse()
+        {
+            RegexNode node = ParseAlternation();
+            if (position_ < pattern_.size())
+                Fail("unmatched ')'");
+            return node;
+        }
+
+    private:
+        static constexpr int kMaxRepeat = 1000;
+
+        [[noreturn]] void Fail(const std::string &message) const
+        {
+            throw std::runtime_error("Invalid regex at offset " + std::to_string(position_) + ": " + message);
+        }
+
+        bool AtEnd() const
+        {
+            return position_ >= pattern_.size();
+        }
+
+        char Peek() const
+        {
+            return pattern_[position_];
+        }
+
+        RegexNode ParseAlternation()
+        {
+            RegexNode first = ParseConcat();
+            if (AtEnd() || Peek() != '|')
+                return first;
+            RegexNode node{RegexNode::Kind::Alternate};
+            node.children.push_back(std::move(first));
+            while (!AtEnd() && Peek() == '|')
+            {
+                ++position_;
+                node.children.push_back(ParseConcat());
+            }
+            return node;
+        }
+
+        RegexNode ParseConcat()
+        {
+            RegexNode node{RegexNode::Kind::Concat};
+            while (!AtEnd() && Peek() != '|' && Peek() != ')')
+            {
+                RegexNode item = ParseRepeat();
+                // Groups are spliced in, so literal runs stay visible.
+                if (item.kind == RegexNode::Kind::Concat)
+                    std::move(item.children.begin(), item.children.end(), std::back_inserter(node.children));
+                else if (item.kind != RegexNode::Kind::Empty)
+                    node.children.push_back(std::move(item));
+            }
+            if (node.children.size() == 1)
+                return std::move(node.children[0]);
+            return node;
+        }
+
+        RegexNode ParseRepeat()
+        {
+            RegexNode node = ParseAtom();
+            while (!AtEnd())
+            {
+                int min = 0, max = 0;
+                const size_t quantifier_start = position_;
+                if (Peek() == '*')
+                    min = 0, max = RegexNode::kUnbounded;
+                else if (Peek() == '+')
+                    min = 1, max = RegexNode::kUnbounded;
+                else if (Peek() == '?')
+                    min = 0, max = 1;
+                else if (Peek() != '{' || !ParseBounds(min, max))
+                    break;
+                if (position_ == quantifier_start)
+                    ++position_;
+                // Lazy quantifiers mean nothing to a leftmost-longest match.
+                if (!AtEnd() && Peek() == '?')
+                    ++position_;
+
+                if (node.kind == RegexNode::Kind::LineStart || node.kind == RegexNode::Kind::LineEnd)
+                {
+                    position_ = quantifier_start;
+                    Fail("nothing to repeat");
+                }
+                if (node.kind == RegexNode::Kind::Empty)
+                    continue; // repeating "()" still matches nothing
+                RegexNode repeat{RegexNode::Kind::Repeat};
+                repeat.min = min;
+                repeat.max = max;
+                repeat.children.push_back(std::move(node));
+                node = std::move(repeat);
+            }
+            return node;
+        }
+
+        // Parses `{n}`, `{n,}` or `{n,m}` at the current position. Anything
+        // else leaves the position alone so that `{` is taken literally.
+        bool ParseBounds(int &min, int &max)
+        {
+            size_t at = position_ + 1;
+            auto read_number = [&](int &value)
+            {
+                const size_t begin = at;
+                value = 0;
+                while (at < pattern_.size() && pattern_[at] >= '0' && pattern_[at] <= '9')
+                {
+                    value = std::min(value * 10 + (pattern_[at] - '0'), kMaxRepeat + 1);
+                    ++at;
+                }
+                return at > begin;
+            };
+            if (!read_number(min))
+                return false;
+            max = min;
+            if (at < pattern_.size() && pattern_[at] == ',')
+            {
+                ++at;
+                if (!read_number(max))
+                    max = RegexNode::kUnbounded;
+            }
+            if (at >= pattern_.size() || pattern_[at] != '}')
+                return false;
+            if (min > kMaxRepeat || max > kMaxRepeat)
+                Fail("repeat count above " + std::to_string(kMaxRepeat));
+            if (max != RegexNode::kUnbounded && max < min)
+                Fail("repeat bounds out of order");
+            position_ = at + 1;
+            return true;
+        }
+
+        RegexNode ParseAtom()
+        {
+            const char c = pattern_[position_++];
+            switch (c)
+            {
+            case '(':
+            {
+                if (pattern_.substr(position_).starts_with("?:"))
+                    position_ += 2;
+                RegexNode node = ParseAlternation();
+                if (AtEnd() || Peek() != ')')
+                    Fail("missing ')'");
+                ++position_;
+                return node;
+            }
+            case '[':
+                return MakeBytes(ParseClass());
+            case '.':
+                return MakeBytes(std::bitset<256>().set().reset('\n'));
+            case '^':
+                return RegexNode{RegexNode::Kind::LineStart};
+            case '$':
+                return RegexNode{RegexNode::Kind::LineEnd};
+            case '\\':
+                return MakeBytes(ParseEscape());
+            case '*':
+            case '+':
+            case '?':
+                --position_;
+                Fail("nothing to repeat");
+            default:
+                return MakeBytes(std::bitset<256>().set(static_cast<unsigned char>(c)));
+            }
+        }
+
+        RegexNode MakeBytes(std::bitset<256> bytes) const
+        {
+            if (fold_)
+            {
+                for (int c = 'a'; c <= 'z'; ++c)
+                {
+                    if (bytes[c] || bytes[c - 'a' + 'A'])
+                        bytes.set(c).set(c - 'a' + 'A');
+                }
+            }
+            RegexNode node{RegexNode::Kind::Bytes};
+            node.bytes = bytes;
+            return node;
+        }
+
+        // Parses the escape after a backslash, inside or outside a class.
+        std::bitset<256> ParseEscape()
+        {
+            if (AtEnd())
+                Fail("trailing backslash");
+            const char c = pattern_[position_++];
+            std::bitset<256> bytes;
+            auto add_range = [&](int from, int to)
+            {
+                for (int b = from; b <= to; ++b)
+                    bytes.set(b);
+            };
+            switch (c)
+            {
+            case 'd':
+            case 'D':
+                add_range('0', '9');
+                break;
+            case 'w':
+            case 'W':
+                add_range('0', '9');
+                add_range('a', 'z');
+                add_range('A', 'Z');
+                bytes.set('_');
+                break;
+            case 's':
+            case 'S':
+                for (char space : {' ', '\t', '\r', '\n', '\f', '\v'})
+                    bytes.set(static_cast<unsigned char>(space));
+                break;
+            case 't':
+                return bytes.set('\t');
+            case 'r':
+                return bytes.set('\r');
+            case 'n':
+                return bytes.set('\n');
+            case 'f':
+                return bytes.set('\f');
+            case 'v':
+                return bytes.set('\v');
+            case 'x':
+            {
+                auto hex_digit = [&](char h) -> int
+                {
+                    if (h >= '0' && h <= '9')
+                        return h - '0';
+                    if (h >= 'a' && h <= 'f')
+                        return h - 'a' + 10;
+                    if (h >= 'A' && h <= 'F')
+                        return h - 'A' + 10;
+                    Fail("invalid \\x escape");
+                };
+                if (position_ + 2 > pattern_.size())
+                    Fail("invalid \\x escape");
+                const int value = hex_digit(pattern_[position_]) * 16 + hex_digit(pattern_[position_ + 1]);
+                position_ += 2;
+                return bytes.set(static_cast<size_t>(value));
+            }
+            default:
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+                    Fail(std::string("unsupported escape \\") + c);
+                return bytes.set(static_cast<unsigned char>(c));
+            }
+            if (c >= 'A' && c <= 'Z')
+                bytes = ~bytes.set('\n');
+            return bytes;
+        }
+
+        // Parses a bracket expression after its '['.
+        std::bitset<256> ParseClass()
+        {
+            std::bitset<256> bytes;
+            const bool negated = !AtEnd() && Peek() == '^';
+            if (negated)
+                ++position_;
+            for (bool first = true;; first = false)
+            {
+                if (AtEnd())
+                    Fail("missing ']'");
+                char c = pattern_[position_++];
+                if (c == ']' && !first)
+                    break;
+                if (c == '\\')
+                {
+                    const std::bitset<256> escaped = ParseEscape();
+                    if (escaped.count() != 1)
+                    {
+                        bytes |= escaped;
+                        continue;
+                    }
+                    c = static_cast<char>(FirstByte(escaped));
+                }
+                if (position_ + 1 < pattern_.size() && Peek() == '-' && pattern_[position_ + 1] != ']')
+                {
+                    ++position_;
+                    char last = pattern_[position_++];
+                    if (last == '\\')
+                    {
+                        const std::bitset<256> escaped = ParseEscape();
+                        if (escaped.count() != 1)
+                            Fail("invalid class range");
+                        last = static_cast<char>(FirstByte(escaped));
+                    }
+                    if (static_cast<unsigned char>(last) < static_cast<unsigned char>(c))
+                        Fail("class range out of order");
+                    for (int b = static_cast<unsigned char>(c); b <= static_cast<unsigned char>(last); ++b)
+                        bytes.set(b);
+                }
+                else
+                    bytes.set(static_cast<unsigned char>(c));
+            }
+            // Fold before negating, or [^a] would match 'a' through 'A'.
+            if (fold_)
+                bytes = MakeBytes(bytes).bytes;
+            if (negated)
+                bytes = ~bytes.set('\n');
+            return bytes;
+        }
+
+        static int FirstByte(const std::bitset<256> &bytes)
+        {
+            for (int b = 0; b < 256; ++b)
+            {
+                if (bytes[b])
+                    return b;
+            }
+            return 0;
+        }
+
+        std::string_view pattern_;
+        const bool fold_;
+        size_t position_ = 0;
+    };
+
+    // Thompson NFA of a regex. Instruction 0 is the match.
+    struct RegexProgram
+    {
+        enum class Op : uint8_t
+        {
+            Match,
+            Bytes,
+            Split, // to both `next` and `alternative`
+            LineStart,
+            LineEnd,
+        };
+
+        struct Instruction
+        {
+            Op op;
+            int next = 0;
+            int alternative = 0;
+            std::bitset<256> bytes{};
+        };
+
+        std::vector<Instruction> instructions;
+        int start = 0;
+        uint64_t id = 0; // tells the per-thread DFA caches apart
+        // Bytes that no instruction tells apart share a class; '\n' and
+        // '\r' always have their own.
+        std::array<uint16_t, 256> byte_class{};
+        size_t class_count = 0;
+
+        static constexpr size_t kMaxInstructions = 100000;
+
+        explicit RegexProgram(const RegexNode &root)
+        {
+            static std::atomic<uint64_t> next_id{1};
+            id = next_id++;
+            instructions.push_back({Op::Match});
+            start = Compile(root, 0);
+            ComputeByteClasses();
+        }
+
+        // Refines the partition of the bytes by each byte instruction in
+        // turn.
+        void ComputeByteClasses()
+        {
+            byte_class['\n'] = 1;
+            byte_class['\r'] = 2;
+            class_count = 3;
+            for (const Instruction &instruction : instructions)
+            {
+                if (instruction.op != Op::Bytes)
+                    continue;
+                std::map<std::pair<uint16_t, bool>, uint16_t> refined;
+                for (int b = 0; b < 256; ++b)
+                {
+                    const auto key = std::make_pair(byte_class[b], bool(instruction.bytes[b]));
+                    byte_class[b] = refined.emplace(key, static_cast<uint16_t>(refined.size())).first->second;
+                }
+                class_count = refined.size();
+            }
+        }
+
+        // Compiles `node` so that it continues at `next` and returns its
+        // entry point.
+        int Compile(const RegexNode &node, int next)
+        {
+            if (instructions.size() > kMaxInstructions)
+                throw std::runtime_error("Regex is too large");
+            switch (node.kind)
+            {
+            case RegexNode::Kind::Empty:
+                return next;
+            case RegexNode::Kind::Bytes:
+                return Add({Op::Bytes, next, 0, node.bytes});
+            case RegexNode::Kind::LineStart:
+                return Add({Op::LineStart, next});
+            case RegexNode::Kind::LineEnd:
+                return Add({Op::LineEnd, next});
+            case RegexNode::Kind::Concat:
+                for (auto child = node.children.rbegin(); child != node.children.rend(); ++child)
+                    next = Compile(*child, next);
+                return next;
+            case RegexNode::Kind::Alternate:
+            {
+                int entry = Compile(node.children.back(), next);
+                for (size_t i = node.children.size() - 1; i-- > 0;)
+                    entry = Add({Op::Split, Compile(node.children[i], next), entry});
+                return entry;
+            }
+            case RegexNode::Kind::Repeat:
+            {
+                const RegexNode &body = node.children[0];
+                if (node.max == RegexNode::kUnbounded)
+                {
+                    const int loop = Add({Op::Split, 0, next});
+                    instructions[loop].next = Compile(body, loop);
+                    next = loop;
+                }
+                else
+                {
+                    for (int i = node.min; i < node.max; ++i)
+                        next = Add({Op::Split, Compile(body, next), next});
+                }
+                for (int i = 0; i < node.min; ++i)
+                    next = Compile(body, next);
+                return next;
+            }
+            }
+            return next;
+        }
+
+        int Add(Instruction instruction)
+        {
+            instructions.push_back(std::move(instruction));
+            return static_cast<int>(instructions.size() - 1);
+        }
+    };
+
+    // DFA over a RegexProgram whose states are built on first use and kept
+    // in a cache of bounded size, in the manner of RE2 and grep. A state is
+    // a set of byte and `$` instructions; reaching `$` only counts once the
+    // line ends. States are handled as row offsets into the transition
+    // table, which has one column per byte class, so the scan loop needs
+    // no multiply.
+    //
+    // In search mode the program may start at any byte of a line, and the
+    // transition table folds in what the scan loop needs to know: reaching
+    // a match, or a '\n' that ends a matching line, gives kMatch, and '\r'
+    // gives kLineEndAtCr where the line may match if it ends right there.
+    // In anchored mode the program starts where it is asked to, and states
+    // with nothing left to match go to the dead state.
+    class LazyDfa
+    {
+    public:
+        static constexpr int32_t kUnknown = -1;
+        static constexpr int32_t kMatch = -2;
+        static constexpr int32_t kLineEndAtCr = -3;
+        static constexpr int32_t kLineStart = 0; // start state at the first byte of a line
+
+        LazyDfa(const RegexProgram &program, bool search)
+            : program_(program), search_(search), class_count_(static_cast<int32_t>(program.class_count)),
+              marks_(program.instructions.size())
+        {
+            Reset();
+        }
+
+        // Start state anywhere but at the first byte of a line.
+        int32_t MidLine() const
+        {
+            return class_count_;
+        }
+
+        bool Accepting(int32_t row) const
+        {
+            return states_[row / class_count_].accepting;
+        }
+
+        bool AcceptingAtLineEnd(int32_t row) const
+        {
+            return states_[row / class_count_].accepting_at_line_end;
+        }
+
+        bool Dead(int32_t row) const
+        {
+            return row == dead_;
+        }
+
+        // The table entry for `byte` from `row`; kUnknown until Compute
+        // has filled it in.
+        int32_t Next(int32_t row, unsigned char byte) const
+        {
+            return table_[static_cast<size_t>(row) + program_.byte_class[byte]];
+        }
+
+        // The transition table for scan loops that index it themselves,
+        // valid until the next Compute or StepCarriageReturn.
+        const int32_t *Table() const
+        {
+            return table_.data();
+        }
+
+        // Fills in the table entry for `byte` from `row` and returns it. If
+        // the cache is full it is emptied first, which renumbers `row`.
+        int32_t Compute(int32_t &row, unsigned char byte)
+        {
+            MakeRoom(row);
+            const State &state = states_[row / class_count_];
+            int32_t next;
+            if (search_ && byte == '\n')
+                next = state.accepting_at_line_end ? kMatch : kLineStart;
+            else if (search_ && byte == '\r' && state.accepting_at_line_end)
+                next = kLineEndAtCr;
+            else
+            {
+                next = Step(row, byte);
+                if (search_ && Accepting(next))
+                    next = kMatch;
+            }
+            table_[static_cast<size_t>(row) + program_.byte_class[byte]] = next;
+            return next;
+        }
+
+        // The real transition on '\r' of a search state whose table entry
+        // is kLineEndAtCr; kMatch if it reaches a match.
+        int32_t StepCarriageReturn(int32_t &row)
+        {
+            MakeRoom(row);
+            const int32_t next = Step(row, '\r');
+            return Accepting(next) ? kMatch : next;
+        }
+
+        // Anchored mode: the transition on `byte`, computed if need be.
+        int32_t Advance(int32_t &row, unsigned char byte)
+        {
+            const int32_t next = Next(row, byte);
+            return next != kUnknown ? next : Compute(row, byte);
+        }
+
+    private:
+        static constexpr size_t kMaxStates = 10000;
+
+        struct State
+        {
+            std::vector<int> instructions; // sorted
+            bool accepting = false;
+            bool accepting_at_line_end = false;
+        };
+
+        void Reset()
+        {
+            states_.clear();
+            table_.clear();
+            ids_.clear();
+            AddState({program_.start}, true);
+            AddState({program_.start}, false);
+            dead_ = search_ ? kUnknown : AddState({}, false);
+        }
+
+        // Empties a full cache, keeping only the state at `row`.
+        void MakeRoom(int32_t &row)
+        {
+            if (states_.size() < kMaxStates)
+                return;
+            const std::vector<int> instructions = states_[row / class_count_].instructions;
+            const bool line_start = row == kLineStart;
+            Reset();
+            if (!line_start)
+                row = AddState(instructions, false);
+        }
+
+        // Adds the instructions reachable from `from` without consuming a
+        // byte to `out`, keeping the byte, `$` and match ones.
+        void Closure(int from, bool line_start, bool line_end, std::vector<int> &out)
+        {
+            std::vector<int> stack{from};
+            while (!stack.empty())
+            {
+                const int index = stack.back();
+                stack.pop_back();
+                if (marks_[index] == generation_)
+                    continue;
+                marks_[index] = generation_;
+                const RegexProgram::Instruction &instruction = program_.instructions[index];
+                switch (instruction.op)
+                {
+                case RegexProgram::Op::Split:
+                    stack.push_back(instruction.alternative);
+                    stack.push_back(instruction.next);
+                    break;
+                case RegexProgram::Op::LineStart:
+                    if (line_start)
+                        stack.push_back(instruction.next);
+                    break;
+                case RegexProgram::Op::LineEnd:
+                    if (line_end)
+                        stack.push_back(instruction.next);
+                    else
+                        out.push_back(index);
+                    break;
+                default:
+                    out.push_back(index);
+                    break;
+                }
+            }
+        }
+
+        // Interns the state holding the closure of `entries` and returns
+        // its row.
+        int32_t AddState(const std::vector<int> &entries, bool line_start)
+        {
+            std::vector<int> instructions;
+            ++generation_;
+            for (int entry : entries)
+                Closure(entry, line_start, false, instructions);
+            std::sort(instructions.begin(), instructions.end());
+            // The two start states stay distinct even if their sets agree.
+            std::vector<int> key = instructions;
+            key.push_back(line_start ? -1 : -2);
+            if (auto found = ids_.find(key); found != ids_.end())
+                return found->second;
+
+            State state;
+            state.instructions = std::move(instructions);
+            std::vector<int> at_line_end;
+            ++generation_;
+            for (int index : state.instructions)
+            {
+                const RegexProgram::Instruction &instruction = program_.instructions[index];
+                if (instruction.op == RegexProgram::Op::Match)
+                    state.accepting = true;
+                else if (instruction.op == RegexProgram::Op::LineEnd)
+                    Closure(instruction.next, line_start, true, at_line_end);
+            }
+            state.accepting_at_line_end =
+                state.accepting || std::any_of(at_line_end.begin(), at_line_end.end(), [&](int index)
+                                               { return program_.instructions[index].op == RegexProgram::Op::Match; });
+
+            const auto row = static_cast<int32_t>(table_.size());
+            states_.push_back(std::move(state));
+            table_.resize(table_.size() + class_count_, kUnknown);
+            ids_.emplace(std::move(key), row);
+            return row;
+        }
+
+        int32_t Step(int32_t row, unsigned char byte)
+        {
+            std::vector<int> entries;
+            for (int index : states_[row / class_count_].instructions)
+            {
+                const RegexProgram::Instruction &instruction = program_.instructions[index];
+                if (instruction.op == RegexProgram::Op::Bytes && instruction.bytes[byte])
+                    entries.push_back(instruction.next);
+            }
+            // A search may also start at the next byte.
+            if (search_)
+                entries.push_back(program_.start);
+            return AddState(entries, false);
+        }
+
+        const RegexProgram &program_;
+        const bool search_;
+        const int32_t class_count_;
+        std::vector<State> states_;
+        std::vector<int32_t> table_;
+        std::map<std::vector<int>, int32_t> ids_;
+        int32_t dead_ = kUnknown;
+        std::vector<uint32_t> marks_;
+        uint32_t generation_ = 0;
+    };
+
+    // Matches a regex line by line with a lazy DFA. Each line that the
+    // search DFA accepts is then split into its leftmost-longest matches by
+    // running an anchored DFA from successive positions. If every match
+    // must contain a literal of two or more bytes, the SIMD kernel for it
+    // picks out the candidate lines first and the rest are never touched.
+    class RegexMatcher
+    {
+    public:
+        // Matches never cross a line, so ChunkScanner hands over whole lines
+        // instead of overlapping its windows.
+        static constexpr bool kLineOriented = true;
+
+        explicit RegexMatcher(std::string pattern, bool fold = false)
+            : pattern_(std::move(pattern)), fold_(fold)
+        {
+            const RegexNode root = RegexParser(pattern_, fold).Parse();
+            program_ = std::make_shared<const RegexProgram>(root);
+            literal_ = RequiredLiteral(root);
+            if (literal_.size() >= 2)
+                find_ = SelectFindKernel(literal_.size());
+        }
+
+        size_t PatternCount() const
+        {
+            return 1;
+        }
+
+        const std::string &Pattern(size_t) const
+        {
+            return pattern_;
+        }
+
+        // Bytes a window must share with the next one: none, since matches
+        // never cross a line and the scanner carries partial lines.
+        size_t OverlapLength() const
+        {
+            return 0;
+        }
+
+        // Reports matches in order; `text` is expected to hold whole lines.
+        template <typename MatchHandler>
+        void ForEachMatch(std::string_view text, MatchHandler &&on_match) const
+        {
+            Caches &caches = ThreadCaches();
+            if (!find_)
+            {
+                SearchLines(caches, text, 0, on_match);
+                return;
+            }
+            size_t next_line = 0;
+            for (size_t pos : find_(text, literal_, fold_))
+            {
+                if (pos < next_line)
+                    continue;
+                const size_t begin = LineBegin(text, pos);
+                const size_t end = std::min(text.find('\n', pos), text.size());
+                SearchLines(caches, text.substr(begin, end - begin), begin, on_match);
+                next_line = end + 1;
+            }
+        }
+
+    private:
+        struct Caches
+        {
+            uint64_t program_id = 0;
+            std::unique_ptr<LazyDfa> search;
+            std::unique_ptr<LazyDfa> anchored;
+        };
+
+        // The DFAs grow as they scan, so each worker thread keeps its own.
+        Caches &ThreadCaches() const
+        {
+            thread_local Caches caches;
+            if (caches.program_id != program_->id)
+            {
+                caches.search = std::make_unique<LazyDfa>(*program_, true);
+                caches.anchored = std::make_unique<LazyDfa>(*program_, false);
+                caches.program_id = program_->id;
+            }
+            return caches;
+        }
+
+        // The longest run of single bytes that every match contains, taken
+        // from the top-level concatenation; anchors do not break a run.
+        std::string RequiredLiteral(const RegexNode &root) const
+        {
+            std::span<const RegexNode> items(&root, 1);
+            if (root.kind == RegexNode::Kind::Concat)
+                items = root.children;
+            std::string best, run;
+            for (const RegexNode &item : items)
+            {
+                if (item.kind == RegexNode::Kind::LineStart || item.kind == RegexNode::Kind::LineEnd)
+                    continue;
+                const int byte = LiteralByte(item);
+                if (byte >= 0 && byte != '\n')
+                {
+                    run += static_cast<char>(byte);
+                    continue;
+                }
+                if (run.size() > best.size())
+                    best = run;
+                run.clear();
+            }
+            return (run.size() > best.size()) ? run : best;
+        }
+
+        // The byte a node matches if it matches just one (both cases of one
+        // letter when folding), else -1.
+        int LiteralByte(const RegexNode &node) const
+        {
+            if (node.kind != RegexNode::Kind::Bytes)
+                return -1;
+            const size_t count = node.bytes.count();
+            for (int b = 0; b < 256; ++b)
+            {
+                if (!node.bytes[b])
+                    continue;
+                if (count == 1)
+                    return b;
+                if (fold_ && count == 2 && b >= 'A' && b <= 'Z' && node.bytes[b - 'A' + 'a'])
+                    return b - 'A' + 'a';
+                return -1;
+            }
+            return -1;
+        }
+
+        // Runs the search DFA over complete lines and reports the matches
+        // of every line it accepts; `base` is the offset of `text` in the
+        // caller's text.
+        template <typename MatchHandler>
+        void SearchLines(Caches &caches, std::string_view text, size_t base, MatchHandler &on_match) const
+        {
+            LazyDfa &dfa = *caches.search;
+            const size_t n = text.size();
+            if (dfa.Accepting(LazyDfa::kLineStart))
+            {
+                // The regex matches the empty string at the start of every
+                // line.
+                for (size_t begin = 0; begin < n;)
+                {
+                    const size_t end = std::min(text.find('\n', begin), n);
+                    ReportLine(caches, text, begin, end, base, on_match);
+                    begin = end + 1;
+                }
+                return;
+            }
+
+            const unsigned char *data = reinterpret_cast<const unsigned char *>(text.data());
+            const uint16_t *byte_class = program_->byte_class.data();
+            const int32_t *table = dfa.Table();
+            int32_t row = LazyDfa::kLineStart;
+            size_t i = 0;
+            while (i < n)
+            {
+                int32_t next = table[row + byte_class[data[i]]];
+                if (next >= 0)
+                {
+                    row = next;
+                    ++i;
+                    continue;
+                }
+                if (next == LazyDfa::kUnknown)
+                {
+                    dfa.Compute(row, data[i]);
+                    table = dfa.Table();
+                    continue;
+                }
+                if (next == LazyDfa::kLineEndAtCr && i + 1 < n && data[i + 1] != '\n')
+                {
+                    next = dfa.StepCarriageReturn(row);
+                    table = dfa.Table();
+                    if (next >= 0)
+                    {
+                        row = next;
+                        ++i;
+                        continue;
+                    }
+                }
+
+                // kMatch: the line holding byte i, or ending at it, is a hit.
+                const size_t end = (data[i] == '\n') ? i : std::min(text.find('\n', i), n);
+                ReportLine(caches, text, LineBegin(text, i), end, base, on_match);
+                i = end + 1;
+                row = LazyDfa::kLineStart;
+            }
+            // A last line without its '\n'.
+            if (i == n && n > 0 && data[n - 1] != '\n' && dfa.AcceptingAtLineEnd(row))
+                ReportLine(caches, text, LineBegin(text, n), n, base, on_match);
+        }
+
+        // Start of the line holding byte `pos`, or ending at it.
+        static size_t LineBegin(std::string_view text, size_t pos)
+        {
+            const size_t newline = (pos == 0) ? std::string_view::npos : text.rfind('\n', pos - 1);
+            return (newline == std::string_view::npos) ? 0 : newline + 1;
+        }
+
+        // Reports the leftmost-longest matches of a line the search DFA
+        // accepted, without the line's '\r'. An empty match only counts if
+        // the line has no other.
+        template <typename MatchHandler>
+        void ReportLine(Caches &caches, std::string_view text, size_t begin, size_t end, size_t base,
+                        MatchHandler &on_match) const
+        {
+            if (end > begin && text[end - 1] == '\r')
+                end--;
+            size_t empty_match = std::string_view::npos;
+            bool reported = false;
+            for (size_t cursor = begin; cursor <= end;)
+            {
+                size_t start = cursor, match_end = std::string_view::npos;
+                for (; start <= end; ++start)
+                {
+                    match_end = LongestMatch(*caches.anchored, text, begin, start, end);
+                    if (match_end != std::string_view::npos)
+                        break;
+                }
+                if (match_end == std::string_view::npos)
+                    break;
+                if (match_end == start)
+                {
+                    if (empty_match == std::string_view::npos)
+                        empty_match = start;
+                    cursor = start + 1;
+                    continue;
+                }
+                on_match(base + start, match_end - start, size_t{0});
+                reported = true;
+                cursor = match_end;
+            }
+            if (!reported && empty_match != std::string_view::npos)
+                on_match(base + empty_match, size_t{0}, size_t{0});
+        }
+
+        // End of the longest match starting at `start` in the line
+        // [line_begin, line_end) of text, or npos.
+        static size_t LongestMatch(LazyDfa &dfa, std::string_view text, size_t line_begin, size_t start,
+                                   size_t line_end)
+        {
+            int32_t row = (start == line_begin) ? LazyDfa::kLineStart : dfa.MidLine();
+            size_t longest = std::string_view::npos;
+            for (size_t i = start;; ++i)
+            {
+                if (i == line_end ? dfa.AcceptingAtLineEnd(row) : dfa.Accepting(row))
+                    longest = i;
+                if (i == line_end)
+                    break;
+                row = dfa.Advance(row, static_cast<unsigned char>(text[i]));
+                if (dfa.Dead(row))
+                    break;
+            }
+            return longest;
+        }
+
+        std::string pattern_;
+        bool fold_;
+        std::shared_ptr<const RegexProgram> program_;
+        std::string literal_;       // required in every match, if any
+        FindFunction find_ = nullptr; // set if literal_ is long enough to prefilter on
+    };
+
+    // Runs a matcher over the windows of one stream and records each match
+    // with its line and column. Newlines are counted as the scan advances,
+    // so a hit only costs a count over the bytes since the previous one.
+    //
+    // A scanner may own just a range of a stream: unless `at_line_start`, it
+    // skips to the first line starting in the stream, and it stops after the
+    // line holding byte `end - 1`. Adjoining ranges of an entry thus own
+    // every line exactly once; their line numbers start at 1 and the
+    // result's line_count says how far to shift those of the next range.
+    //
+    // Once `hits` reaches its limit the scanner stops asking for more bytes
+    // and marks the result as truncated. Its own hits are added as they are
+    // found only if `count_hits`; see SearchInputs.
+    template <typename Matcher>
+    class ChunkScanner
+    {
+    public:
+        ChunkScanner(const Matcher &matcher, const ScanOptions &options, SearchResult &result, HitCounter &hits,
+                     bool count_hits, bool at_line_start = true, uint64_t end = kUnknown)
+            : matcher_(matcher), whole_line_(options.whole_line), count_only_(options.count_only), result_(result),
+              hits_(hits), count_hits_(count_hits),
+              overlap_length_(matcher.OverlapLength()), end_(end),
+              owned_begin_(at_line_start ? 0 : kUnknown), counted_(owned_begin_), line_start_(owned_begin_)
+        {
+        }
+
+        // Searches `window` and returns how many of its trailing bytes must
+        // be carried into the next one.
+        size_t Scan(std::string_view window, size_t carried)
+        {
+            if (result_.truncated)
+                return 0;
+            const uint64_t window_offset = consumed_ - carried;
+            const bool last = window.size() == carried;
+            consumed_ = window_offset + window.size();
+
+            if (owned_begin_ == kUnknown)
+            {
+                const size_t newline = window.find('\n', carried);
+                if (newline == std::string_view::npos)
+                    return 0;
+                owned_begin_ = counted_ = line_start_ = window_offset + newline + 1;
+            }
+            FindOwnedEnd(window, window_offset, carried, last);
+
+            // With --whole-line or --unique, or a matcher whose matches never
+            // cross a line, only complete lines are searched; the partial one
+            // is carried so it can be printed, counted or matched in full.
+            size_t limit = window.size();
+            if ((whole_line_ || hits_.CountsLines() || Matcher::kLineOriented) && !last)
+            {
+                const size_t newline = window.rfind('\n');
+                limit = (newline == std::string_view::npos) ? 0 : newline + 1;
+                if (window.size() - limit + std::min(limit, overlap_length_) > kChunkSize)
+                    limit = window.size();
+            }
+            size_t scan_end = limit;
+            if (owned_end_ != kUnknown)
+                scan_end = std::min<uint64_t>(scan_end, SaturatingSub(owned_end_ + overlap_length_, window_offset));
+
+            const uint64_t found = result_.Count();
+            matcher_.ForEachMatch(window.substr(0, scan_end), [&](size_t pos, size_t length, size_t pattern)
+            {
+                const uint64_t offset = window_offset + pos;
+                if (offset + std::max<size_t>(length, 1) > scanned_ && offset >= owned_begin_ && offset < owned_end_)
+                    Record(window, window_offset, pos, length, pattern);
+            });
+            if (count_hits_)
+                hits_.Add(result_.Count() - found);
+            scanned_ = std::max<uint64_t>(scanned_, window_offset + scan_end);
+
+            const size_t keep = last ? 0 : window.size() - limit + std::min(limit, overlap_length_);
+            CountTo(window, window_offset, std::min<uint64_t>(consumed_ - keep, owned_end_));
+            return keep;
+        }
+
+        // How many more bytes of the stream the scanner needs at least; 0
+        // once everything it owns has been searched or the hit limit stopped
+        // it.
+        uint64_t Wanted()
+        {
+            uint64_t wanted = kUnknown;
+            if (owned_end_ != kUnknown)
+                wanted = SaturatingSub(owned_end_ + overlap_length_, consumed_);
+            else if (end_ != kUnknown)
+                wanted = std::max<uint64_t>(SaturatingSub(end_ + overlap_length_, consumed_), kLineProbeSize);
+            if (wanted > 0 && hits_.Reached())
+            {
+                result_.truncated = true;
+                wanted = 0;
+            }
+            return wanted;
+        }
+
+    private:
+        static constexpr uint64_t kUnknown = UINT64_MAX;
+        static constexpr uint64_t kLineProbeSize = 4 * 1024;
+
+        static uint64_t SaturatingSub(uint64_t a, uint64_t b)
+        {
+            return a > b ? a - b : 0;
+        }
+
+        void FindOwnedEnd(std::string_view window, uint64_t window_offset, size_t carried, bool last)
+        {
+            if (owned_end_ != kUnknown || end_ == kUnknown)
+                return;
+            if (owned_begin_ >= end_)
+            {
+                owned_end_ = owned_begin_;
+                return;
+            }
+            const uint64_t from = std::max<uint64_t>(end_ - 1, window_offset + carried);
+            if (from < consumed_)
+            {
+                const size_t newline = window.find('\n', from - window_offset);
+                if (newline != std::string_view::npos)
+                    owned_end_ = window_offset + newline + 1;
+            }
+            if (owned_end_ == kUnknown && last)
+                owned_end_ = consumed_;
+        }
+
+        // Advances the newline count to `offset`, which lies in the window.
+        void CountTo(std::string_view window, uint64_t window_offset, uint64_t offset)
+        {
+            if (offset <= counted_ || count_only_)
+                return;
+            const std::string_view text = window.substr(counted_ - window_offset, offset - counted_);
+            if (const size_t newlines = CountNewlines(text); newlines > 0)
+            {
+                result_.line_count += newlines;
+                line_start_ = counted_ + text.rfind('\n') + 1;
+            }
+            counted_ = offset;
+        }
+
+        // The line holding `pos`, without its '\r'. Scans for whole lines
+        // start their windows at a line, so all of it is in the window.
+        static std::string_view LineAt(std::string_view window, size_t pos)
+        {
+            const size_t newline = (pos == 0) ? std::string_view::npos : window.rfind('\n', pos - 1);
+            const size_t begin = (newline == std::string_view::npos) ? 0 : newline + 1;
+            size_t end = std::min(window.find('\n', pos), window.size());
+            if (end > begin && window[end - 1] == '\r')
+                end--;
+            return window.substr(begin, end - begin);
+        }
+
+        void Record(std::string_view window, uint64_t window_offset, size_t pos, size_t length, size_t pattern)
+        {
+            if (hits_.CountsLines())
+                hits_.AddLine(LineAt(window, pos));
+            if (count_only_)
+            {
+                // Only the per-pattern summary needs to know which it was.
+                if (matcher_.PatternCount() > 1)
+                    result_.Add(0, 0, {}, pattern);
+                else
+                    result_.AddUnrecorded();
+                return;
+            }
+
+            const uint64_t offset = window_offset + pos;
+            uint64_t line = result_.line_count + 1;
+            uint64_t line_start = line_start_;
+            if (offset >= counted_)
+            {
+                CountTo(window, window_offset, offset);
+                line = result_.line_count + 1;
+                line_start = line_start_;
+            }
+            else if (const size_t newlines = CountNewlines(window.substr(pos, counted_ - offset)); newlines > 0)
+            {
+                // Multi-pattern matches are reported by end position, so one
+                // may start before the previous hit, though only by a pattern
+                // length.
+                line -= newlines;
+                const size_t newline = (pos == 0) ? std::string_view::npos : window.rfind('\n', pos - 1);
+                line_start = window_offset + ((newline == std::string_view::npos) ? 0 : newline + 1);
+            }
+
+            std::string_view context;
+            if (whole_line_)
+            {
+                const size_t begin = static_cast<size_t>(std::max(line_start, window_offset) - window_offset);
+                size_t end = std::min(window.find('\n', pos), window.size());
+                if (end > begin && window[end - 1] == '\r')
+                    end--;
+                context = window.substr(begin, end - begin);
+            }
+            else
+            {
+                const size_t context_start = (pos > kContextSize) ? pos - kContextSize : 0;
+                const size_t context_end = std::min(pos + length + kContextSize, window.length());
+                context = window.substr(context_start, context_end - context_start);
+            }
+
+            result_.Add(line, offset - line_start + 1, context, pattern);
+        }
+
+        const Matcher &matcher_;
+        const bool whole_line_;
+        const bool count_only_;
+        SearchResult &result_;
+        HitCounter &hits_;
+        const bool count_hits_;
+        const size_t overlap_length_;
+        const uint64_t end_;
+        uint64_t owned_begin_;
+        uint64_t owned_end_ = kUnknown;
+        uint64_t consumed_ = 0; // stream bytes seen so far
+        uint64_t scanned_ = 0;  // stream bytes already searched
+        uint64_t counted_;      // stream bytes whose newlines are in line_count
+        uint64_t line_start_;   // offset of the line holding byte counted_
+    };
+
+    // Searches everything `reader` streams: any input with the
+    // ForEachChunk protocol of ZipEntryReader, GzipReader or ZstdReader.
+    template <typename Matcher, typename Reader>
+    SearchResult SearchInFile(Reader &reader,
+                              const std::string &file_name,
+                              const Matcher &matcher,
+                              const ScanOptions &options,
+                              HitCounter &hits)
+    {
+        SearchResult result(file_name);
+
+        ChunkScanner<Matcher> scanner(matcher, options, result, hits, true);
+        reader.ForEachChunk([&]
+                            { return scanner.Wanted(); },
+                            [&](std::string_view window, size_t carried)
+                            { return scanner.Scan(window, carried); });
+
+        return result;
+    }
+
+    template <typename Matcher>
+    SearchResult SearchInFile(ZipArchive &archive,
+                              const std::string &file_name,
+                              const FileInfo &file_info,
+                              const Matcher &matcher,
+                              const ScanOptions &options,
+                              HitCounter &hits)
+    {
+        ZipEntryReader reader(archive, file_name, file_info);
+        return SearchInFile(reader, file_name, matcher, options, hits);
+    }
+
+    // A position inside a raw deflate stream at which decompression can be
+    // resumed without inflating anything before it (zlib's zran approach).
+    struct InflateCheckpoint
+    {
+        uint64_t out_offset; // uncompressed bytes before this point
+        uint64_t in_offset;  // compressed bytes consumed, relative to the entry data
+        uint32_t bits;       // bits of the byte at in_offset - 1 still to be used
+        std::vector<unsigned char> window; // up to 32 KB of preceding output
+    };
+
+    struct EntryCheckpoints
+    {
+        uint64_t data_offset = 0;
+        uint64_t compressed_size = 0;
+        uint64_t size = 0;
+        std::vector<InflateCheckpoint> points;
+    };
+
+    using CheckpointIndex = std::map<std::string, EntryCheckpoints>;
+
+    // Inflates a whole raw deflate stream once, recording a checkpoint at the
+    // first block boundary after every `span` bytes of output.
+    std::vector<InflateCheckpoint> BuildInflateCheckpoints(std::string_view compressed, uint64_t span)
+    {
+        std::vector<InflateCheckpoint> points;
+        points.push_back({0, 0, 0, {}});
+
+        z_stream stream{};
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        {
+            throw std::runtime_error("Error initializing inflate");
+        }
+
+        std::vector<unsigned char> window(kDeflateWindowSize);
+        uint64_t in_position = 0;
+        uint64_t total_in = 0, total_out = 0, last = 0;
+        int ret = Z_OK;
+        do
+        {
+            if (stream.avail_in == 0)
+                RefillInflateInput(stream, compressed, in_position);
+            if (stream.avail_out == 0)
+            {
+                stream.next_out = window.data();
+                stream.avail_out = static_cast<uInt>(window.size());
+            }
+
+            total_in += stream.avail_in;
+            total_out += stream.avail_out;
+            ret = inflate(&stream, Z_BLOCK);
+            total_in -= stream.avail_in;
+            total_out -= stream.avail_out;
+
+            if (ret != Z_OK && ret != Z_STREAM_END)
+            {
+                inflateEnd(&stream);
+                throw std::runtime_error(ret == Z_BUF_ERROR ? "Unexpected end of deflate stream"
+                                                            : "Error inflating deflate stream");
+            }
+
+            // Bit 7 of data_type marks the end of a block, bit 6 the last
+            // block; the low three bits are the unused bits of the last input
+            // byte.
+            if (ret == Z_OK && (stream.data_type & 128) && !(stream.data_type & 64) && total_out - last > span)
+            {
+                InflateCheckpoint point{total_out, total_in, static_cast<uint32_t>(stream.data_type & 7), {}};
+                const size_t window_size = static_cast<size_t>(std::min<uint64_t>(total_out, kDeflateWindowSize));
+                const size_t head = window.size() - stream.avail_out;
+                point.window.resize(window_size);
+                for (size_t i = 0; i < window_size; ++i)
+                {
+                    point.window[i] = window[(head + window.size() - window_size + i) % window.size()];
+                }
+                points.push_back(std::move(point));
+                last = total_out;
+            }
+        } while (ret != Z_STREAM_END);
+
+        inflateEnd(&stream);
+        return points;
+    }
+
+    // Resumes inflating `compressed` at `point` and streams the output to
+    // `handler` through StreamWindows. Before each read `wanted()` caps how
+    // many more bytes are inflated, and 0 stops.
+    template <typename Wanted, typename WindowHandler>
+    void InflateFromCheckpoint(std::string_view compressed, const InflateCheckpoint &point,
+                               Wanted &&wanted, WindowHandler &&handler)
+    {
+        z_stream stream{};
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        {
+            throw std::runtime_error("Error initializing inflate");
+        }
+
+        uint64_t in_position = point.in_offset;
+        if (point.bits != 0)
+        {
+            const auto byte = static_cast<unsigned char>(compressed[point.in_offset - 1]);
+            inflatePrime(&stream, static_cast<int>(point.bits), byte >> (8 - point.bits));
+        }
+        if (!point.window.empty())
+        {
+            inflateSetDictionary(&stream, point.window.data(), static_cast<uInt>(point.window.size()));
+        }
+
+        int ret = Z_OK;
+        auto fill = [&](char *destination, size_t capacity) -> size_t
+        {
+            const uint64_t max_output = wanted();
+            if (max_output == 0 || ret == Z_STREAM_END)
+                return 0;
+            stream.next_out = reinterpret_cast<Bytef *>(destination);
+            stream.avail_out = static_cast<uInt>(std::min<uint64_t>(capacity, max_output));
+            // A call may consume input without producing any, and returning
+            // nothing would end the stream, so the window is filled up.
+            while (ret != Z_STREAM_END && stream.avail_out > 0)
+            {
+                if (stream.avail_in == 0)
+                    RefillInflateInput(stream, compressed, in_position);
+                ret = inflate(&stream, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END)
+                {
+                    throw std::runtime_error(ret == Z_BUF_ERROR ? "Unexpected end of deflate stream"
+                                                                : "Error inflating from checkpoint");
+                }
+            }
+            return static_cast<size_t>(reinterpret_cast<char *>(stream.next_out) - destination);
+        };
+
+        try
+        {
+            StreamWindows(fill, handler);
+        }
+        catch (...)
+        {
+            inflateEnd(&stream);
+            throw;
+        }
+        inflateEnd(&stream);
+    }
+
+    std::string CheckpointFilename(const std::string &zip_filename)
+    {
+        return zip_filename + ".ckpt";
+    }
+
+    // Size and modification time of the archive a checkpoint file was built
+    // from, so a replaced archive invalidates it.
+    std::pair<uint64_t, int64_t> ArchiveStamp(const std::string &zip_filename)
+    {
+        return {std::filesystem::file_size(zip_filename),
+                static_cast<int64_t>(std::filesystem::last_write_time(zip_filename).time_since_epoch().count())};
+    }
+
+    void SaveCheckpoints(const std::string &zip_filename, uint64_t span, const CheckpointIndex &checkpoints)
+    {
+        const std::string checkpoint_filename = CheckpointFilename(zip_filename);
+        std::ofstream out(checkpoint_filename, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Error creating checkpoint file: " + checkpoint_filename);
+        }
+
+        auto put = [&](uint64_t value)
+        { out.write(reinterpret_cast<const char *>(&value), sizeof(value)); };
+
+        const auto [archive_size, archive_mtime] = ArchiveStamp(zip_filename);
+        out.write(kCheckpointMagic.data(), kCheckpointMagic.size());
+        put(span);
+        put(archive_size);
+        put(static_cast<uint64_t>(archive_mtime));
+        put(checkpoints.size());
+        for (const auto &[file_name, entry] : checkpoints)
+        {
+            put(file_name.size());
+            out.write(file_name.data(), static_cast<std::streamsize>(file_name.size()));
+            put(entry.data_offset);
+            put(entry.compressed_size);
+            put(entry.size);
+            put(entry.points.size());
+            for (const auto &point : entry.points)
+            {
+                put(point.out_offset);
+                put(point.in_offset);
+                put(point.bits);
+                put(point.window.size());
+                out.write(reinterpret_cast<const char *>(point.window.data()),
+                          static_cast<std::streamsize>(point.window.size()));
+            }
+        }
+
+        if (!out)
+        {
+            throw std::runtime_error("Error writing checkpoint file: " + checkpoint_filename);
+        }
+    }
+
+    // Returns false if there is no checkpoint file for this archive and span,
+    // it belongs to a different version of the archive, or it is truncated
+    // or corrupt. Every size read from the file is checked against the bytes
+    // left in it, and every offset against its entry, before it is used.
+    bool LoadCheckpoints(const std::string &zip_filename, uint64_t span, CheckpointIndex &checkpoints)
+    {
+        const std::string checkpoint_filename = CheckpointFilename(zip_filename);
+        std::ifstream in(checkpoint_filename, std::ios::binary);
+        std::error_code error;
+        const uint64_t file_size = std::filesystem::file_size(checkpoint_filename, error);
+        if (!in || error)
+            return false;
+
+        auto get = [&]()
+        {
+            uint64_t value = 0;
+            in.read(reinterpret_cast<char *>(&value), sizeof(value));
+            return value;
+        };
+        auto remaining = [&]() -> uint64_t
+        {
+            const auto position = in.tellg();
+            return (in && position >= 0) ? file_size - std::min(file_size, static_cast<uint64_t>(position)) : 0;
+        };
+
+        std::array<char, 8> magic{};
+        in.read(magic.data(), magic.size());
+        const auto [archive_size, archive_mtime] = ArchiveStamp(zip_filename);
+        if (!in || magic != kCheckpointMagic || get() != span || get() != archive_size ||
+            get() != static_cast<uint64_t>(archive_mtime))
+        {
+            return false;
+        }
+
+        // The smallest an entry and a point can be in the file.
+        constexpr uint64_t kMinEntryBytes = 5 * sizeof(uint64_t);
+        constexpr uint64_t kMinPointBytes = 4 * sizeof(uint64_t);
+
+        auto read_entries = [&]()
+        {
+            const uint64_t entry_count = get();
+            if (!in || entry_count > remaining() / kMinEntryBytes)
+                return false;
+            for (uint64_t entries = entry_count; entries > 0; --entries)
+            {
+                const uint64_t name_size = get();
+                if (!in || name_size > remaining())
+                    return false;
+                std::string file_name(static_cast<size_t>(name_size), '\0');
+                in.read(file_name.data(), static_cast<std::streamsize>(file_name.size()));
+                EntryCheckpoints &entry = checkpoints[file_name];
+                entry.data_offset = get();
+                entry.compressed_size = get();
+                entry.size = get();
+                const uint64_t point_count = get();
+                if (!in || entry.data_offset > archive_size || entry.compressed_size > archive_size - entry.data_offset ||
+                    point_count == 0 || point_count > remaining() / kMinPointBytes)
+                {
+                    return false;
+                }
+                entry.points.resize(static_cast<size_t>(point_count));
+                for (size_t i = 0; i < entry.points.size(); ++i)
+                {
+                    InflateCheckpoint &point = entry.points[i];
+                    point.out_offset = get();
+                    point.in_offset = get();
+                    const uint64_t bits = get();
+                    const uint64_t window_size = get();
+                    // The first point is the start of the stream, and the
+                    // others follow it in order within the entry; a point
+                    // with bits left over needs the input byte before it.
+                    const bool in_order = (i == 0) ? point.out_offset == 0 && point.in_offset == 0
+                                                   : point.out_offset > entry.points[i - 1].out_offset;
+                    if (!in || !in_order || point.out_offset > entry.size ||
+                        point.in_offset > entry.compressed_size || bits > 7 || (bits != 0 && point.in_offset == 0) ||
+                        window_size > std::min<uint64_t>(point.out_offset, kDeflateWindowSize) || window_size > remaining())
+                    {
+                        return false;
+                    }
+                    point.bits = static_cast<uint32_t>(bits);
+                    point.window.resize(static_cast<size_t>(window_size));
+                    in.read(reinterpret_cast<char *>(point.window.data()),
+                            static_cast<std::streamsize>(point.window.size()));
+                }
+            }
+            return static_cast<bool>(in);
+        };
+
+        if (!read_entries())
+        {
+            checkpoints.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Loads the checkpoint file next to the archive, or builds and saves it
+    // when it is missing or stale. Only deflated entries larger than two spans
+    // get checkpoints; everything else is searched as a whole. A line on
+    // `status`, unless it is null, says when they have to be built.
+    CheckpointIndex LoadOrBuildCheckpoints(const std::string &zip_filename, const ZipIndex &index, uint64_t span,
+                                           size_t prefetch_blocks = 0, std::ostream *status = nullptr)
+    {
+        CheckpointIndex checkpoints;
+        if (LoadCheckpoints(zip_filename, span, checkpoints))
+            return checkpoints;
+
+        if (status)
+            *status << "Building inflate checkpoints every " << span / (1024 * 1024) << " MB...\n";
+        ZipArchive archive(zip_filename, prefetch_blocks);
+        for (const auto &[file_name, file_info] : index)
+        {
+            if (file_info.compression_method != Z_DEFLATED || file_info.encrypted || file_info.size <= 2 * span)
+                continue;
+
+            ZipEntryReader reader(archive, file_name, file_info);
+            EntryCheckpoints entry;
+            entry.data_offset = reader.DataOffset();
+            entry.compressed_size = file_info.compressed_size;
+            entry.size = file_info.size;
+            if (entry.data_offset == 0)
+                continue;
+
+            MappedFile compressed(zip_filename, entry.data_offset, entry.compressed_size);
+            entry.points = BuildInflateCheckpoints(compressed.View(), span);
+            checkpoints[file_name] = std::move(entry);
+        }
+
+        SaveCheckpoints(zip_filename, span, checkpoints);
+        return checkpoints;
+    }
+
+    // Searches the uncompressed bytes between checkpoint `range` and the
+    // next one, so that the checkpoints of one entry can be searched in
+    // parallel.
+    template <typename Matcher>
+    SearchResult SearchInCheckpointRange(const std::string &zip_filename,
+                                         const std::string &file_name,
+                                         const EntryCheckpoints &entry,
+                                         size_t range,
+                                         const Matcher &matcher,
+                                         const ScanOptions &options,
+                                         HitCounter &hits)
+    {
+        const InflateCheckpoint &point = entry.points[range];
+        const uint64_t end = (range + 1 < entry.points.size()) ? entry.points[range + 1].out_offset : entry.size;
+
+        MappedFile compressed(zip_filename, entry.data_offset, entry.compressed_size);
+
+        SearchResult result(file_name);
+
+        // The checkpoint window ends with the byte before the range, which
+        // tells whether the range starts a line. Inflation runs a little past
+        // the end until the last line and any match starting in it are done.
+        const bool at_line_start = point.window.empty() || point.window.back() == '\n';
+        ChunkScanner<Matcher> scanner(matcher, options, result, hits, range == 0, at_line_start, end - point.out_offset);
+        InflateFromCheckpoint(compressed.View(), point, [&]
+                              { return scanner.Wanted(); },
+                              [&](std::string_view window, size_t carried)
+                              { return scanner.Scan(window, carried); });
+
+        return result;
+    }
+
+    // Searches the lines starting in bytes [begin, end) of a stored entry
+    // whose data starts at `data_offset` in the archive, or of a plain text
+    // file with a `data_offset` of 0. The mapping starts
+    // one byte early to see whether `begin` starts a line and runs to the
+    // end of the entry, since the last line may reach any distance past
+    // `end`; the scanner stops once it is done.
+    template <typename Matcher>
+    SearchResult SearchInStoredRange(const std::string &zip_filename,
+                                     const std::string &file_name,
+                                     const FileInfo &file_info,
+                                     uint64_t data_offset,
+                                     uint64_t begin,
+                                     uint64_t end,
+                                     const Matcher &matcher,
+                                     const ScanOptions &options,
+                                     HitCounter &hits)
+    {
+        const uint64_t mapped_begin = (begin > 0) ? begin - 1 : 0;
+        MappedFile mapped(zip_filename, data_offset + mapped_begin, static_cast<size_t>(file_info.size - mapped_begin));
+
+        std::string_view content = mapped.View();
+        const bool at_line_start = begin == 0 || content.front() == '\n';
+        content.remove_prefix(static_cast<size_t>(begin - mapped_begin));
+
+        SearchResult result(file_name);
+
+        ChunkScanner<Matcher> scanner(matcher, options, result, hits, begin == 0, at_line_start, end - begin);
+        MappedWindows(content, [&]
+                      { return scanner.Wanted(); },
+                      [&](std::string_view window, size_t carried)
+                      { return scanner.Scan(window, carried); });
+        return result;
+    }
+
+#ifdef SEARCH_HAVE_ZSTD
+    // Searches the lines starting in the frames that decompress to bytes
+    // [begin, end) of a seekable zstd file, which lie on frame boundaries.
+    // Only the frame before the range is decompressed to see whether
+    // `begin` starts a line; the range itself streams on into the next
+    // frames until its last line is done.
+    template <typename Matcher>
+    SearchResult SearchInZstdFrames(const std::string &filename,
+                                    const std::string &file_name,
+                                    const ZstdSeekTable &table,
+                                    uint64_t begin,
+                                    uint64_t end,
+                                    const Matcher &matcher,
+                                    const ScanOptions &options,
+                                    HitCounter &hits)
+    {
+        const auto &offsets = table.decompressed_offsets;
+        const size_t frame = static_cast<size_t>(std::lower_bound(offsets.begin(), offsets.end(), begin) -
+                                                 offsets.begin());
+        MappedFile mapped(filename, table.compressed_offsets[frame],
+                          static_cast<size_t>(table.compressed_offsets.back() - table.compressed_offsets[frame]));
+
+        bool at_line_start = true;
+        if (frame > 0)
+        {
+            const uint64_t previous = table.compressed_offsets[frame - 1];
+            MappedFile previous_frame(filename, previous,
+                                      static_cast<size_t>(table.compressed_offsets[frame] - previous));
+            char last = '\n';
+            DecompressZstd(previous_frame.View(), []
+                           { return UINT64_MAX; },
+                           [&](std::string_view window, size_t carried)
+                           {
+                               if (window.size() > carried)
+                                   last = window.back();
+                               return size_t{0};
+                           });
+            at_line_start = last == '\n';
+        }
+
+        SearchResult result(file_name);
+
+        ChunkScanner<Matcher> scanner(matcher, options, result, hits, begin == 0, at_line_start, end - begin);
+        DecompressZstd(mapped.View(), [&]
+                       { return scanner.Wanted(); },
+                       [&](std::string_view window, size_t carried)
+                       { return scanner.Scan(window, carried); });
+        return result;
+    }
+#endif
+
+    // Hands out task indices from one deque per worker. Workers take tasks
+    // from the front of their own deque and, when it runs dry, steal the
+    // back half of another worker's deque in one go, so the shared state is
+    // touched once per batch rather than once per task.
+    class WorkStealingScheduler
+    {
+    public:
+        // Deals tasks 0..task_count-1, which should be ordered by decreasing
+        // cost, round-robin so every worker starts with one of the largest.
+        WorkStealingScheduler(size_t task_count, size_t worker_count)
+            : queues_(std::max<size_t>(worker_count, 1))
+        {
+            for (size_t task = 0; task < task_count; ++task)
+            {
+                queues_[task % queues_.size()].tasks.push_back(task);
+            }
+        }
+
+        // Returns false once there is no work left.
+        bool Next(size_t worker, size_t &task)
+        {
+            WorkerQueue &own = queues_[worker];
+            {
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.tasks.empty())
+                {
+                    task = own.tasks.front();
+                    own.tasks.pop_front();
+                    return true;
+                }
+            }
+
+            for (size_t i = 1; i < queues_.size(); ++i)
+            {
+                WorkerQueue &victim = queues_[(worker + i) % queues_.size()];
+                std::deque<size_t> stolen;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    const size_t count = (victim.tasks.size() + 1) / 2;
+                    stolen.assign(victim.tasks.end() - count, victim.tasks.end());
+                    victim.tasks.erase(victim.tasks.end() - count, victim.tasks.end());
+                }
+                if (stolen.empty())
+                    continue;
+
+                task = stolen.front();
+                stolen.pop_front();
+                std::lock_guard<std::mutex> lock(own.mutex);
+                own.tasks.insert(own.tasks.end(), stolen.begin(), stolen.end());
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        struct alignas(64) WorkerQueue
+        {
+            std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+
+        std::vector<WorkerQueue> queues_;
+    };
+
+    // NUMA node of a CPU, or 0 where the system does not say.
+    int CpuNode(int cpu)
+    {
+#ifdef __linux__
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(
+                 "/sys/devices/system/cpu/cpu" + std::to_string(cpu), error))
+        {
+            const std::string name = entry.path().filename().string();
+            if (name.size() > 4 && name.starts_with("node"))
+                return std::atoi(name.c_str() + 4);
+        }
+#else
+        static_cast<void>(cpu);
+#endif
+        return 0;
+    }
+
+    // CPUs the process may run on (as restricted by taskset, cpusets or
+    // job objects), ordered by NUMA node so that consecutive workers share
+    // one. Empty where the system cannot tell.
+    std::vector<int> AllowedCpus()
+    {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+            }
+        }
+#elif defined(_WIN32)
+        DWORD_PTR process_mask = 0, system_mask = 0;
+        if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        {
+            for (int cpu = 0; cpu < static_cast<int>(sizeof(process_mask) * CHAR_BIT); ++cpu)
+            {
+                if (process_mask & (DWORD_PTR{1} << cpu))
+                    cpus.push_back(cpu);
+            }
+        }
+#endif
+        std::vector<int> nodes(cpus.size());
+        std::transform(cpus.begin(), cpus.end(), nodes.begin(), CpuNode);
+        std::vector<size_t> order(cpus.size());
+        std::iota(order.begin(), order.end(), size_t{0});
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                         { return nodes[a] < nodes[b]; });
+        std::vector<int> sorted;
+        sorted.reserve(cpus.size());
+        for (size_t i : order)
+            sorted.push_back(cpus[i]);
+        return sorted;
+    }
+
+    // Binds the calling thread to one CPU; a no-op where that is not
+    // supported.
+    void PinCurrentThread(int cpu)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+#elif defined(_WIN32)
+        SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR{1} << cpu);
+#else
+        static_cast<void>(cpu);
+#endif
+    }
+
+    size_t DefaultThreadCount()
+    {
+        if (const size_t cpus = AllowedCpus().size(); cpus > 0)
+            return cpus;
+        const unsigned int count = std::thread::hardware_concurrency();
+        return (count != 0) ? count : 4; // Default to 4 threads if hardware_concurrency() fails
+    }
+
+    // A fixed set of worker threads that runs one batch of tasks at a time
+    // through a WorkStealingScheduler. Keeping the threads alive lets a
+    // long-running process pay for thread creation once.
+    //
+    // It runs `thread_count` workers, or DefaultThreadCount() if that is 0.
+    // With `pin` worker i is bound to the i-th allowed CPU, which fills one
+    // NUMA node before the next. The buffers a worker allocates are then
+    // first touched, and so placed, on its own node.
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(size_t thread_count, bool pin = false)
+        {
+            const std::vector<int> cpus = pin ? AllowedCpus() : std::vector<int>();
+            if (thread_count == 0)
+                thread_count = DefaultThreadCount();
+            for (size_t i = 0; i < thread_count; ++i)
+            {
+                const int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+                threads_.emplace_back([this, i, cpu]
+                {
+                    if (cpu >= 0)
+                        PinCurrentThread(cpu);
+                    Loop(i);
+                });
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_all();
+            for (auto &thread : threads_)
+            {
+                thread.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        size_t Size() const
+        {
+            return threads_.size();
+        }
+
+        // Calls task_function(worker, task) for every task in
+        // 0..task_count-1, which should be ordered by decreasing cost, and
+        // returns when all are done. Concurrent callers take turns. The first
+        // exception thrown by a task is rethrown here once the batch ends.
+        template <typename TaskFunction>
+        void Run(size_t task_count, TaskFunction &&task_function)
+        {
+            std::lock_guard<std::mutex> batch_lock(batch_mutex_);
+            WorkStealingScheduler scheduler(task_count, threads_.size());
+            std::exception_ptr error;
+            std::mutex error_mutex;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_ = [&](size_t worker)
+            {
+                size_t task;
+                while (scheduler.Next(worker, task))
+                {
+                    try
+                    {
+                        task_function(worker, task);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> error_lock(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                }
+            };
+            busy_ = threads_.size();
+            ++generation_;
+            wake_.notify_all();
+            done_.wait(lock, [&]
+                       { return busy_ == 0; });
+            job_ = nullptr;
+            lock.unlock();
+
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+    private:
+        void Loop(size_t worker)
+        {
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true)
+            {
+                wake_.wait(lock, [&]
+                           { return stopping_ || generation_ != seen; });
+                if (stopping_)
+                    return;
+                seen = generation_;
+
+                lock.unlock();
+                job_(worker);
+                lock.lock();
+                if (--busy_ == 0)
+                    done_.notify_one();
+            }
+        }
+
+        std::mutex batch_mutex_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+        std::function<void(size_t)> job_;
+        uint64_t generation_ = 0;
+        size_t busy_ = 0;
+        bool stopping_ = false;
+        std::vector<std::thread> threads_;
+    };
+
+    std::string ChecksumFilename(const std::string &filename)
+    {
+        return filename + ".b3sum";
+    }
+
+    std::string VerifiedStampFilename(const std::string &filename)
+    {
+        return filename + ".b3ok";
+    }
+
+    // BLAKE3 digest of `filename` in hex, from the first field of its
+    // `b3sum` line.
+    std::string ReadExpectedDigest(const std::string &filename)
+    {
+        const std::string checksum_filename = ChecksumFilename(filename);
+        std::ifstream in(checksum_filename);
+        if (!in)
+        {
+            throw std::runtime_error("--verify needs a checksum file: " + checksum_filename);
+        }
+        std::string digest;
+        in >> digest;
+        std::transform(digest.begin(), digest.end(), digest.begin(), FoldCase);
+        if (digest.size() != 2 * kDigestSize ||
+            digest.find_first_not_of("0123456789abcdef") != std::string::npos)
+        {
+            throw std::runtime_error("No BLAKE3 digest in checksum file: " + checksum_filename);
+        }
+        return digest;
+    }
+
+    // True if this version of `filename` was verified against `digest`
+    // before, by size and modification time.
+    bool IsVerified(const std::string &filename, const std::string &digest)
+    {
+        std::ifstream in(VerifiedStampFilename(filename), std::ios::binary);
+        std::array<char, 8> magic{};
+        uint64_t size = 0;
+        uint64_t mtime = 0;
+        std::string verified_digest(2 * kDigestSize, '\0');
+        in.read(magic.data(), magic.size());
+        in.read(reinterpret_cast<char *>(&size), sizeof(size));
+        in.read(reinterpret_cast<char *>(&mtime), sizeof(mtime));
+        in.read(verified_digest.data(), static_cast<std::streamsize>(verified_digest.size()));
+        const auto [file_size, file_mtime] = ArchiveStamp(filename);
+        return in && magic == kVerifiedMagic && size == file_size && mtime == static_cast<uint64_t>(file_mtime) &&
+               verified_digest == digest;
+    }
+
+    // The stamp only saves the next run from hashing again, so inputs in
+    // read-only directories simply go without.
+    void SaveVerifiedStamp(const std::string &filename, std::pair<uint64_t, int64_t> stamp,
+                           const std::string &digest)
+    {
+        std::ofstream out(VerifiedStampFilename(filename), std::ios::binary | std::ios::trunc);
+        const uint64_t mtime = static_cast<uint64_t>(stamp.second);
+        out.write(kVerifiedMagic.data(), kVerifiedMagic.size());
+        out.write(reinterpret_cast<const char *>(&stamp.first), sizeof(stamp.first));
+        out.write(reinterpret_cast<const char *>(&mtime), sizeof(mtime));
+        out.write(digest.data(), static_cast<std::streamsize>(digest.size()));
+    }
+
+#ifdef SEARCH_HAVE_BLAKE3
+    InputVerifier::InputVerifier(const std::vector<std::string> &filenames)
+    {
+        for (const std::string &filename : filenames)
+        {
+            std::string digest = ReadExpectedDigest(filename);
+            const bool verified = IsVerified(filename, digest);
+            inputs_.push_back({filename, std::move(digest), verified, verified ? Result::Unchanged
+                                                                             : Result::Mismatch});
+        }
+        thread_ = std::thread([this]
+                              { HashInputs(); });
+    }
+
+    InputVerifier::~InputVerifier()
+    {
+        cancelled_ = true;
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    bool InputVerifier::Finish(std::ostream *status)
+    {
+        thread_.join();
+        bool all_match = true;
+        for (const VerifiedInput &input : inputs_)
+        {
+            if (input.result == Result::Mismatch)
+            {
+                std::cerr << "Checksum mismatch: " << input.filename << " does not match "
+                          << ChecksumFilename(input.filename) << '\n';
+                all_match = false;
+            }
+            else if (input.result == Result::Failed)
+            {
+                std::cerr << "Error verifying " << input.filename << ": " << input.error << '\n';
+                all_match = false;
+            }
+            else if (status)
+            {
+                *status << "BLAKE3 verified: " << input.filename
+                        << (input.result == Result::Unchanged ? " (unchanged since last check)" : "") << '\n';
+            }
+        }
+        return all_match;
+    }
+
+    void InputVerifier::HashInputs()
+    {
+        for (VerifiedInput &input : inputs_)
+        {
+            if (input.skip)
+                continue;
+            try
+            {
+                // Stamped from before hashing, so a write in between
+                // leaves a stamp the next run does not trust.
+                const auto stamp = ArchiveStamp(input.filename);
+                const std::string digest = HashFile(input.filename);
+                if (cancelled_)
+                    return;
+                input.result = (digest == input.digest) ? Result::Match : Result::Mismatch;
+                if (input.result == Result::Match)
+                    SaveVerifiedStamp(input.filename, stamp, digest);
+            }
+            catch (const std::exception &e)
+            {
+                input.result = Result::Failed;
+                input.error = e.what();
+            }
+        }
+    }
+
+    // Large updates let BLAKE3 hash several 1 KB chunks at once in SIMD
+    // lanes; between them, a search that ends early stops the hash.
+    std::string InputVerifier::HashFile(const std::string &filename)
+    {
+        constexpr size_t kUpdateSize = 16 * kChunkSize;
+        const MappedFile file(filename);
+        const std::string_view data = file.View();
+        blake3_hasher hasher;
+        blake3_hasher_init(&hasher);
+        for (size_t offset = 0; offset < data.size() && !cancelled_; offset += kUpdateSize)
+        {
+            blake3_hasher_update(&hasher, data.data() + offset, std::min(kUpdateSize, data.size() - offset));
+        }
+
+        std::array<uint8_t, BLAKE3_OUT_LEN> digest;
+        blake3_hasher_finalize(&hasher, digest.data(), digest.size());
+        std::string hex;
+        for (const uint8_t byte : digest)
+        {
+            hex += "0123456789abcdef"[byte >> 4];
+            hex += "0123456789abcdef"[byte & 15];
+        }
+        return hex;
+    }
+#endif
+
+    // An input opened for searching: the entries of an archive, or a text
+    // file as a single entry named after it, with what splits them into
+    // ranges.
+    struct SearchInput
+    {
+        std::string filename;
+        InputFormat format;
+        ZipIndex entries;
+        CheckpointIndex checkpoints;
+        ZstdSeekTable frames;
+    };
+
+    std::vector<SearchInput> OpenSearchInputs(const std::vector<std::string> &filenames)
+    {
+        std::vector<SearchInput> inputs;
+        inputs.reserve(filenames.size());
+        for (const std::string &filename : filenames)
+        {
+            SearchInput &input = inputs.emplace_back(SearchInput{filename, DetectInputFormat(filename), {}, {}, {}});
+            if (input.format == InputFormat::Zip)
+            {
+                input.entries = CreateZipIndex(filename);
+                continue;
+            }
+#ifndef SEARCH_HAVE_ZSTD
+            if (input.format == InputFormat::Zstd)
+            {
+                throw std::runtime_error("Searching zstd files needs a build with -DSEARCH_ZSTD=ON: " + filename);
+            }
+#endif
+            // Until a stream is inflated, its compressed size stands in for
+            // the size of its text when tasks are ordered.
+            uint64_t size = std::filesystem::file_size(filename);
+            if (input.format == InputFormat::Zstd)
+            {
+                input.frames = ReadZstdSeekTable(MappedFile(filename).View());
+                if (input.frames.FrameCount() > 0)
+                    size = input.frames.decompressed_offsets.back();
+            }
+            input.entries.push_back({filename, {0, size, size, 0, false}});
+        }
+        return inputs;
+    }
+
+    void LoadInputCheckpoints(std::vector<SearchInput> &inputs, uint64_t span, size_t prefetch_blocks,
+                              std::ostream *status = nullptr)
+    {
+        for (SearchInput &input : inputs)
+        {
+            if (input.format == InputFormat::Zip)
+                input.checkpoints =
+                    LoadOrBuildCheckpoints(input.filename, input.entries, span, prefetch_blocks, status);
+        }
+    }
+
+    // Consecutive parts of an entry that have been searched: the first
+    // `count` occurrences of `parts` are reported. They follow the
+    // `first_line` lines of the parts that were handed over before them.
+    struct FinishedEntry
+    {
+        const std::string &name;
+        std::span<const SearchResult> parts;
+        uint64_t count;
+        uint64_t first_line = 0;
+
+        // Calls handler(occurrence, context) for each reported occurrence in
+        // order. Each part numbers its lines from 1, so they are renumbered
+        // from the start of the entry.
+        template <typename OccurrenceHandler>
+        void ForEachOccurrence(OccurrenceHandler &&handler) const
+        {
+            uint64_t remaining = count;
+            uint64_t first_line = this->first_line;
+            for (size_t i = 0; i < parts.size() && remaining > 0; ++i)
+            {
+                parts[i].ForEachOccurrence(remaining, [&](Occurrence occurrence, std::string_view context)
+                {
+                    occurrence.line += first_line;
+                    handler(occurrence, context);
+                });
+                remaining -= std::min(remaining, parts[i].Count());
+                first_line += parts[i].line_count;
+            }
+        }
+    };
+
+    std::string_view EntryReport::Name() const
+    {
+        return entry_.name;
+    }
+
+    uint64_t EntryReport::Count() const
+    {
+        return entry_.count;
+    }
+
+    void EntryReport::ForEachOccurrence(const std::function<void(const Occurrence &, std::string_view)> &handler) const
+    {
+        entry_.ForEachOccurrence(handler);
+    }
+
+    // Searches every entry of `inputs` with one set of workers and returns
+    // how many occurrences were reported. Each finished entry is handed to
+    // on_entry(const FinishedEntry &) on the worker that completed it, so
+    // several may be handed over at once; for an entry that could not be
+    // searched, on_error(name, exception) is called instead, one at a time.
+    // With stream_parts the ranges of a split entry are handed over in
+    // order as soon as every range before them is, so their matches need
+    // not wait for the whole entry; an entry that fails then may already
+    // have reported its first ranges.
+    // With a max_count the workers stop once that many have been found, and
+    // at most that many are reported. `stats` is empty or holds one slot per
+    // worker.
+    template <typename Matcher, typename EntryHandler, typename ErrorHandler>
+    uint64_t ScanInputs(const std::vector<SearchInput> &inputs, const Matcher &matcher, const ScanOptions &options,
+                        ThreadPool &pool, HitCounter &hits, std::span<WorkerStats> stats, EntryHandler &&on_entry,
+                        ErrorHandler &&on_error)
+    {
+        std::atomic<uint64_t> total_count = 0;
+        std::mutex state_mutex;
+
+        // Large entries are split into byte ranges: stored ones and plain
+        // files at fixed offsets of the mapped data, deflated ones at their
+        // inflate checkpoints and seekable zstd files at frame boundaries.
+        // The parts of an entry are merged and handed over once its last
+        // range is done, or with stream_parts once the ranges before them
+        // are.
+        enum class TaskKind
+        {
+            Stream,
+            CheckpointRange,
+            StoredRange,
+            ZstdFrames,
+        };
+
+        struct SearchTask
+        {
+            TaskKind kind;
+            const SearchInput *input;
+            const ZipEntry *entry;
+            const EntryCheckpoints *checkpoints; // set for checkpoint ranges
+            uint64_t data_offset;                // set for stored ranges
+            uint64_t begin;
+            uint64_t end;
+            size_t part;
+            size_t pending_index;
+        };
+
+        struct PendingEntry
+        {
+            std::string name;
+            std::vector<SearchResult> parts;
+            std::vector<bool> done;
+            size_t remaining;
+            size_t counted = 1;          // parts whose hits are in `hits`
+            size_t reported = 0;         // parts handed over to on_entry
+            uint64_t reported_lines = 0; // the lines of those parts
+            bool reporting = false;      // a worker is handing parts over
+            bool failed = false;
+        };
+
+        std::vector<SearchTask> tasks;
+        std::vector<PendingEntry> pending;
+        for (const SearchInput &input : inputs)
+        {
+            std::unique_ptr<ZipArchive> archive;
+            if (input.format == InputFormat::Zip)
+                archive = std::make_unique<ZipArchive>(input.filename, options.prefetch_blocks);
+
+            for (const ZipEntry &entry : input.entries)
+            {
+                size_t parts = 0;
+                auto add_task = [&](TaskKind kind, const EntryCheckpoints *entry_checkpoints, uint64_t data_offset,
+                                    uint64_t begin, uint64_t end)
+                {
+                    tasks.push_back({kind, &input, &entry, entry_checkpoints, data_offset, begin, end, parts++,
+                                     pending.size()});
+                };
+
+                auto found = input.checkpoints.find(entry.name);
+                if (input.format == InputFormat::Plain)
+                {
+                    for (uint64_t begin = 0; begin < entry.info.size; begin += kStoredRangeSize)
+                    {
+                        add_task(TaskKind::StoredRange, nullptr, 0, begin,
+                                 std::min<uint64_t>(begin + kStoredRangeSize, entry.info.size));
+                    }
+                    if (parts == 0)
+                        add_task(TaskKind::StoredRange, nullptr, 0, 0, 0);
+                }
+                else if (input.format == InputFormat::Zstd && input.frames.FrameCount() > 0)
+                {
+                    // Ranges of at least kStoredRangeSize, each starting after
+                    // a frame that is not empty.
+                    const auto &offsets = input.frames.decompressed_offsets;
+                    uint64_t begin = 0;
+                    for (size_t frame = 1; frame < offsets.size(); ++frame)
+                    {
+                        if (frame + 1 == offsets.size() ||
+                            (offsets[frame] - begin >= kStoredRangeSize && offsets[frame] > offsets[frame - 1]))
+                        {
+                            add_task(TaskKind::ZstdFrames, nullptr, 0, begin, offsets[frame]);
+                            begin = offsets[frame];
+                        }
+                    }
+                }
+                else if (found != input.checkpoints.end() && found->second.size == entry.info.size)
+                {
+                    const auto &points = found->second.points;
+                    for (size_t range = 0; range < points.size(); ++range)
+                    {
+                        const uint64_t end = (range + 1 < points.size()) ? points[range + 1].out_offset
+                                                                         : entry.info.size;
+                        add_task(TaskKind::CheckpointRange, &found->second, 0, points[range].out_offset, end);
+                    }
+                }
+                else if (archive && entry.info.compression_method == 0 && !entry.info.encrypted &&
+                         entry.info.size >= 2 * kStoredRangeSize)
+                {
+                    const uint64_t data_offset = ZipEntryReader(*archive, entry.name, entry.info).DataOffset();
+                    for (uint64_t begin = 0; data_offset != 0 && begin < entry.info.size; begin += kStoredRangeSize)
+                    {
+                        add_task(TaskKind::StoredRange, nullptr, data_offset, begin,
+                                 std::min<uint64_t>(begin + kStoredRangeSize, entry.info.size));
+                    }
+                }
+
+                if (parts == 0)
+                {
+                    add_task(TaskKind::Stream, nullptr, 0, 0, entry.info.size);
+                }
+                std::string name = (archive && inputs.size() > 1) ? input.filename + '/' + entry.name : entry.name;
+                pending.push_back({std::move(name), std::vector<SearchResult>(parts), std::vector<bool>(parts), parts});
+            }
+        }
+
+        std::stable_sort(tasks.begin(), tasks.end(), [](const SearchTask &a, const SearchTask &b)
+                         { return a.end - a.begin > b.end - b.begin; });
+
+        // Each worker keeps the archive of its last zip entry open.
+        std::vector<std::unique_ptr<ZipArchive>> worker_archives(pool.Size());
+
+        pool.Run(tasks.size(), [&](size_t worker_index, size_t i)
+        {
+            std::unique_ptr<ZipArchive> &worker_archive = worker_archives[worker_index];
+            const SearchTask &task = tasks[i];
+            const std::string &filename = task.input->filename;
+            const auto &[entry_name, file_info] = *task.entry;
+            const std::string &file_name = pending[task.pending_index].name;
+
+            // The stats pointer must not outlive this task on a pool thread.
+            struct StatsScope
+            {
+                explicit StatsScope(WorkerStats *stats) { worker_stats = stats; }
+                ~StatsScope() { worker_stats = nullptr; }
+            } stats_scope(stats.empty() ? nullptr : &stats[worker_index]);
+            AddStat(&WorkerStats::tasks, 1);
+
+            SearchResult part(file_name);
+            bool failed = false;
+            try
+            {
+                if (hits.Reached())
+                    part.truncated = true;
+                else if (task.kind == TaskKind::CheckpointRange)
+                    part = SearchInCheckpointRange(filename, file_name, *task.checkpoints, task.part, matcher,
+                                                   options, hits);
+                else if (task.kind == TaskKind::StoredRange)
+                    part = SearchInStoredRange(filename, file_name, file_info, task.data_offset, task.begin,
+                                               task.end, matcher, options, hits);
+#ifdef SEARCH_HAVE_ZSTD
+                else if (task.kind == TaskKind::ZstdFrames)
+                    part = SearchInZstdFrames(filename, file_name, task.input->frames, task.begin, task.end, matcher,
+                                              options, hits);
+                else if (task.input->format == InputFormat::Zstd)
+                {
+                    ZstdReader reader(filename);
+                    part = SearchInFile(reader, file_name, matcher, options, hits);
+                }
+#endif
+                else if (task.input->format == InputFormat::Gzip)
+                {
+                    GzipReader reader(filename);
+                    part = SearchInFile(reader, file_name, matcher, options, hits);
+                }
+                else
+                {
+                    if (!worker_archive || worker_archive->Filename() != filename)
+                        worker_archive = std::make_unique<ZipArchive>(filename, options.prefetch_blocks);
+                    ZipEntryReader reader(*worker_archive, entry_name, file_info);
+                    part = SearchInFile(reader, file_name, matcher, options, hits);
+                }
+                // A part that has to wait for those before it does so
+                // without holding on to its buffer.
+                bool waits = pending[task.pending_index].parts.size() > 1;
+                if (waits && options.stream_parts)
+                {
+                    std::lock_guard<std::mutex> lock(state_mutex);
+                    waits = pending[task.pending_index].reported != task.part;
+                }
+                if (waits)
+                    part.Spill();
+            }
+            catch (const std::exception &e)
+            {
+                failed = true;
+                std::lock_guard<std::mutex> lock(state_mutex);
+                on_error(file_name, e);
+            }
+
+            std::unique_lock<std::mutex> lock(state_mutex, std::defer_lock);
+            {
+                StageTimer timer(&WorkerStats::lock_wait_seconds);
+                lock.lock();
+            }
+            PendingEntry &entry = pending[task.pending_index];
+            entry.parts[task.part] = std::move(part);
+            entry.done[task.part] = true;
+            entry.failed |= failed;
+
+            // Only the first part of an entry counts its hits as it goes. The
+            // others may yet be dropped by an earlier part stopping short, so
+            // theirs only count once every part before them is complete; that
+            // way reaching the limit guarantees as many hits get reported.
+            while (entry.counted < entry.parts.size() && entry.done[entry.counted - 1] &&
+                   entry.done[entry.counted] && !entry.parts[entry.counted - 1].truncated)
+            {
+                hits.Add(entry.parts[entry.counted++].Count());
+            }
+            if (--entry.remaining == 0)
+                AddStat(&WorkerStats::entries, 1);
+
+            // One worker at a time hands over the parts of an entry that are
+            // ready, and then also those that finished meanwhile. A part that
+            // stopped early left its line count short, which would misnumber
+            // every later one, so those are dropped.
+            while (!entry.failed && !entry.reporting && (options.stream_parts || entry.remaining == 0))
+            {
+                size_t end = entry.reported;
+                while (end < entry.parts.size() && entry.done[end] && (end == 0 || !entry.parts[end - 1].truncated))
+                {
+                    ++end;
+                }
+                if (end == entry.reported)
+                    break;
+                std::vector<SearchResult> parts(std::make_move_iterator(entry.parts.begin() + entry.reported),
+                                                std::make_move_iterator(entry.parts.begin() + end));
+                const uint64_t first_line = entry.reported_lines;
+                uint64_t count = 0;
+                for (const SearchResult &searched : parts)
+                {
+                    entry.reported_lines += searched.line_count;
+                    count += searched.Count();
+                }
+                entry.reported = end;
+                entry.reporting = true;
+                lock.unlock();
+
+                bool skipped = false;
+                if (options.max_count > 0)
+                {
+                    const uint64_t reported = total_count.fetch_add(count);
+                    const bool cut_off = parts.back().truncated || reported >= options.max_count;
+                    count = (reported >= options.max_count) ? 0 : std::min(count, options.max_count - reported);
+                    // Skip parts the limit cut off before they found anything.
+                    skipped = count == 0 && cut_off;
+                }
+                else
+                    total_count += count;
+                if (!skipped)
+                    on_entry(FinishedEntry{file_name, parts, count, first_line});
+
+                parts.clear();
+                lock.lock();
+                entry.reporting = false;
+            }
+        });
+
+        return std::min(total_count.load(), options.max_count > 0 ? options.max_count : UINT64_MAX);
+    }
+
+    uint64_t MixHash(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // 64-bit hash of a filter key, mixing in eight bytes at a time.
+    uint64_t HashKey(std::string_view key)
+    {
+        uint64_t hash = 0x9e3779b97f4a7c15ULL ^ key.size();
+        size_t i = 0;
+        for (; i + 8 <= key.size(); i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, key.data() + i, sizeof(word));
+            hash = MixHash(hash ^ word);
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, key.data() + i, key.size() - i);
+        return MixHash(hash ^ tail);
+    }
+
+    // Bloom filter split into 64-byte blocks: a key sets all of its bits in
+    // one block, so a query touches a single cache line (Putze, Sanders and
+    // Singler, "Cache-, Hash- and Space-Efficient Bloom Filters"). A negative
+    // answer is definite; a positive one still needs the index.
+    class BlockedBloomFilter
+    {
+    public:
+        static constexpr size_t kBlockWords = 8;
+        static constexpr uint32_t kBlockBits = 512;
+
+        // An empty filter sized for `expected_keys` at the given rate.
+        BlockedBloomFilter(uint64_t expected_keys, double false_positive_rate)
+        {
+            if (!(false_positive_rate > 0 && false_positive_rate < 1))
+            {
+                throw std::runtime_error("False-positive rate must be between 0 and 1");
+            }
+            // Start from the classic optimum and add bits until the blocked
+            // filter, whose blocks fill unevenly, reaches the requested rate.
+            const double ln2 = std::log(2.0);
+            const double optimal_bits = -std::log(false_positive_rate) / (ln2 * ln2);
+            header_.hash_count = static_cast<uint32_t>(std::clamp(std::lround(optimal_bits * ln2), 1L, 16L));
+            double bits_per_key = optimal_bits;
+            while (BlockedFalsePositiveRate(bits_per_key, header_.hash_count) > false_positive_rate)
+            {
+                bits_per_key *= 1.02;
+            }
+            header_.magic = kBloomMagic;
+            header_.version = 1;
+            header_.block_count = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(
+                                                            static_cast<double>(expected_keys) * bits_per_key / kBlockBits)));
+            owned_.assign(header_.block_count * kBlockWords, 0);
+            blocks_ = owned_;
+        }
+
+        // Maps a filter written by Save.
+        explicit BlockedBloomFilter(const std::string &filename)
+            : file_(std::make_unique<MappedFile>(filename, true))
+        {
+            std::string_view bytes = file_->View();
+            if (bytes.size() < sizeof(BloomHeader))
+            {
+                throw std::runtime_error("Filter file is truncated: " + filename);
+            }
+            std::memcpy(&header_, bytes.data(), sizeof(header_));
+            if (header_.magic != kBloomMagic || header_.version != 1 || header_.hash_count == 0 ||
+                header_.block_count == 0 ||
+                sizeof(BloomHeader) + header_.block_count * kBlockWords * sizeof(uint64_t) > bytes.size())
+            {
+                throw std::runtime_error("Not a valid filter file: " + filename);
+            }
+            blocks_ = {reinterpret_cast<const uint64_t *>(bytes.data() + sizeof(BloomHeader)),
+                       header_.block_count * kBlockWords};
+        }
+
+        void Add(std::string_view key)
+        {
+            ForEachBit(key, [&](size_t word, uint64_t bit)
+                       { owned_[word] |= bit; return true; });
+            header_.key_count++;
+        }
+
+        bool MayContain(std::string_view key) const
+        {
+            return ForEachBit(key, [&](size_t word, uint64_t bit)
+                              { return (blocks_[word] & bit) != 0; });
+        }
+
+        void Save(const std::string &filename) const
+        {
+            std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+            out.write(reinterpret_cast<const char *>(blocks_.data()),
+                      static_cast<std::streamsize>(blocks_.size() * sizeof(uint64_t)));
+            if (!out)
+            {
+                throw std::runtime_error("Error writing filter file: " + filename);
+            }
+        }
+
+        uint64_t SizeInBytes() const
+        {
+            return sizeof(BloomHeader) + blocks_.size() * sizeof(uint64_t);
+        }
+
+        uint64_t KeyCount() const
+        {
+            return header_.key_count;
+        }
+
+        uint64_t IndexStamp() const
+        {
+            return header_.index_stamp;
+        }
+
+        void SetIndexStamp(uint64_t stamp)
+        {
+            header_.index_stamp = stamp;
+        }
+
+    private:
+        // Expected false-positive rate of a blocked filter: the keys per
+        // block follow a Poisson distribution, and each block behaves like a
+        // small classic Bloom filter.
+        static double BlockedFalsePositiveRate(double bits_per_key, uint32_t hash_count)
+        {
+            const double mean = kBlockBits / bits_per_key;
+            double probability = std::exp(-mean); // of a block holding `keys` keys
+            double rate = 0;
+            for (int keys = 0; keys < mean * 4 + 64; ++keys)
+            {
+                const double unset = std::pow(1.0 - 1.0 / kBlockBits, static_cast<double>(hash_count) * keys);
+                rate += probability * std::pow(1.0 - unset, hash_count);
+                probability *= mean / (keys + 1);
+            }
+            return rate;
+        }
+
+        // Calls visit(word, bit) for the key's bits until it returns false.
+        // The block comes from the key hash and each bit from the next 9
+        // bits of a chain of further mixes; double hashing would correlate
+        // the bits too much within a block this small.
+        template <typename Visit>
+        bool ForEachBit(std::string_view key, Visit &&visit) const
+        {
+            const uint64_t hash = HashKey(key);
+            const size_t block = static_cast<size_t>(hash % header_.block_count) * kBlockWords;
+            uint64_t state = hash, bits = 0;
+            for (uint32_t i = 0; i < header_.hash_count; ++i, bits >>= 9)
+            {
+                if (i % 7 == 0)
+                    bits = state = MixHash(state + 0x9e3779b97f4a7c15ULL);
+                const uint32_t bit = static_cast<uint32_t>(bits % kBlockBits);
+                if (!visit(block + bit / 64, uint64_t{1} << (bit % 64)))
+                    return false;
+            }
+            return true;
+        }
+
+        BloomHeader header_{};
+        std::vector<uint64_t> owned_;
+        std::span<const uint64_t> blocks_;
+        std::unique_ptr<MappedFile> file_;
+    };
+
+    // The filter of an index lives next to it, like its trigram index and
+    // digest tables.
+    std::string FilterFilename(const std::string &index_filename)
+    {
+        return index_filename + ".bloom";
+    }
+
+    struct LineRef
+    {
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    // Sorts and deduplicates the lines collected so far and writes them to a
+    // temporary run file next to the index.
+    std::string FlushIndexRun(const std::vector<char> &arena, std::vector<LineRef> &lines,
+                              const std::string &index_filename, size_t run_number)
+    {
+        auto view = [&](const LineRef &ref)
+        {
+            return std::string_view(arena.data() + ref.offset, ref.length);
+        };
+        std::sort(lines.begin(), lines.end(),
+                  [&](const LineRef &a, const LineRef &b)
+                  { return view(a) < view(b); });
+
+        std::string run_filename = index_filename + ".run" + std::to_string(run_number);
+        std::ofstream out(run_filename, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Error creating run file: " + run_filename);
+        }
+
+        for (size_t i = 0; i < lines.size(); ++i)
+        {
+            std::string_view line = view(lines[i]);
+            if (i > 0 && line == view(lines[i - 1]))
+                continue;
+            out.write(line.data(), static_cast<std::streamsize>(line.size()));
+            out.put('\n');
+        }
+
+        if (!out)
+        {
+            throw std::runtime_error("Error writing run file: " + run_filename);
+        }
+        return run_filename;
+    }
+
+    std::string TrigramFilename(const std::string &index_filename)
+    {
+        return index_filename + ".tri";
+    }
+
+    // The trigram of the three bytes at `text`.
+    uint32_t TrigramAt(const char *text)
+    {
+        return static_cast<uint32_t>(static_cast<unsigned char>(text[0])) << 16 |
+               static_cast<uint32_t>(static_cast<unsigned char>(text[1])) << 8 |
+               static_cast<uint32_t>(static_cast<unsigned char>(text[2]));
+    }
+
+    void AppendVarint(std::vector<char> &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    uint64_t ReadVarint(const char *&in)
+    {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            const auto byte = static_cast<unsigned char>(*in++);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (byte < 0x80)
+                return value;
+        }
+    }
+
+    // Builds a trigram index over the lines of a sorted index as they are
+    // written. (trigram, line) pairs are collected until a segment is full,
+    // then sorted and written out as postings, so memory stays bounded.
+    class TrigramIndexWriter
+    {
+    public:
+        explicit TrigramIndexWriter(const std::string &filename)
+            : filename_(filename), out_(filename, std::ios::binary | std::ios::trunc)
+        {
+            if (!out_)
+            {
+                throw std::runtime_error("Error creating trigram index: " + filename);
+            }
+            header_.magic = kTrigramMagic;
+            header_.version = 1;
+            out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+        }
+
+        // Adds the next line of the index.
+        void Add(std::string_view line)
+        {
+            if (pairs_.size() + line.size() > kTrigramSegmentPairs)
+                FlushSegment();
+            const uint64_t local_line = header_.line_count - segment_first_line_;
+            for (size_t i = 0; i + 3 <= line.size(); ++i)
+            {
+                pairs_.push_back(static_cast<uint64_t>(TrigramAt(line.data() + i)) << 40 | local_line);
+            }
+            header_.line_count++;
+        }
+
+        // Writes the segment table once the index is complete, and records
+        // which build of it this is.
+        void Finish(const IndexHeader &index_header)
+        {
+            FlushSegment();
+            header_.index_data_size = index_header.data_size;
+            header_.index_stamp = index_header.stamp;
+            header_.segment_count = segment_offsets_.size();
+            header_.segment_table_offset = static_cast<uint64_t>(out_.tellp());
+            out_.write(reinterpret_cast<const char *>(segment_offsets_.data()),
+                       static_cast<std::streamsize>(segment_offsets_.size() * sizeof(uint64_t)));
+            out_.seekp(0);
+            out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+            if (!out_)
+            {
+                throw std::runtime_error("Error writing trigram index: " + filename_);
+            }
+        }
+
+    private:
+        static constexpr uint64_t kLineMask = (uint64_t{1} << 40) - 1;
+
+        void FlushSegment()
+        {
+            if (header_.line_count == segment_first_line_)
+                return;
+
+            // Sorting by trigram and then line also brings up repeats of a
+            // trigram within one line next to each other.
+            std::sort(pairs_.begin(), pairs_.end());
+            pairs_.erase(std::unique(pairs_.begin(), pairs_.end()), pairs_.end());
+
+            std::vector<TrigramEntry> entries;
+            std::vector<char> postings;
+            uint64_t previous_line = 0;
+            for (uint64_t pair : pairs_)
+            {
+                const auto trigram = static_cast<uint32_t>(pair >> 40);
+                const uint64_t line = pair & kLineMask;
+                if (entries.empty() || entries.back().trigram != trigram)
+                {
+                    entries.push_back({trigram, 0, postings.size()});
+                    previous_line = 0;
+                }
+                AppendVarint(postings, line - previous_line);
+                entries.back().count++;
+                previous_line = line;
+            }
+
+            TrigramSegment segment{segment_first_line_, header_.line_count - segment_first_line_, entries.size(),
+                                   postings.size()};
+            segment_offsets_.push_back(static_cast<uint64_t>(out_.tellp()));
+            out_.write(reinterpret_cast<const char *>(&segment), sizeof(segment));
+            out_.write(reinterpret_cast<const char *>(entries.data()),
+                       static_cast<std::streamsize>(entries.size() * sizeof(TrigramEntry)));
+            out_.write(postings.data(), static_cast<std::streamsize>(postings.size()));
+            const uint64_t padding = (8 - postings.size() % 8) % 8;
+            out_.write("\0\0\0\0\0\0\0", static_cast<std::streamsize>(padding));
+
+            pairs_.clear();
+            segment_first_line_ = header_.line_count;
+        }
+
+        std::string filename_;
+        std::ofstream out_;
+        TrigramHeader header_{};
+        std::vector<uint64_t> pairs_;
+        std::vector<uint64_t> segment_offsets_;
+        uint64_t segment_first_line_ = 0;
+    };
+
+    // k-way merges the sorted run files and hands every line to `on_line`
+    // once, in sorted order, dropping lines that occur in more than one run.
+    template <typename LineHandler>
+    void MergeRuns(const std::vector<std::string> &run_filenames, LineHandler &&on_line)
+    {
+        std::vector<std::ifstream> runs;
+        std::vector<std::string> heads(run_filenames.size());
+        runs.reserve(run_filenames.size());
+        for (const auto &run_filename : run_filenames)
+        {
+            runs.emplace_back(run_filename, std::ios::binary);
+            if (!runs.back())
+            {
+                throw std::runtime_error("Error opening run file: " + run_filename);
+            }
+        }
+
+        auto greater = [&](size_t a, size_t b)
+        { return heads[a] > heads[b]; };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            if (std::getline(runs[i], heads[i]))
+                queue.push(i);
+        }
+
+        std::string previous;
+        bool first = true;
+        while (!queue.empty())
+        {
+            size_t i = queue.top();
+            queue.pop();
+
+            if (first || heads[i] != previous)
+            {
+                on_line(std::string_view(heads[i]));
+                previous = heads[i];
+                first = false;
+            }
+
+            if (std::getline(runs[i], heads[i]))
+                queue.push(i);
+        }
+    }
+
+    // Tells a build of an index from the next one. The fence table holds the
+    // offset of every kFenceInterval-th line, so it changes along with
+    // almost any change to the lines.
+    uint64_t IndexStamp(const IndexHeader &header, std::span<const uint64_t> fences)
+    {
+        const std::string_view bytes(reinterpret_cast<const char *>(fences.data()), fences.size_bytes());
+        return MixHash(HashKey(bytes) ^ MixHash(header.line_count ^ MixHash(header.data_size)));
+    }
+
+    // Merges the sorted run files into the final index, recording a fence
+    // pointer for every kFenceInterval-th line and adding every line to
+    // `trigrams` if given.
+    IndexHeader MergeIndexRuns(const std::vector<std::string> &run_filenames,
+                               const std::string &index_filename,
+                               TrigramIndexWriter *trigrams)
+    {
+        std::ofstream out(index_filename, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Error creating index file: " + index_filename);
+        }
+
+        IndexHeader header{};
+        header.magic = kIndexMagic;
+        header.version = 1;
+        header.fence_interval = kFenceInterval;
+        header.data_offset = sizeof(IndexHeader);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        std::vector<uint64_t> fences;
+        MergeRuns(run_filenames, [&](std::string_view line)
+        {
+            if (header.line_count % kFenceInterval == 0)
+                fences.push_back(header.data_size);
+            out.write(line.data(), static_cast<std::streamsize>(line.size()));
+            out.put('\n');
+            if (trigrams)
+                trigrams->Add(line);
+            header.data_size += line.size() + 1;
+            header.line_count++;
+        });
+
+        uint64_t padding = (8 - (header.data_offset + header.data_size) % 8) % 8;
+        out.write("\0\0\0\0\0\0\0", static_cast<std::streamsize>(padding));
+        header.fence_offset = header.data_offset + header.data_size + padding;
+        header.fence_count = fences.size();
+        out.write(reinterpret_cast<const char *>(fences.data()),
+                  static_cast<std::streamsize>(fences.size() * sizeof(uint64_t)));
+        header.stamp = IndexStamp(header, fences);
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        if (!out)
+        {
+            throw std::runtime_error("Error writing index file: " + index_filename);
+        }
+        return header;
+    }
+
+    // Reads the non-empty lines of every archive entry, without a trailing
+    // '\r', into sorted, deduplicated run files named after `run_prefix` of
+    // up to kIndexRunBudget each.
+    void WriteIndexRuns(const std::string &zip_filename, const std::string &run_prefix,
+                            std::vector<std::string> &run_filenames)
+    {
+        auto index = CreateZipIndex(zip_filename);
+        ZipArchive archive(zip_filename);
+
+        std::vector<char> arena;
+        std::vector<LineRef> lines;
+
+        auto add_line = [&](std::string_view line)
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            if (line.empty())
+                return;
+            if (arena.size() + line.size() + (lines.size() + 1) * sizeof(LineRef) > kIndexRunBudget)
+            {
+                run_filenames.push_back(FlushIndexRun(arena, lines, run_prefix, run_filenames.size()));
+                arena.clear();
+                lines.clear();
+            }
+            lines.push_back({arena.size(), static_cast<uint32_t>(line.size())});
+            arena.insert(arena.end(), line.begin(), line.end());
+        };
+
+        for (const auto &[file_name, file_info] : index)
+        {
+            ZipEntryReader reader(archive, file_name, file_info);
+            reader.ForEachChunk([] { return UINT64_MAX; }, [&](std::string_view window, size_t carried) -> size_t
+            {
+                // A window without new bytes holds a last line lacking '\n'.
+                if (window.size() == carried)
+                {
+                    add_line(window);
+                    return 0;
+                }
+
+                size_t line_start = 0;
+                for (size_t newline; (newline = window.find('\n', line_start)) != std::string_view::npos;
+                     line_start = newline + 1)
+                {
+                    add_line(window.substr(line_start, newline - line_start));
+                }
+
+                // Carry the incomplete last line into the next window, unless
+                // it is too long to carry; then it is split.
+                if (window.size() - line_start >= kChunkSize)
+                {
+                    add_line(window.substr(line_start));
+                    return 0;
+                }
+                return window.size() - line_start;
+            });
+        }
+
+        if (!lines.empty() || run_filenames.empty())
+        {
+            run_filenames.push_back(FlushIndexRun(arena, lines, run_prefix, run_filenames.size()));
+        }
+    }
+
+    // Adds every line of a finished index to `filter`.
+    void AddIndexLines(const std::string &index_filename, const IndexHeader &header, BlockedBloomFilter &filter)
+    {
+        const MappedFile index(index_filename, header.data_offset, static_cast<size_t>(header.data_size));
+        const std::string_view data = index.View();
+        for (size_t line_start = 0, newline; (newline = data.find('\n', line_start)) != std::string_view::npos;
+             line_start = newline + 1)
+        {
+            filter.Add(data.substr(line_start, newline - line_start));
+        }
+    }
+
+    void BuildIndex(const std::string &zip_filename, const std::string &index_filename,
+                    double false_positive_rate, bool build_trigrams)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        std::vector<std::string> run_filenames;
+        WriteIndexRuns(zip_filename, index_filename, run_filenames);
+
+        // A trigram index of an earlier build would no longer match.
+        std::unique_ptr<TrigramIndexWriter> trigrams;
+        if (build_trigrams)
+            trigrams = std::make_unique<TrigramIndexWriter>(TrigramFilename(index_filename));
+        else
+            std::filesystem::remove(TrigramFilename(index_filename));
+        IndexHeader header = MergeIndexRuns(run_filenames, index_filename, trigrams.get());
+        if (trigrams)
+            trigrams->Finish(header);
+        for (const auto &run_filename : run_filenames)
+        {
+            std::filesystem::remove(run_filename);
+        }
+
+        // Only the merge knows how many distinct lines there are, so the
+        // filter is sized for them and then filled from the index, a
+        // sequential read of a file that is still in the page cache.
+        BlockedBloomFilter filter(header.line_count, false_positive_rate);
+        AddIndexLines(index_filename, header, filter);
+        filter.SetIndexStamp(header.stamp);
+        const std::string filter_filename = FilterFilename(index_filename);
+        filter.Save(filter_filename);
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double> elapsed = end_time - start_time;
+
+        std::cout << "Index written to " << index_filename << ": " << header.line_count
+                  << " unique lines in " << run_filenames.size() << " run(s)\n";
+        std::cout << "Filter written to " << filter_filename << ": " << filter.SizeInBytes() / 1024
+                  << " KB for a false-positive rate of " << false_positive_rate << '\n';
+        if (trigrams)
+            std::cout << "Trigram index written to " << TrigramFilename(index_filename) << '\n';
+        std::cout << "Time taken: " << elapsed.count() << " seconds\n";
+    }
+
+    std::string StoreFilename(const std::string &zip_filename)
+    {
+        return zip_filename + ".store";
+    }
+
+    // Zstd when it is built in, else deflate, which every build can read.
+    StoreCodec DefaultStoreCodec()
+    {
+#ifdef SEARCH_HAVE_ZSTD
+        return StoreCodec::Zstd;
+#else
+        return StoreCodec::Deflate;
+#endif
+    }
+
+    std::string CompressStoreBlock(StoreCodec codec, std::string_view block)
+    {
+        std::string compressed;
+        if (codec == StoreCodec::Zstd)
+        {
+#ifdef SEARCH_HAVE_ZSTD
+            compressed.resize(ZSTD_compressBound(block.size()));
+            const size_t size = ZSTD_compress(compressed.data(), compressed.size(), block.data(), block.size(), 9);
+            if (ZSTD_isError(size))
+            {
+                throw std::runtime_error(std::string("Error compressing store block: ") + ZSTD_getErrorName(size));
+            }
+            compressed.resize(size);
+            return compressed;
+#endif
+        }
+        uLongf size = compressBound(static_cast<uLong>(block.size()));
+        compressed.resize(size);
+        if (compress2(reinterpret_cast<Bytef *>(compressed.data()), &size,
+                      reinterpret_cast<const Bytef *>(block.data()), static_cast<uLong>(block.size()),
+                      Z_BEST_COMPRESSION) != Z_OK)
+        {
+            throw std::runtime_error("Error compressing store block");
+        }
+        compressed.resize(size);
+        return compressed;
+    }
+
+    void DecompressStoreBlock(StoreCodec codec, std::string_view compressed, char *destination, size_t size)
+    {
+        if (codec == StoreCodec::Zstd)
+        {
+#ifdef SEARCH_HAVE_ZSTD
+            if (ZSTD_decompress(destination, size, compressed.data(), compressed.size()) != size)
+            {
+                throw std::runtime_error("Error decompressing store block");
+            }
+            return;
+#else
+            throw std::runtime_error("Reading a zstd store needs a build with -DSEARCH_ZSTD=ON");
+#endif
+        }
+        uLongf inflated = static_cast<uLongf>(size);
+        if (uncompress(reinterpret_cast<Bytef *>(destination), &inflated,
+                       reinterpret_cast<const Bytef *>(compressed.data()), static_cast<uLong>(compressed.size())) != Z_OK ||
+            inflated != size)
+        {
+            throw std::runtime_error("Error decompressing store block");
+        }
+    }
+
+    // Writes sorted lines to a password store, front-coding them into blocks
+    // of about kStoreBlockSize and compressing each block on its own.
+    class StoreWriter
+    {
+    public:
+        StoreWriter(const std::string &filename, StoreCodec codec)
+            : filename_(filename), out_(filename, std::ios::binary | std::ios::trunc)
+        {
+            if (!out_)
+            {
+                throw std::runtime_error("Error creating store file: " + filename);
+            }
+            header_.magic = kStoreMagic;
+            header_.version = 1;
+            header_.codec = codec;
+            out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+            offset_ = sizeof(header_);
+        }
+
+        void Add(std::string_view line)
+        {
+            if (block_.size() >= kStoreBlockSize)
+                FlushBlock();
+            size_t shared = 0;
+            if (block_lines_ == 0)
+            {
+                blocks_.push_back({0, 0, 0, keys_.size(), static_cast<uint32_t>(line.size()), 0});
+                keys_.insert(keys_.end(), line.begin(), line.end());
+            }
+            else
+            {
+                const size_t limit = std::min(line.size(), previous_.size());
+                while (shared < limit && line[shared] == previous_[shared])
+                    ++shared;
+            }
+            AppendVarint(block_, shared);
+            AppendVarint(block_, line.size() - shared);
+            block_.insert(block_.end(), line.begin() + shared, line.end());
+            previous_.assign(line);
+            block_lines_++;
+            header_.line_count++;
+        }
+
+        StoreHeader Finish()
+        {
+            FlushBlock();
+            header_.block_count = blocks_.size();
+            header_.block_table_offset = offset_;
+            out_.write(reinterpret_cast<const char *>(blocks_.data()),
+                       static_cast<std::streamsize>(blocks_.size() * sizeof(StoreBlock)));
+            header_.key_offset = offset_ + blocks_.size() * sizeof(StoreBlock);
+            header_.key_size = keys_.size();
+            out_.write(keys_.data(), static_cast<std::streamsize>(keys_.size()));
+
+            out_.seekp(0);
+            out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+            out_.close();
+            if (!out_)
+            {
+                throw std::runtime_error("Error writing store file: " + filename_);
+            }
+            return header_;
+        }
+
+    private:
+        void FlushBlock()
+        {
+            if (block_lines_ == 0)
+                return;
+            const std::string compressed =
+                CompressStoreBlock(header_.codec, std::string_view(block_.data(), block_.size()));
+            StoreBlock &block = blocks_.back();
+            block.offset = offset_;
+            block.compressed_size = static_cast<uint32_t>(compressed.size());
+            block.size = static_cast<uint32_t>(block_.size());
+            block.line_count = block_lines_;
+            out_.write(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+            offset_ += compressed.size();
+            block_.clear();
+            block_lines_ = 0;
+        }
+
+        std::string filename_;
+        std::ofstream out_;
+        StoreHeader header_{};
+        uint64_t offset_;
+        std::vector<StoreBlock> blocks_;
+        std::vector<char> keys_;
+        std::vector<char> block_;
+        uint32_t block_lines_ = 0;
+        std::string previous_;
+    };
+
+    // Converts the lines of every archive entry into a password store: the
+    // same sorted, deduplicated lines as BuildIndex, in compressed blocks.
+    void ConvertToStore(const std::string &zip_filename, const std::string &store_filename)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        std::vector<std::string> run_filenames;
+        WriteIndexRuns(zip_filename, store_filename, run_filenames);
+
+        StoreWriter writer(store_filename, DefaultStoreCodec());
+        MergeRuns(run_filenames, [&](std::string_view line)
+                  { writer.Add(line); });
+        const StoreHeader header = writer.Finish();
+        for (const auto &run_filename : run_filenames)
+        {
+            std::filesystem::remove(run_filename);
+        }
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double> elapsed = end_time - start_time;
+
+        constexpr double kMiB = 1024.0 * 1024.0;
+        std::cout << "Store written to " << store_filename << ": " << header.line_count << " unique lines in "
+                  << header.block_count << " blocks, " << std::fixed << std::setprecision(1)
+                  << std::filesystem::file_size(store_filename) / kMiB << " MiB ("
+                  << std::filesystem::file_size(zip_filename) / kMiB << " MiB zipped)\n"
+                  << std::defaultfloat << std::setprecision(6);
+        std::cout << "Time taken: " << elapsed.count() << " seconds\n";
+    }
+
+    // Index of the last of `items`, from `from` on, that satisfies
+    // `not_after`, which must hold for items[from] and be monotone. It
+    // gallops forward before binary-searching, so a run of sorted queries
+    // costs O(log distance) each rather than O(log size).
+    template <typename Items, typename Predicate>
+    size_t GallopLast(const Items &items, size_t from, Predicate not_after)
+    {
+        size_t bound = from + 1;
+        for (size_t step = 1; bound < items.size() && not_after(items[bound]); step *= 2)
+        {
+            from = bound;
+            bound = from + step;
+        }
+        const auto first = items.begin() + static_cast<ptrdiff_t>(from + 1);
+        const auto last = items.begin() + static_cast<ptrdiff_t>(std::min(bound, items.size()));
+        return static_cast<size_t>(std::partition_point(first, last, not_after) - items.begin()) - 1;
+    }
+
+    // Read-only view of an index written by BuildIndex. Lookups binary-search
+    // the fence table and then scan at most kFenceInterval lines.
+    class SortedIndex
+    {
+    public:
+        explicit SortedIndex(const std::string &filename, bool random_access = true)
+            : file_(filename, random_access)
+        {
+            std::string_view bytes = file_.View();
+            if (bytes.size() < sizeof(IndexHeader))
+            {
+                throw std::runtime_error("Index file is truncated: " + filename);
+            }
+            std::memcpy(&header_, bytes.data(), sizeof(header_));
+            if (header_.magic != kIndexMagic || header_.version != 1 ||
+                header_.data_offset + header_.data_size > bytes.size() ||
+                header_.fence_offset + header_.fence_count * sizeof(uint64_t) > bytes.size())
+            {
+                throw std::runtime_error("Not a valid index file: " + filename);
+            }
+            data_ = bytes.substr(header_.data_offset, header_.data_size);
+            fences_ = {reinterpret_cast<const uint64_t *>(bytes.data() + header_.fence_offset),
+                       header_.fence_count};
+        }
+
+        uint64_t LineCount() const
+        {
+            return header_.line_count;
+        }
+
+        uint64_t Stamp() const
+        {
+            return header_.stamp;
+        }
+
+        // Returns the data offset of the first line that is not less than key,
+        // or the data size if there is none.
+        uint64_t LowerBound(std::string_view key) const
+        {
+            auto fence = std::partition_point(fences_.begin(), fences_.end(),
+                                              [&](uint64_t offset)
+                                              { return LineAt(offset) < key; });
+            if (fence == fences_.begin())
+                return 0;
+
+            uint64_t end = (fence == fences_.end()) ? data_.size() : *fence;
+            uint64_t offset = *std::prev(fence);
+            while (offset < end && LineAt(offset) < key)
+            {
+                offset += LineAt(offset).size() + 1;
+            }
+            return offset;
+        }
+
+        bool Contains(std::string_view key) const
+        {
+            uint64_t offset = LowerBound(key);
+            return offset < data_.size() && LineAt(offset) == key;
+        }
+
+        // Sets found[i] for each of `keys`, which must be sorted, that is in
+        // the index. The keys are matched in one forward pass: each gallops
+        // over the fences from the fence of the key before it and then scans
+        // at most one fence interval, continuing where the key before it
+        // stopped, so the index is read in order and only where keys fall.
+        void ContainsSorted(std::span<const std::string> keys, std::span<uint8_t> found) const
+        {
+            size_t fence = 0;
+            uint64_t offset = 0;
+            for (size_t i = 0; i < keys.size() && !fences_.empty(); ++i)
+            {
+                const std::string_view key = keys[i];
+                const size_t key_fence = GallopLast(fences_, fence, [&](uint64_t fence_offset)
+                                                    { return LineAt(fence_offset) <= key; });
+                if (key_fence != fence)
+                {
+                    fence = key_fence;
+                    offset = fences_[fence];
+                }
+                const uint64_t end = (fence + 1 < fences_.size()) ? fences_[fence + 1] : data_.size();
+                while (offset < end && LineAt(offset) < key)
+                {
+                    offset += LineAt(offset).size() + 1;
+                }
+                found[i] = offset < end && LineAt(offset) == key;
+            }
+        }
+
+        // Appends up to `limit` lines starting with prefix, in sorted order.
+        void FindPrefix(std::string_view prefix, size_t limit, std::vector<std::string_view> &lines) const
+        {
+            for (uint64_t offset = LowerBound(prefix); offset < data_.size() && lines.size() < limit;)
+            {
+                std::string_view line = LineAt(offset);
+                if (!line.starts_with(prefix))
+                    break;
+                lines.push_back(line);
+                offset += line.size() + 1;
+            }
+        }
+
+        size_t FenceCount() const
+        {
+            return fences_.size();
+        }
+
+        // Calls function(line, number) for every line from the fence
+        // `first_fence` up to the fence `last_fence`, or to the end.
+        template <typename Function>
+        void ForEachLine(size_t first_fence, size_t last_fence, Function &&function) const
+        {
+            if (first_fence >= fences_.size())
+                return;
+            uint64_t number = first_fence * header_.fence_interval;
+            const uint64_t end = (last_fence < fences_.size()) ? fences_[last_fence] : data_.size();
+            for (uint64_t offset = fences_[first_fence]; offset < end; ++number)
+            {
+                const std::string_view line = LineAt(offset);
+                function(line, number);
+                offset += line.size() + 1;
+            }
+        }
+
+        // The sorted lines, each terminated by '\n'.
+        std::string_view Data() const
+        {
+            return data_;
+        }
+
+        // The line with the given 0-based number, found from the nearest
+        // fence in at most kFenceInterval - 1 steps.
+        std::string_view LineByNumber(uint64_t number) const
+        {
+            uint64_t offset = fences_[number / header_.fence_interval];
+            for (uint64_t skip = number % header_.fence_interval; skip > 0; --skip)
+            {
+                offset += LineAt(offset).size() + 1;
+            }
+            return LineAt(offset);
+        }
+
+    private:
+        std::string_view LineAt(uint64_t offset) const
+        {
+            std::string_view rest = data_.substr(offset);
+            return rest.substr(0, rest.find('\n'));
+        }
+
+        MappedFile file_;
+        IndexHeader header_;
+        std::string_view data_;
+        std::span<const uint64_t> fences_;
+    };
+
+    // The Bloom filter of an index, or null if it has none. A filter from
+    // another build of the index is refused rather than trusted.
+    std::unique_ptr<BlockedBloomFilter> OpenIndexFilter(const std::string &index_filename, const SortedIndex &index)
+    {
+        const std::string filter_filename = FilterFilename(index_filename);
+        if (!std::filesystem::exists(filter_filename))
+            return nullptr;
+        auto filter = std::make_unique<BlockedBloomFilter>(filter_filename);
+        if (filter->KeyCount() != index.LineCount() || filter->IndexStamp() != index.Stamp())
+        {
+            throw std::runtime_error("Filter " + filter_filename + " does not match " + index_filename +
+                                     "; rebuild it with build-index");
+        }
+        return filter;
+    }
+
+    // Read-only view of a password store written by StoreWriter. A lookup
+    // binary-searches the first lines of the blocks and decompresses the
+    // one block that can hold the key.
+    class PasswordStore
+    {
+    public:
+        explicit PasswordStore(const std::string &filename)
+            : file_(filename, true)
+        {
+            std::string_view bytes = file_.View();
+            if (bytes.size() < sizeof(StoreHeader))
+            {
+                throw std::runtime_error("Store file is truncated: " + filename);
+            }
+            std::memcpy(&header_, bytes.data(), sizeof(header_));
+            if (header_.magic != kStoreMagic || header_.version != 1 ||
+                header_.block_table_offset + header_.block_count * sizeof(StoreBlock) > bytes.size() ||
+                header_.key_offset + header_.key_size > bytes.size())
+            {
+                throw std::runtime_error("Not a valid store file: " + filename);
+            }
+            blocks_ = {reinterpret_cast<const StoreBlock *>(bytes.data() + header_.block_table_offset),
+                       header_.block_count};
+            keys_ = bytes.substr(header_.key_offset, header_.key_size);
+        }
+
+        uint64_t LineCount() const
+        {
+            return header_.line_count;
+        }
+
+        bool Contains(std::string_view key) const
+        {
+            // The last block whose first line is not greater than the key.
+            auto block = std::partition_point(blocks_.begin(), blocks_.end(),
+                                              [&](const StoreBlock &b)
+                                              { return FirstLine(b) <= key; });
+            if (block == blocks_.begin())
+                return false;
+            --block;
+
+            const std::unique_ptr<char[]> text = Decompress(*block);
+            const char *in = text.get();
+            const char *end = in + block->size;
+            std::string line;
+            while (in < end)
+            {
+                NextLine(in, line);
+                if (line >= key)
+                    return line == key;
+            }
+            return false;
+        }
+
+        // Sets found[i] for each of `keys`, which must be sorted, that is in
+        // the store. Every block is decompressed at most once, the first time
+        // a key falls into it, and walked forward from key to key.
+        void ContainsSorted(std::span<const std::string> keys, std::span<uint8_t> found) const
+        {
+            size_t block = SIZE_MAX;
+            std::unique_ptr<char[]> text;
+            const char *in = nullptr;
+            const char *end = nullptr;
+            std::string line;
+            bool line_pending = false; // `line` is decoded but not yet behind the keys
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                const std::string_view key = keys[i];
+                if (blocks_.empty() || key < FirstLine(blocks_[0]))
+                    continue;
+                const size_t key_block = GallopLast(blocks_, block == SIZE_MAX ? 0 : block,
+                                                    [&](const StoreBlock &b)
+                                                    { return FirstLine(b) <= key; });
+                if (key_block != block)
+                {
+                    block = key_block;
+                    text = Decompress(blocks_[block]);
+                    in = text.get();
+                    end = in + blocks_[block].size;
+                    line_pending = false;
+                }
+                while (line_pending || in < end)
+                {
+                    if (!line_pending)
+                        NextLine(in, line);
+                    line_pending = line >= key;
+                    if (line_pending)
+                        break;
+                }
+                found[i] = line_pending && line == key;
+            }
+        }
+
+    private:
+        std::unique_ptr<char[]> Decompress(const StoreBlock &block) const
+        {
+            auto text = std::make_unique_for_overwrite<char[]>(block.size);
+            DecompressStoreBlock(header_.codec, file_.View().substr(block.offset, block.compressed_size),
+                                 text.get(), block.size);
+            return text;
+        }
+
+        // Decodes the front-coded line at `in` over the previous one.
+        static void NextLine(const char *&in, std::string &line)
+        {
+            const uint64_t shared = ReadVarint(in);
+            const uint64_t rest = ReadVarint(in);
+            line.resize(shared);
+            line.append(in, rest);
+            in += rest;
+        }
+
+        std::string_view FirstLine(const StoreBlock &block) const
+        {
+            return keys_.substr(block.key_offset, block.key_length);
+        }
+
+        MappedFile file_;
+        StoreHeader header_;
+        std::span<const StoreBlock> blocks_;
+        std::string_view keys_;
+    };
+
+    constexpr std::array<DigestAlgorithm, 3> kDigestAlgorithms = {DigestAlgorithm::Ntlm, DigestAlgorithm::Md5,
+                                                                  DigestAlgorithm::Sha1};
+    constexpr std::array<uint32_t, 5> kDigestInitialState = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                                                             0xc3d2e1f0};
+
+    std::string_view DigestName(DigestAlgorithm algorithm)
+    {
+        switch (algorithm)
+        {
+        case DigestAlgorithm::Ntlm:
+            return "ntlm";
+        case DigestAlgorithm::Md5:
+            return "md5";
+        default:
+            return "sha1";
+        }
+    }
+
+    DigestAlgorithm ParseDigestAlgorithm(std::string_view name)
+    {
+        for (const DigestAlgorithm algorithm : kDigestAlgorithms)
+        {
+            if (DigestName(algorithm) == name)
+                return algorithm;
+        }
+        throw std::runtime_error("Unknown hash algorithm: " + std::string(name));
+    }
+
+    size_t DigestSize(DigestAlgorithm algorithm)
+    {
+        return algorithm == DigestAlgorithm::Sha1 ? 20 : 16;
+    }
+
+    std::string DigestTableFilename(const std::string &index_filename, DigestAlgorithm algorithm)
+    {
+        return index_filename + '.' + std::string(DigestName(algorithm));
+    }
+
+    // Appends the bytes `algorithm` hashes for `line`: the line itself, or
+    // for NTLM its UTF-16LE form, decoding UTF-8 and taking any byte that
+    // is not part of a valid sequence as Latin-1.
+    void AppendDigestMessage(DigestAlgorithm algorithm, std::string_view line, std::string &message)
+    {
+        if (algorithm != DigestAlgorithm::Ntlm)
+        {
+            message.append(line);
+            return;
+        }
+        auto put = [&](uint32_t unit)
+        {
+            message += static_cast<char>(unit & 0xff);
+            message += static_cast<char>(unit >> 8);
+        };
+        auto continuation = [&](size_t i)
+        { return i < line.size() && (static_cast<unsigned char>(line[i]) & 0xc0) == 0x80; };
+        for (size_t i = 0; i < line.size();)
+        {
+            const auto byte = static_cast<unsigned char>(line[i]);
+            const size_t length = (byte >= 0xf0 && byte <= 0xf4) ? 4 : (byte >= 0xe0) ? 3 : (byte >= 0xc2) ? 2 : 1;
+            bool valid = length > 1 && byte < 0xf5;
+            for (size_t k = 1; valid && k < length; ++k)
+            {
+                valid = continuation(i + k);
+            }
+            uint32_t code_point = byte;
+            if (valid)
+            {
+                code_point = byte & (0x7f >> length);
+                for (size_t k = 1; k < length; ++k)
+                {
+                    code_point = (code_point << 6) | (static_cast<unsigned char>(line[i + k]) & 0x3f);
+                }
+                // Overlong forms, surrogates and code points past U+10FFFF.
+                valid = (length != 3 || (code_point >= 0x800 && (code_point < 0xd800 || code_point > 0xdfff))) &&
+                        (length != 4 || (code_point >= 0x10000 && code_point <= 0x10ffff));
+            }
+            if (!valid)
+            {
+                put(byte);
+                ++i;
+                continue;
+            }
+            if (code_point >= 0x10000)
+            {
+                put(0xd800 + ((code_point - 0x10000) >> 10));
+                put(0xdc00 + ((code_point - 0x10000) & 0x3ff));
+            }
+            else
+                put(code_point);
+            i += length;
+        }
+    }
+
+    // Pads a message to whole 64-byte blocks, ending in its length in bits
+    // in the byte order of the algorithm.
+    void PadDigestMessage(DigestAlgorithm algorithm, std::string &message)
+    {
+        const uint64_t bits = message.size() * 8;
+        message += '\x80';
+        message.append((120 - message.size() % 64) % 64, '\0');
+        for (int i = 0; i < 8; ++i)
+        {
+            const int shift = (algorithm == DigestAlgorithm::Sha1) ? 56 - 8 * i : 8 * i;
+            message += static_cast<char>(bits >> shift);
+        }
+    }
+
+    uint32_t LoadDigestWord(DigestAlgorithm algorithm, const char *bytes)
+    {
+        uint32_t word = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            const int shift = (algorithm == DigestAlgorithm::Sha1) ? 24 - 8 * i : 8 * i;
+            word |= static_cast<uint32_t>(static_cast<unsigned char>(bytes[i])) << shift;
+        }
+        return word;
+    }
+
+    void StoreDigest(DigestAlgorithm algorithm, const uint32_t *state, uint8_t *digest)
+    {
+        const bool big_endian = algorithm == DigestAlgorithm::Sha1;
+        const size_t words = DigestSize(algorithm) / 4;
+        for (size_t i = 0; i < words; ++i)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                digest[4 * i + k] = static_cast<uint8_t>(state[i] >> (big_endian ? 24 - 8 * k : 8 * k));
+            }
+        }
+    }
+
+    // Multi-buffer hashing: each lane of a vector holds the same word of a
+    // different message, so one pass through the rounds hashes one block
+    // of every lane's message. GCC and Clang lower the vector type to the
+    // SIMD registers of the function it is inlined into.
+#if defined(__GNUC__) || defined(__clang__)
+    constexpr size_t kDigestLanes = 8;
+    typedef uint32_t DigestLanes __attribute__((vector_size(4 * kDigestLanes)));
+#else
+    constexpr size_t kDigestLanes = 1;
+    using DigestLanes = uint32_t;
+#endif
+
+    // One step of MD4 or MD5: the new word, rotated into place.
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void DigestStep(V &a, V &b, V &c, V &d, const V &sum, int shift, bool add_b)
+    {
+        const V rotated = (sum << shift) | (sum >> (32 - shift));
+        a = d;
+        d = c;
+        c = b;
+        b = add_b ? b + rotated : rotated;
+    }
+
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void Md4Block(V *state, const V *words)
+    {
+        static constexpr int kSecondOrder[16] = {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15};
+        static constexpr int kThirdOrder[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
+        static constexpr int kShifts[3][4] = {{3, 7, 11, 19}, {3, 5, 9, 13}, {3, 9, 11, 15}};
+        V a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 16; ++i)
+        {
+            DigestStep(a, b, c, d, a + ((b & c) | (~b & d)) + words[i], kShifts[0][i % 4], false);
+        }
+        for (int i = 0; i < 16; ++i)
+        {
+            DigestStep(a, b, c, d, a + ((b & c) | (b & d) | (c & d)) + words[kSecondOrder[i]] + 0x5a827999u,
+                       kShifts[1][i % 4], false);
+        }
+        for (int i = 0; i < 16; ++i)
+        {
+            DigestStep(a, b, c, d, a + (b ^ c ^ d) + words[kThirdOrder[i]] + 0x6ed9eba1u, kShifts[2][i % 4], false);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void Md5Block(V *state, const V *words)
+    {
+        static constexpr uint32_t kConstants[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+        };
+        static constexpr int kShifts[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+        V a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 16; ++i)
+        {
+            DigestStep(a, b, c, d, a + ((b & c) | (~b & d)) + kConstants[i] + words[i], kShifts[0][i % 4], true);
+        }
+        for (int i = 16; i < 32; ++i)
+        {
+            DigestStep(a, b, c, d, a + ((d & b) | (~d & c)) + kConstants[i] + words[(5 * i + 1) % 16],
+                       kShifts[1][i % 4], true);
+        }
+        for (int i = 32; i < 48; ++i)
+        {
+            DigestStep(a, b, c, d, a + (b ^ c ^ d) + kConstants[i] + words[(3 * i + 5) % 16], kShifts[2][i % 4],
+                       true);
+        }
+        for (int i = 48; i < 64; ++i)
+        {
+            DigestStep(a, b, c, d, a + (c ^ (b | ~d)) + kConstants[i] + words[(7 * i) % 16], kShifts[3][i % 4],
+                       true);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void Sha1Step(V *schedule, V &a, V &b, V &c, V &d, V &e, int i, const V &f, uint32_t constant)
+    {
+        if (i >= 16)
+        {
+            const V mixed = schedule[(i + 13) % 16] ^ schedule[(i + 8) % 16] ^ schedule[(i + 2) % 16] ^
+                            schedule[i % 16];
+            schedule[i % 16] = (mixed << 1) | (mixed >> 31);
+        }
+        const V t = ((a << 5) | (a >> 27)) + f + e + constant + schedule[i % 16];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = t;
+    }
+
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void Sha1Block(V *state, const V *words)
+    {
+        V schedule[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            schedule[i] = words[i];
+        }
+        V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int i = 0; i < 20; ++i)
+        {
+            Sha1Step(schedule, a, b, c, d, e, i, (b & c) | (~b & d), 0x5a827999u);
+        }
+        for (int i = 20; i < 40; ++i)
+        {
+            Sha1Step(schedule, a, b, c, d, e, i, b ^ c ^ d, 0x6ed9eba1u);
+        }
+        for (int i = 40; i < 60; ++i)
+        {
+            Sha1Step(schedule, a, b, c, d, e, i, (b & c) | (b & d) | (c & d), 0x8f1bbcdcu);
+        }
+        for (int i = 60; i < 80; ++i)
+        {
+            Sha1Step(schedule, a, b, c, d, e, i, b ^ c ^ d, 0xca62c1d6u);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void CompressDigestBlock(DigestAlgorithm algorithm, V *state, const V *words)
+    {
+        if (algorithm == DigestAlgorithm::Ntlm)
+            Md4Block(state, words);
+        else if (algorithm == DigestAlgorithm::Md5)
+            Md5Block(state, words);
+        else
+            Sha1Block(state, words);
+    }
+
+    // Hashes kDigestLanes single-block messages at once: words[i][lane] is
+    // word i of a lane's padded message, state[i][lane] receives word i of
+    // its final state.
+    using DigestLanesFunction = void (*)(DigestAlgorithm, const uint32_t (*)[kDigestLanes],
+                                         uint32_t (*)[kDigestLanes]);
+
+    template <typename V>
+    SEARCH_ALWAYS_INLINE void DigestLanesWith(DigestAlgorithm algorithm, const uint32_t (*words)[kDigestLanes],
+                                              uint32_t (*state)[kDigestLanes])
+    {
+        V block[16];
+        V lanes[5];
+        for (int i = 0; i < 16; ++i)
+        {
+            std::memcpy(&block[i], words[i], sizeof(V));
+        }
+        for (int i = 0; i < 5; ++i)
+        {
+            lanes[i] = V{} + kDigestInitialState[i];
+        }
+        CompressDigestBlock(algorithm, lanes, block);
+        for (int i = 0; i < 5; ++i)
+        {
+            std::memcpy(state[i], &lanes[i], sizeof(V));
+        }
+    }
+
+    void DigestLanesGeneric(DigestAlgorithm algorithm, const uint32_t (*words)[kDigestLanes],
+                            uint32_t (*state)[kDigestLanes])
+    {
+        DigestLanesWith<DigestLanes>(algorithm, words, state);
+    }
+
+#if defined(SEARCH_X86) && (defined(__GNUC__) || defined(__clang__))
+    SEARCH_TARGET("avx2")
+    void DigestLanesAvx2(DigestAlgorithm algorithm, const uint32_t (*words)[kDigestLanes],
+                         uint32_t (*state)[kDigestLanes])
+    {
+        DigestLanesWith<DigestLanes>(algorithm, words, state);
+    }
+#endif
+
+    // AVX2 runs all eight lanes in one register; elsewhere the baseline
+    // SIMD registers take them four at a time.
+    DigestLanesFunction SelectDigestLanesFunction()
+    {
+#if defined(SEARCH_X86) && (defined(__GNUC__) || defined(__clang__))
+        if (DetectCpuFeatures().avx2)
+            return DigestLanesAvx2;
+#endif
+        return DigestLanesGeneric;
+    }
+
+    // Digest of a padded message of any number of blocks, one at a time.
+    void DigestMessage(DigestAlgorithm algorithm, std::string_view message, uint8_t *digest)
+    {
+        uint32_t state[5];
+        std::copy(kDigestInitialState.begin(), kDigestInitialState.end(), state);
+        for (size_t offset = 0; offset < message.size(); offset += 64)
+        {
+            uint32_t words[16];
+            for (int i = 0; i < 16; ++i)
+            {
+                words[i] = LoadDigestWord(algorithm, message.data() + offset + 4 * i);
+            }
+            CompressDigestBlock(algorithm, state, words);
+        }
+        StoreDigest(algorithm, state, digest);
+    }
+
+    // Hashes lines kDigestLanes at a time. Lines whose padded message takes
+    // more than one block, which few passwords do, are hashed on their own.
+    class LineDigester
+    {
+    public:
+        explicit LineDigester(DigestAlgorithm algorithm)
+            : algorithm_(algorithm), lanes_function_(SelectDigestLanesFunction())
+        {
+        }
+
+        // Calls emit(digest, number) for the line, either now or from a
+        // later Add or Flush.
+        template <typename Emit>
+        void Add(std::string_view line, uint64_t number, Emit &emit)
+        {
+            message_.clear();
+            AppendDigestMessage(algorithm_, line, message_);
+            if (message_.size() > 55)
+            {
+                PadDigestMessage(algorithm_, message_);
+                uint8_t digest[20];
+                DigestMessage(algorithm_, message_, digest);
+                emit(digest, number);
+                return;
+            }
+
+            // The padded block is built in place, after the previous line.
+            const size_t size = message_.size();
+            std::memcpy(block_, message_.data(), size);
+            std::memset(block_ + size, 0, last_size_ > size ? last_size_ - size : 1);
+            block_[size] = '\x80';
+            last_size_ = size + 1;
+            const uint32_t bits = static_cast<uint32_t>(size * 8);
+            if (algorithm_ == DigestAlgorithm::Sha1)
+            {
+                for (int i = 0; i < 14; ++i)
+                {
+                    words_[i][count_] = LoadDigestWord(algorithm_, block_ + 4 * i);
+                }
+                words_[14][count_] = 0;
+                words_[15][count_] = bits;
+            }
+            else
+            {
+                for (int i = 0; i < 14; ++i)
+                {
+                    words_[i][count_] = ReadLittleEndian32(block_ + 4 * i);
+                }
+                words_[14][count_] = bits;
+                words_[15][count_] = 0;
+            }
+            numbers_[count_++] = number;
+            if (count_ == kDigestLanes)
+                Flush(emit);
+        }
+
+        template <typename Emit>
+        void Flush(Emit &emit)
+        {
+            if (count_ == 0)
+                return;
+            lanes_function_(algorithm_, words_, state_);
+            for (size_t lane = 0; lane < count_; ++lane)
+            {
+                uint32_t state[5];
+                uint8_t digest[20];
+                for (int i = 0; i < 5; ++i)
+                {
+                    state[i] = state_[i][lane];
+                }
+                StoreDigest(algorithm_, state, digest);
+                emit(digest, numbers_[lane]);
+            }
+            count_ = 0;
+        }
+
+    private:
+        DigestAlgorithm algorithm_;
+        DigestLanesFunction lanes_function_;
+        std::string message_;
+        char block_[64] = {};
+        size_t last_size_ = 64; // bytes of block_ that may not be zero
+        uint32_t words_[16][kDigestLanes] = {};
+        uint32_t state_[5][kDigestLanes] = {};
+        uint64_t numbers_[kDigestLanes] = {};
+        size_t count_ = 0;
+    };
+
+    // The leading `bits` bits of a digest, 1 to 32.
+    uint32_t DigestPrefix(const uint8_t *digest, uint32_t bits)
+    {
+        const uint32_t word = (static_cast<uint32_t>(digest[0]) << 24) | (static_cast<uint32_t>(digest[1]) << 16) |
+                              (static_cast<uint32_t>(digest[2]) << 8) | digest[3];
+        return word >> (32 - bits);
+    }
+
+    template <size_t kSize>
+    struct DigestRecord
+    {
+        std::array<uint8_t, kSize> digest;
+        std::array<uint8_t, 8> line_number; // host byte order
+
+        auto operator<=>(const DigestRecord &) const = default;
+    };
+
+    // Hashes every line of the index on the pool and writes the digest
+    // table. The records first go to partition files by their leading bits,
+    // as many as it takes for each to be sorted within kIndexRunBudget, and
+    // the sorted partitions are then appended in order.
+    template <size_t kSize>
+    void WriteDigestTable(const SortedIndex &index, DigestAlgorithm algorithm, const std::string &table_filename,
+                          ThreadPool &pool)
+    {
+        using Record = DigestRecord<kSize>;
+        constexpr size_t kFencesPerTask = 4096;
+
+        const uint64_t record_count = index.LineCount();
+        // Buckets of about 256 records, at most 2^24 of them.
+        const uint32_t prefix_bits = static_cast<uint32_t>(std::clamp(static_cast<int>(std::bit_width(record_count)) - 8, 8, 24));
+        uint32_t partition_bits = 0;
+        while (partition_bits < 8 && (record_count * sizeof(Record) >> partition_bits) > kIndexRunBudget)
+        {
+            ++partition_bits;
+        }
+        const size_t partition_count = size_t{1} << partition_bits;
+
+        std::vector<std::string> partition_filenames;
+        std::vector<std::ofstream> partitions;
+        for (size_t i = 0; i < partition_count; ++i)
+        {
+            partition_filenames.push_back(table_filename + ".part" + std::to_string(i));
+            partitions.emplace_back(partition_filenames.back(), std::ios::binary | std::ios::trunc);
+            if (!partitions.back())
+            {
+                throw std::runtime_error("Error creating partition file: " + partition_filenames.back());
+            }
+        }
+
+        std::mutex partition_mutex;
+        const size_t task_count = (index.FenceCount() + kFencesPerTask - 1) / kFencesPerTask;
+        pool.Run(task_count, [&](size_t, size_t task)
+        {
+            std::vector<std::vector<Record>> buffers(partition_count);
+            auto flush = [&](size_t partition)
+            {
+                std::lock_guard<std::mutex> lock(partition_mutex);
+                partitions[partition].write(reinterpret_cast<const char *>(buffers[partition].data()),
+                                            static_cast<std::streamsize>(buffers[partition].size() * sizeof(Record)));
+                buffers[partition].clear();
+            };
+            auto emit = [&](const uint8_t *digest, uint64_t number)
+            {
+                Record record;
+                std::memcpy(record.digest.data(), digest, kSize);
+                std::memcpy(record.line_number.data(), &number, sizeof(number));
+                const size_t partition = (partition_bits == 0) ? 0 : DigestPrefix(digest, partition_bits);
+                buffers[partition].push_back(record);
+                if (buffers[partition].size() * sizeof(Record) >= kChunkSize)
+                    flush(partition);
+            };
+
+            LineDigester digester(algorithm);
+            index.ForEachLine(task * kFencesPerTask, (task + 1) * kFencesPerTask,
+                              [&](std::string_view line, uint64_t number)
+                              { digester.Add(line, number, emit); });
+            digester.Flush(emit);
+            for (size_t partition = 0; partition < partition_count; ++partition)
+            {
+                if (!buffers[partition].empty())
+                    flush(partition);
+            }
+        });
+        for (size_t i = 0; i < partition_count; ++i)
+        {
+            partitions[i].close();
+            if (!partitions[i])
+            {
+                throw std::runtime_error("Error writing partition file: " + partition_filenames[i]);
+            }
+        }
+
+        std::ofstream out(table_filename, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Error creating digest table: " + table_filename);
+        }
+        DigestTableHeader header{};
+        header.magic = kDigestTableMagic;
+        header.version = 1;
+        header.algorithm = static_cast<uint32_t>(algorithm);
+        header.digest_size = kSize;
+        header.prefix_bits = prefix_bits;
+        header.record_count = record_count;
+        header.record_offset = sizeof(header);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        // Record numbers where each bucket starts, counted as records go by.
+        std::vector<uint64_t> buckets((size_t{1} << prefix_bits) + 1);
+        for (const std::string &partition_filename : partition_filenames)
+        {
+            std::vector<Record> records(std::filesystem::file_size(partition_filename) / sizeof(Record));
+            {
+                std::ifstream in(partition_filename, std::ios::binary);
+                in.read(reinterpret_cast<char *>(records.data()),
+                        static_cast<std::streamsize>(records.size() * sizeof(Record)));
+                if (!in)
+                {
+                    throw std::runtime_error("Error reading partition file: " + partition_filename);
+                }
+            }
+            std::filesystem::remove(partition_filename);
+            std::sort(records.begin(), records.end());
+            for (const Record &record : records)
+            {
+                ++buckets[DigestPrefix(record.digest.data(), prefix_bits) + 1];
+            }
+            out.write(reinterpret_cast<const char *>(records.data()),
+                      static_cast<std::streamsize>(records.size() * sizeof(Record)));
+        }
+        std::partial_sum(buckets.begin(), buckets.end(), buckets.begin());
+
+        // The bucket table is read in place, so it starts 8-byte aligned.
+        header.bucket_offset = header.record_offset + record_count * sizeof(Record);
+        out.write("\0\0\0\0\0\0\0", static_cast<std::streamsize>((8 - header.bucket_offset % 8) % 8));
+        header.bucket_offset += (8 - header.bucket_offset % 8) % 8;
+        out.write(reinterpret_cast<const char *>(buckets.data()),
+                  static_cast<std::streamsize>(buckets.size() * sizeof(uint64_t)));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        if (!out)
+        {
+            throw std::runtime_error("Error writing digest table: " + table_filename);
+        }
+    }
+
+    // Writes a digest table next to the index for each algorithm.
+    void BuildDigestTables(const std::string &index_filename, const std::vector<DigestAlgorithm> &algorithms,
+                           size_t threads, bool pin_threads)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        // Read front to back, unlike the random access of lookups.
+        const SortedIndex index(index_filename, false);
+        ThreadPool pool(threads, pin_threads);
+        for (const DigestAlgorithm algorithm : algorithms)
+        {
+            const std::string table_filename = DigestTableFilename(index_filename, algorithm);
+            if (DigestSize(algorithm) == 20)
+                WriteDigestTable<20>(index, algorithm, table_filename, pool);
+            else
+                WriteDigestTable<16>(index, algorithm, table_filename, pool);
+            std::cout << "Digest table written to " << table_filename << ": " << index.LineCount() << ' '
+                      << DigestName(algorithm) << " digests\n";
+        }
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double> elapsed = end_time - start_time;
+        std::cout << "Time taken: " << elapsed.count() << " seconds\n";
+    }
+
+    // Read-only view of a digest table written by WriteDigestTable. A lookup
+    // reads the one bucket that can hold the digest and binary-searches it.
+    class DigestTable
+    {
+    public:
+        explicit DigestTable(const std::string &filename)
+            : file_(filename, true)
+        {
+            std::string_view bytes = file_.View();
+            if (bytes.size() < sizeof(DigestTableHeader))
+            {
+                throw std::runtime_error("Digest table is truncated: " + filename);
+            }
+            std::memcpy(&header_, bytes.data(), sizeof(header_));
+            record_size_ = header_.digest_size + sizeof(uint64_t);
+            if (header_.magic != kDigestTableMagic || header_.version != 1 || header_.prefix_bits < 1 ||
+                header_.prefix_bits > 32 || header_.digest_size < 4 ||
+                header_.record_offset + header_.record_count * record_size_ > bytes.size() ||
+                header_.bucket_offset + ((uint64_t{1} << header_.prefix_bits) + 1) * sizeof(uint64_t) > bytes.size())
+            {
+                throw std::runtime_error("Not a valid digest table: " + filename);
+            }
+            records_ = bytes.substr(header_.record_offset, header_.record_count * record_size_);
+            buckets_ = {reinterpret_cast<const uint64_t *>(bytes.data() + header_.bucket_offset),
+                        (size_t{1} << header_.prefix_bits) + 1};
+        }
+
+        // Sets `line_number` to the index line whose digest this is.
+        bool Find(std::span<const uint8_t> digest, uint64_t &line_number) const
+        {
+            if (digest.size() != header_.digest_size)
+                return false;
+            const uint32_t bucket = DigestPrefix(digest.data(), header_.prefix_bits);
+            uint64_t low = buckets_[bucket];
+            uint64_t high = std::min<uint64_t>(buckets_[bucket + 1], header_.record_count);
+            while (low < high)
+            {
+                const uint64_t middle = low + (high - low) / 2;
+                const char *record = records_.data() + middle * record_size_;
+                const int order = std::memcmp(record, digest.data(), digest.size());
+                if (order == 0)
+                {
+                    std::memcpy(&line_number, record + digest.size(), sizeof(line_number));
+                    return true;
+                }
+                if (order < 0)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            return false;
+        }
+
+    private:
+        MappedFile file_;
+        DigestTableHeader header_;
+        uint64_t record_size_;
+        std::string_view records_;
+        std::span<const uint64_t> buckets_;
+    };
+
+    // Looks a hex digest up in the index's digest tables of that length and
+    // prints the password it belongs to.
+    bool LookupDigest(const std::string &index_filename, std::string_view hex)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        std::vector<uint8_t> digest;
+        auto nibble = [](char c) -> int
+        {
+            c = FoldCase(c);
+            return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        };
+        for (size_t i = 0; i + 1 < hex.size() && nibble(hex[i]) >= 0 && nibble(hex[i + 1]) >= 0; i += 2)
+        {
+            digest.push_back(static_cast<uint8_t>(nibble(hex[i]) << 4 | nibble(hex[i + 1])));
+        }
+        if (digest.size() * 2 != hex.size() || (digest.size() != 16 && digest.size() != 20))
+        {
+            throw std::runtime_error("Not an NTLM, MD5 or SHA-1 digest in hex: " + std::string(hex));
+        }
+
+        bool searched = false;
+        bool found = false;
+        for (const DigestAlgorithm algorithm : kDigestAlgorithms)
+        {
+            const std::string table_filename = DigestTableFilename(index_filename, algorithm);
+            if (DigestSize(algorithm) != digest.size() || !std::filesystem::exists(table_filename))
+                continue;
+            searched = true;
+            uint64_t line_number = 0;
+            if (DigestTable(table_filename).Find(digest, line_number))
+            {
+                std::cout << "Found (" << DigestName(algorithm)
+                          << "): " << SortedIndex(index_filename).LineByNumber(line_number) << '\n';
+                found = true;
+            }
+        }
+        if (!searched)
+        {
+            throw std::runtime_error("No digest table of this length for " + index_filename +
+                                     "; build one with build-index --hashes=" +
+                                     (digest.size() == 20 ? "sha1" : "ntlm,md5"));
+        }
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double, std::milli> elapsed = end_time - start_time;
+        if (!found)
+            std::cout << "Not found: " << hex << '\n';
+        std::cout << "Time taken: " << elapsed.count() << " ms\n";
+        return found;
+    }
+
+    // Read-only view of a trigram index written by TrigramIndexWriter.
+    class TrigramIndex
+    {
+    public:
+        explicit TrigramIndex(const std::string &filename)
+            : file_(filename, true)
+        {
+            bytes_ = file_.View();
+            if (bytes_.size() < sizeof(TrigramHeader))
+            {
+                throw std::runtime_error("Trigram index is truncated: " + filename);
+            }
+            std::memcpy(&header_, bytes_.data(), sizeof(header_));
+            if (header_.magic != kTrigramMagic || header_.version != 1 ||
+                header_.segment_table_offset + header_.segment_count * sizeof(uint64_t) > bytes_.size())
+            {
+                throw std::runtime_error("Not a valid trigram index: " + filename);
+            }
+        }
+
+        // Whether the trigrams were taken from this build of `index`.
+        bool Matches(const SortedIndex &index) const
+        {
+            return header_.line_count == index.LineCount() && header_.index_data_size == index.Data().size() &&
+                   header_.index_stamp == index.Stamp();
+        }
+
+        // Calls on_candidate(line) in increasing order for every line that
+        // contains all trigrams of `needle`, which must be at least three
+        // bytes long, until on_candidate returns false. Candidates still need
+        // to be verified.
+        template <typename CandidateHandler>
+        void ForEachCandidate(std::string_view needle, CandidateHandler &&on_candidate) const
+        {
+            std::vector<uint32_t> trigrams;
+            for (size_t i = 0; i + 3 <= needle.size(); ++i)
+            {
+                trigrams.push_back(TrigramAt(needle.data() + i));
+            }
+            std::sort(trigrams.begin(), trigrams.end());
+            trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+            std::vector<uint64_t> candidates, postings, intersection;
+            for (uint64_t s = 0; s < header_.segment_count; ++s)
+            {
+                uint64_t segment_offset;
+                std::memcpy(&segment_offset, bytes_.data() + header_.segment_table_offset + s * sizeof(uint64_t),
+                            sizeof(segment_offset));
+                TrigramSegment segment;
+                std::memcpy(&segment, bytes_.data() + segment_offset, sizeof(segment));
+                const auto *entries = reinterpret_cast<const TrigramEntry *>(bytes_.data() + segment_offset +
+                                                                             sizeof(TrigramSegment));
+                const char *postings_start = reinterpret_cast<const char *>(entries + segment.entry_count);
+
+                // Intersect the rarest trigrams first to keep the lists short.
+                std::vector<const TrigramEntry *> found;
+                for (uint32_t trigram : trigrams)
+                {
+                    const TrigramEntry *entry = std::lower_bound(entries, entries + segment.entry_count, trigram,
+                                                                 [](const TrigramEntry &e, uint32_t t)
+                                                                 { return e.trigram < t; });
+                    if (entry == entries + segment.entry_count || entry->trigram != trigram)
+                    {
+                        found.clear();
+                        break;
+                    }
+                    found.push_back(entry);
+                }
+                if (found.empty())
+                    continue;
+                std::sort(found.begin(), found.end(), [](const TrigramEntry *a, const TrigramEntry *b)
+                          { return a->count < b->count; });
+
+                Decode(*found[0], postings_start, candidates);
+                for (size_t i = 1; i < found.size() && !candidates.empty(); ++i)
+                {
+                    Decode(*found[i], postings_start, postings);
+                    intersection.clear();
+                    std::set_intersection(candidates.begin(), candidates.end(), postings.begin(), postings.end(),
+                                          std::back_inserter(intersection));
+                    candidates.swap(intersection);
+                }
+                for (uint64_t line : candidates)
+                {
+                    if (!on_candidate(segment.first_line + line))
+                        return;
+                }
+            }
+        }
+
+    private:
+        static void Decode(const TrigramEntry &entry, const char *postings_start, std::vector<uint64_t> &lines)
+        {
+            lines.resize(entry.count);
+            const char *in = postings_start + entry.offset;
+            uint64_t line = 0;
+            for (auto &value : lines)
+            {
+                line += ReadVarint(in);
+                value = line;
+            }
+        }
+
+        MappedFile file_;
+        std::string_view bytes_;
+        TrigramHeader header_{};
+    };
+
+    // The trigram index of an index, or null if it has none. One from
+    // another build of the index is refused rather than trusted.
+    std::unique_ptr<TrigramIndex> OpenTrigramIndex(const std::string &index_filename, const SortedIndex &index)
+    {
+        const std::string trigram_filename = TrigramFilename(index_filename);
+        if (!std::filesystem::exists(trigram_filename))
+            return nullptr;
+        auto trigrams = std::make_unique<TrigramIndex>(trigram_filename);
+        if (!trigrams->Matches(index))
+        {
+            throw std::runtime_error("Trigram index " + trigram_filename + " does not match " + index_filename +
+                                     "; rebuild it with build-index --trigrams");
+        }
+        return trigrams;
+    }
+
+    uint64_t FindInIndex(const std::string &index_filename, const std::string &needle, const EntryCallback &on_found)
+    {
+        SortedIndex index(index_filename);
+        SearchResult result(index_filename);
+
+        const auto trigrams = OpenTrigramIndex(index_filename, index);
+        if (needle.size() >= 3 && trigrams)
+        {
+            trigrams->ForEachCandidate(needle, [&](uint64_t number)
+            {
+                const std::string_view line = index.LineByNumber(number);
+                for (size_t pos : FindAll(line, needle))
+                {
+                    result.Add(number + 1, pos + 1, line, 0);
+                }
+                return true;
+            });
+        }
+        else
+        {
+            const std::string_view data = index.Data();
+            uint64_t number = 0;
+            size_t counted = 0;
+            for (size_t pos : FindAll(data, needle))
+            {
+                number += CountNewlines(data.substr(counted, pos - counted));
+                counted = pos;
+                const size_t line_start = (pos == 0) ? 0 : data.rfind('\n', pos - 1) + 1;
+                const size_t line_end = data.find('\n', pos);
+                result.Add(number + 1, pos - line_start + 1, data.substr(line_start, line_end - line_start), 0);
+            }
+        }
+
+        if (on_found)
+            on_found(EntryReport(FinishedEntry{result.filename, {&result, 1}, result.Count()}));
+        return result.Count();
+    }
+
+    // Whether `filename` is a password store rather than a sorted index.
+    bool IsPasswordStore(const std::string &filename)
+    {
+        std::array<char, 8> magic{};
+        std::ifstream file(filename, std::ios::binary);
+        file.read(magic.data(), magic.size());
+        return file && magic == kStoreMagic;
+    }
+
+    bool LookupInStore(const std::string &store_filename, const std::string &password)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+        const bool found = PasswordStore(store_filename).Contains(password);
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double, std::milli> elapsed = end_time - start_time;
+
+        std::cout << (found ? "Found: " : "Not found: ") << password << '\n';
+        std::cout << "Time taken: " << elapsed.count() << " ms\n";
+        return found;
+    }
+
+    bool LookupInIndex(const std::string &index_filename, const std::string &password)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        // A negative answer from the filter spares the index lookup.
+        const SortedIndex index(index_filename);
+        const auto filter = OpenIndexFilter(index_filename, index);
+        const bool found = (!filter || filter->MayContain(password)) && index.Contains(password);
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double, std::milli> elapsed = end_time - start_time;
+
+        std::cout << (found ? "Found: " : "Not found: ") << password << '\n';
+        std::cout << "Time taken: " << elapsed.count() << " ms\n";
+        return found;
+    }
+
+    // Checks every line of `queries_filename` against an index or a store.
+    // The queries are sorted and split into key ranges, several per worker,
+    // and each range is matched in a single forward pass, so the index is
+    // read in order instead of at a random page per query. Prints the queries
+    // that were found, in sorted order, and returns how many there were.
+    uint64_t LookupBatch(const std::string &filename, const std::string &queries_filename, size_t threads,
+                         bool pin_threads)
+    {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+
+        std::vector<std::string> queries = ReadPatternsFile(queries_filename);
+        std::sort(queries.begin(), queries.end());
+        queries.erase(std::unique(queries.begin(), queries.end()), queries.end());
+
+        std::unique_ptr<PasswordStore> store;
+        std::unique_ptr<SortedIndex> index;
+        if (IsPasswordStore(filename))
+            store = std::make_unique<PasswordStore>(filename);
+        else
+            index = std::make_unique<SortedIndex>(filename);
+
+        std::vector<uint8_t> found(queries.size());
+        ThreadPool pool(threads, pin_threads);
+        const size_t range_count = std::min(queries.size(), pool.Size() * 8);
+        pool.Run(range_count, [&](size_t, size_t range)
+        {
+            const size_t begin = range * queries.size() / range_count;
+            const size_t end = (range + 1) * queries.size() / range_count;
+            const std::span<const std::string> keys(queries.data() + begin, end - begin);
+            if (store)
+                store->ContainsSorted(keys, std::span(found).subspan(begin, end - begin));
+            else
+                index->ContainsSorted(keys, std::span(found).subspan(begin, end - begin));
+        });
+
+        uint64_t found_count = 0;
+        std::string out;
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            if (!found[i])
+                continue;
+            ++found_count;
+            out += queries[i];
+            out += '\n';
+            if (out.size() >= kChunkSize)
+                std::cout << std::exchange(out, {});
+        }
+        std::cout << out << std::flush;
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        const std::chrono::duration<double, std::milli> elapsed = end_time - start_time;
+        std::cerr << "Found " << found_count << " of " << queries.size() << " distinct queries\n";
+        std::cerr << "Time taken: " << elapsed.count() << " ms\n";
+        return found_count;
+    }
+
+    // Keeps the most recent query latencies of one kind for percentiles.
+    class LatencyRecorder
+    {
+    public:
+        void Record(std::chrono::nanoseconds latency)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (samples_.size() < kMaxSamples)
+                samples_.push_back(latency.count());
+            else
+                samples_[count_ % kMaxSamples] = latency.count();
+            ++count_;
+        }
+
+        // "queries=N p50_us=X p99_us=Y" over the retained samples.
+        std::string Summary() const
+        {
+            std::vector<int64_t> samples;
+            uint64_t count;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                samples = samples_;
+                count = count_;
+            }
+
+            auto percentile = [&](double fraction) -> double
+            {
+                if (samples.empty())
+                    return 0;
+                auto nth = samples.begin() + static_cast<ptrdiff_t>(fraction * (samples.size() - 1));
+                std::nth_element(samples.begin(), nth, samples.end());
+                return static_cast<double>(*nth) / 1000.0;
+            };
+            const double p50 = percentile(0.50);
+            const double p99 = percentile(0.99);
+
+            char summary[128];
+            std::snprintf(summary, sizeof(summary), "queries=%llu p50_us=%.1f p99_us=%.1f",
+                          static_cast<unsigned long long>(count), p50, p99);
+            return summary;
+        }
+
+    private:
+        static constexpr size_t kMaxSamples = 16384;
+
+        mutable std::mutex mutex_;
+        std::vector<int64_t> samples_;
+        uint64_t count_ = 0;
+    };
+
+    // Answers queries against one sorted index for as long as the process
+    // runs. Exact and prefix queries are a binary search on the mapped
+    // index; substring queries scan it on the shared worker pool.
+    class QueryServer
+    {
+    public:
+        static constexpr size_t kMaxResults = 1000;
+
+        QueryServer(const std::string &index_filename, ThreadPool &pool)
+            : index_(index_filename), pool_(pool)
+        {
+            filter_ = OpenIndexFilter(index_filename, index_);
+            trigrams_ = OpenTrigramIndex(index_filename, index_);
+        }
+
+        uint64_t LineCount() const
+        {
+            return index_.LineCount();
+        }
+
+        // Handles one request line and returns the complete response: an
+        // "OK <count>" line ("OK <count> truncated" when results were cut
+        // at kMaxResults) followed by that many lines, or "ERR <message>".
+        std::string Handle(std::string_view request)
+        {
+            const size_t space = request.find(' ');
+            const std::string_view command = request.substr(0, space);
+            const std::string_view argument = (space == std::string_view::npos) ? std::string_view() : request.substr(space + 1);
+
+            const auto start_time = std::chrono::steady_clock::now();
+            std::vector<std::string_view> lines;
+            LatencyRecorder *latency = nullptr;
+            bool truncated = false;
+            if (command == "exact")
+            {
+                if ((!filter_ || filter_->MayContain(argument)) && index_.Contains(argument))
+                    lines.push_back(argument);
+                latency = &exact_latency_;
+            }
+            else if (command == "prefix")
+            {
+                index_.FindPrefix(argument, kMaxResults + 1, lines);
+                latency = &prefix_latency_;
+            }
+            else if (command == "substring" && !argument.empty())
+            {
+                FindSubstring(argument, lines);
+                latency = &substring_latency_;
+            }
+            else if (command == "stats")
+            {
+                return "OK 3\nexact " + exact_latency_.Summary() + "\nprefix " + prefix_latency_.Summary() +
+                       "\nsubstring " + substring_latency_.Summary() + '\n';
+            }
+            else
+            {
+                return "ERR expected exact, prefix or substring <text>, or stats\n";
+            }
+
+            if (lines.size() > kMaxResults)
+            {
+                lines.resize(kMaxResults);
+                truncated = true;
+            }
+            std::string response = "OK " + std::to_string(lines.size()) + (truncated ? " truncated\n" : "\n");
+            for (std::string_view line : lines)
+            {
+                response += line;
+                response += '\n';
+            }
+            latency->Record(std::chrono::steady_clock::now() - start_time);
+            return response;
+        }
+
+    private:
+        // Splits the index at line boundaries into a few ranges per worker;
+        // each collects its first kMaxResults + 1 matching lines, and
+        // concatenating the ranges in order keeps the result sorted.
+        void FindSubstring(std::string_view needle, std::vector<std::string_view> &lines)
+        {
+            if (trigrams_ && needle.size() >= 3)
+            {
+                // Candidates arrive in line order; stop one line past the limit.
+                trigrams_->ForEachCandidate(needle, [&](uint64_t number)
+                {
+                    const std::string_view line = index_.LineByNumber(number);
+                    if (line.find(needle) != std::string_view::npos)
+                        lines.push_back(line);
+                    return lines.size() <= kMaxResults;
+                });
+                return;
+            }
+
+            const std::string_view data = index_.Data();
+            const size_t range_count = std::max<size_t>(1, std::min<size_t>(pool_.Size() * 4, data.size() / kChunkSize));
+            std::vector<size_t> bounds{0};
+            for (size_t range = 1; range < range_count; ++range)
+            {
+                const size_t newline = data.find('\n', std::max(data.size() / range_count * range, bounds.back()));
+                bounds.push_back((newline == std::string_view::npos) ? data.size() : newline + 1);
+            }
+            bounds.push_back(data.size());
+
+            std::vector<std::vector<std::string_view>> found(range_count);
+            pool_.Run(range_count, [&](size_t, size_t range)
+            {
+                const std::string_view text = data.substr(bounds[range], bounds[range + 1] - bounds[range]);
+                size_t line_end = 0;
+                for (size_t pos : FindAll(text, needle))
+                {
+                    if (pos < line_end)
+                        continue; // another hit in a line already reported
+                    const size_t line_start = (pos == 0) ? 0 : text.rfind('\n', pos - 1) + 1;
+                    line_end = text.find('\n', pos);
+                    found[range].push_back(text.substr(line_start, line_end - line_start));
+                    if (found[range].size() > kMaxResults)
+                        break;
+                }
+            });
+
+            for (const auto &range_lines : found)
+            {
+                lines.insert(lines.end(), range_lines.begin(), range_lines.end());
+                if (lines.size() > kMaxResults)
+                    break;
+            }
+        }
+
+        SortedIndex index_;
+        std::unique_ptr<BlockedBloomFilter> filter_;
+        std::unique_ptr<TrigramIndex> trigrams_;
+        ThreadPool &pool_;
+        LatencyRecorder exact_latency_;
+        LatencyRecorder prefix_latency_;
+        LatencyRecorder substring_latency_;
+    };
+
+#ifndef _WIN32
+    // Requests are a command and a password or some text, so a line this
+    // long is not one; its client is disconnected rather than buffered.
+    constexpr size_t kMaxRequestSize = 64 * 1024; // 64 KB
+
+    // Writes all of `data` to `client`; false if the client went away.
+    bool SendAll(int client, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            const ssize_t sent = ::send(client, data.data(), data.size(), 0);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return false;
+            data.remove_prefix(static_cast<size_t>(sent));
+        }
+        return true;
+    }
+
+    // Reads request lines from one client and writes back each response,
+    // until the client hangs up or sends a request over kMaxRequestSize.
+    void ServeConnection(QueryServer &server, int client)
+    {
+        std::string pending;
+        char buffer[64 * 1024];
+        while (true)
+        {
+            const ssize_t received = ::recv(client, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                return;
+            pending.append(buffer, static_cast<size_t>(received));
+
+            std::string responses;
+            size_t start = 0;
+            for (size_t newline; (newline = pending.find('\n', start)) != std::string::npos; start = newline + 1)
+            {
+                std::string_view request(pending.data() + start, newline - start);
+                if (!request.empty() && request.back() == '\r')
+                    request.remove_suffix(1);
+                responses += server.Handle(request);
+            }
+            pending.erase(0, start);
+
+            if (pending.size() > kMaxRequestSize)
+            {
+                responses += "ERR request longer than " + std::to_string(kMaxRequestSize) + " bytes\n";
+                SendAll(client, responses);
+                return;
+            }
+            if (!SendAll(client, responses))
+                return;
+        }
+    }
+
+    // The client threads of Serve. They use the server, so all of them are
+    // joined before it goes away; when the accept loop ends, their sockets
+    // are shut down first, which ends any read they are blocked in. A
+    // socket is closed only after its thread is joined, so its descriptor
+    // cannot be reused while a shutdown may still reach it.
+    class ClientThreads
+    {
+    public:
+        ClientThreads() = default;
+
+        ClientThreads(const ClientThreads &) = delete;
+        ClientThreads &operator=(const ClientThreads &) = delete;
+
+        ~ClientThreads()
+        {
+            for (Client &client : clients_)
+                ::shutdown(client.socket, SHUT_RDWR);
+            for (Client &client : clients_)
+            {
+                client.thread.join();
+                ::close(client.socket);
+            }
+        }
+
+        // Runs ServeConnection for `socket` on a thread of its own, after
+        // joining the threads of clients that have hung up.
+        void Start(QueryServer &server, int socket)
+        {
+            for (auto it = clients_.begin(); it != clients_.end();)
+            {
+                if (!it->done)
+                {
+                    ++it;
+                    continue;
+                }
+                it->thread.join();
+                ::close(it->socket);
+                it = clients_.erase(it);
+            }
+
+            Client &client = clients_.emplace_back(socket);
+            try
+            {
+                client.thread = std::thread([&server, &client]
+                                            {
+                                                ServeConnection(server, client.socket);
+                                                // The client sees the end now, the
+                                                // descriptor goes with the thread.
+                                                ::shutdown(client.socket, SHUT_RDWR);
+                                                client.done = true;
+                                            });
+            }
+            catch (...)
+            {
+                ::close(socket);
+                clients_.pop_back();
+                throw;
+            }
+        }
+
+    private:
+        struct Client
+        {
+            explicit Client(int socket) : socket(socket)
+            {
+            }
+
+            int socket;
+            std::atomic<bool> done = false;
+            std::thread thread;
+        };
+
+        std::list<Client> clients_; // stable addresses for the threads
+    };
+#endif
+
+    // Listens on a Unix domain socket and answers the line protocol of
+    // QueryServer, one thread per client connection.
+    void Serve(const std::string &index_filename, const std::string &socket_path, size_t threads, bool pin_threads)
+    {
+#ifdef _WIN32
+        static_cast<void>(index_filename);
+        static_cast<void>(socket_path);
+        static_cast<void>(threads);
+        static_cast<void>(pin_threads);
+        throw std::runtime_error("serve needs Unix domain sockets, which this build does not support");
+#else
+        ThreadPool pool(threads, pin_threads);
+        QueryServer server(index_filename, pool);
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+        {
+            throw std::runtime_error("Socket path is too long: " + socket_path);
+        }
+        std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+        const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+        {
+            throw std::runtime_error("Error creating socket");
+        }
+        ::unlink(socket_path.c_str());
+        if (::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listener, SOMAXCONN) != 0)
+        {
+            ::close(listener);
+            throw std::runtime_error("Error listening on socket: " + socket_path);
+        }
+
+        // A client that hangs up mid-response must not take the server down.
+        std::signal(SIGPIPE, SIG_IGN);
+        std::cout << "Serving " << server.LineCount() << " lines from " << index_filename << " on "
+                  << socket_path << std::endl;
+
+        ClientThreads clients;
+        while (true)
+        {
+            const int client = ::accept(listener, nullptr, nullptr);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                break;
+            }
+            clients.Start(server, client);
+        }
+
+        ::close(listener);
+        throw std::runtime_error("Error accepting connections on socket: " + socket_path);
+#endif
+    }
+
+    struct QueryMatcher::Impl
+    {
+        template <typename Matcher, typename... Args>
+        explicit Impl(std::in_place_type_t<Matcher> type, Args &&...args) : matcher(type, std::forward<Args>(args)...)
+        {
+        }
+
+        std::variant<KeywordMatcher, RegexMatcher, LineMatcher, PatternSet> matcher;
+    };
+
+    QueryMatcher::QueryMatcher(std::string_view query, const QueryOptions &options)
+    {
+        const bool fold = options.case_insensitive;
+        switch (options.kind)
+        {
+        case QueryKind::Regex:
+            impl_ = std::make_unique<Impl>(std::in_place_type<RegexMatcher>, std::string(query), fold);
+            break;
+        case QueryKind::LineExact:
+        case QueryKind::LinePrefix:
+        case QueryKind::LineSuffix:
+        {
+            const LineMatch mode = (options.kind == QueryKind::LineExact)    ? LineMatch::Exact
+                                   : (options.kind == QueryKind::LinePrefix) ? LineMatch::Prefix
+                                                                             : LineMatch::Suffix;
+            impl_ = std::make_unique<Impl>(std::in_place_type<LineMatcher>, std::string(query), mode,
+                                           options.min_length, options.max_length, fold);
+            break;
+        }
+        default:
+            if (options.min_length > 0 || options.max_length != SIZE_MAX)
+            {
+                throw std::runtime_error("min_length and max_length need a line query");
+            }
+            impl_ = std::make_unique<Impl>(std::in_place_type<KeywordMatcher>, std::string(query), fold);
+        }
+    }
+
+    QueryMatcher::QueryMatcher(std::vector<std::string> patterns, bool fold)
+        : impl_(std::make_unique<Impl>(std::in_place_type<PatternSet>, std::move(patterns), fold))
+    {
+    }
+
+    QueryMatcher::~QueryMatcher() = default;
+
+    size_t QueryMatcher::PatternCount() const
+    {
+        return std::visit([](const auto &matcher)
+                          { return matcher.PatternCount(); }, impl_->matcher);
+    }
+
+    std::string_view QueryMatcher::Pattern(size_t index) const
+    {
+        return std::visit([index](const auto &matcher) -> std::string_view
+                          { return matcher.Pattern(index); }, impl_->matcher);
+    }
+
+    InputScanner::InputScanner(size_t threads, bool pin_threads)
+        : pool_(std::make_unique<ThreadPool>(threads, pin_threads))
+    {
+    }
+
+    InputScanner::~InputScanner() = default;
+
+    size_t InputScanner::WorkerCount() const
+    {
+        return pool_->Size();
+    }
+
+    ScanSummary InputScanner::Scan(const std::vector<std::string> &filenames, const QueryMatcher &matcher,
+                                   const ScanOptions &options, uint64_t checkpoint_span, std::ostream &status,
+                                   std::span<WorkerStats> stats, const EntryCallback &on_entry,
+                                   const ErrorCallback &on_error)
+    {
+        std::vector<SearchInput> inputs = OpenSearchInputs(filenames);
+        if (checkpoint_span > 0)
+            LoadInputCheckpoints(inputs, checkpoint_span, options.prefetch_blocks, &status);
+
+        HitCounter hits(options.max_count, options.count_unique);
+        auto hand_over = [&](const FinishedEntry &entry)
+        {
+            StageTimer timer(&WorkerStats::output_seconds);
+            on_entry(EntryReport(entry));
+        };
+        return std::visit([&](const auto &scanned)
+        {
+            const uint64_t reported = ScanInputs(inputs, scanned, options, *pool_, hits, stats, hand_over, on_error);
+            return ScanSummary{reported, hits.Reached(), hits.LineCount()};
+        }, matcher.impl_->matcher);
+    }
+
+    struct Searcher::Impl
+    {
+        Impl(const std::vector<std::string> &filenames, const SearcherOptions &options)
+            : inputs(OpenSearchInputs(filenames)),
+              pool(options.threads, options.pin_threads),
+              prefetch_blocks(options.prefetch_size > 0
+                                  ? static_cast<size_t>(std::max<uint64_t>(options.prefetch_size / kPrefetchBlockSize, 1))
+                                  : 0)
+        {
+            if (options.checkpoint_span > 0)
+                LoadInputCheckpoints(inputs, options.checkpoint_span, prefetch_blocks);
+            if (options.index_file.empty())
+                return;
+            if (IsPasswordStore(options.index_file))
+            {
+                store = std::make_unique<PasswordStore>(options.index_file);
+                return;
+            }
+            index = std::make_unique<SortedIndex>(options.index_file);
+            filter = OpenIndexFilter(options.index_file, *index);
+        }
+
+        // The matches of each run of finished ranges go out under one lock,
+        // so on_match sees one call at a time. An exception it throws stops the search and
+        // is rethrown once the workers are done.
+        template <typename Matcher>
+        uint64_t Search(const Matcher &matcher, const QueryOptions &options, const MatchCallback &on_match)
+        {
+            const ScanOptions scan{options.whole_line, false, options.max_count, false, prefetch_blocks, true};
+            HitCounter hits(options.max_count);
+            std::mutex callback_mutex;
+            uint64_t delivered = 0;
+            bool stopped = false;
+            std::exception_ptr callback_error;
+            std::string error;
+
+            auto deliver = [&](const FinishedEntry &entry)
+            {
+                std::lock_guard<std::mutex> lock(callback_mutex);
+                entry.ForEachOccurrence([&](const Occurrence &occurrence, std::string_view context)
+                {
+                    if (stopped)
+                        return;
+                    try
+                    {
+                        stopped = !on_match(Match{entry.name, occurrence.line, occurrence.col, context});
+                        delivered++;
+                    }
+                    catch (...)
+                    {
+                        callback_error = std::current_exception();
+                        stopped = true;
+                    }
+                    if (stopped)
+                        hits.Stop();
+                });
+            };
+            auto record_error = [&](const std::string &file_name, const std::exception &e)
+            {
+                if (error.empty())
+                    error = "Error processing file \"" + file_name + "\": " + e.what();
+            };
+            ScanInputs(inputs, matcher, scan, pool, hits, {}, deliver, record_error);
+
+            if (callback_error)
+                std::rethrow_exception(callback_error);
+            if (!error.empty())
+                throw std::runtime_error(error);
+            return delivered;
+        }
+
+        std::vector<SearchInput> inputs;
+        ThreadPool pool;
+        const size_t prefetch_blocks;
+        std::unique_ptr<SortedIndex> index;
+        std::unique_ptr<BlockedBloomFilter> filter;
+        std::unique_ptr<PasswordStore> store;
+    };
+
+    Searcher::Searcher(const std::vector<std::string> &inputs, const SearcherOptions &options)
+        : impl_(std::make_unique<Impl>(inputs, options))
+    {
+    }
+
+    Searcher::~Searcher() = default;
+
+    uint64_t Searcher::Search(std::string_view query, const QueryOptions &options, const MatchCallback &on_match) const
+    {
+        const QueryMatcher matcher(query, options);
+        return std::visit([&](const auto &scanned)
+                          { return impl_->Search(scanned, options, on_match); }, matcher.impl_->matcher);
+    }
+
+    bool Searcher::Contains(std::string_view password) const
+    {
+        if (impl_->store)
+            return impl_->store->Contains(password);
+        if (!impl_->index)
+        {
+            throw std::runtime_error("Contains needs a Searcher with an index_file");
+        }
+        return (!impl_->filter || impl_->filter->MayContain(password)) && impl_->index->Contains(password);
+    }
+}
@@ -0,0 +1,230 @@
+// What the search command line uses of libsearch beyond Searcher.h: the
+// subcommands, and a scanner that hands every finished entry over to be
+// printed. This header is not installed, and libsearch is built with hidden
+// visibility, so none of it is exported from a program that embeds the
+// library; it changes whenever the command line needs it to.
+
+#pragma once
+
+#include "Searcher.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace Search
+{
+    constexpr uint64_t kDefaultCheckpointSpan = 32 * 1024 * 1024; // 32 MB
+    constexpr double kDefaultFalsePositiveRate = 0.01;
+    constexpr size_t kPrefetchBlockSize = 4 * 1024 * 1024;    // 4 MB per read issued ahead
+    constexpr size_t kDefaultPrefetchSize = 16 * 1024 * 1024; // 16 MB in flight per open archive
+
+    // Hash functions of the digest tables. NTLM is MD4 over the UTF-16LE
+    // form of the password.
+    enum class DigestAlgorithm : uint32_t
+    {
+        Ntlm = 1,
+        Md5 = 2,
+        Sha1 = 3,
+    };
+
+    class ThreadPool;
+    struct FinishedEntry;
+
+    std::vector<std::string> ExpandInputs(const std::vector<std::string> &inputs);
+    std::vector<std::string> ReadPatternsFile(const std::string &filename);
+    DigestAlgorithm ParseDigestAlgorithm(std::string_view name);
+
+    // The subcommands. Those with `threads` run that many workers, or one
+    // per CPU the process may use if it is 0, as --threads and --pin ask.
+    void BuildIndex(const std::string &zip_filename, const std::string &index_filename, double false_positive_rate,
+                    bool build_trigrams);
+    void BuildDigestTables(const std::string &index_filename, const std::vector<DigestAlgorithm> &algorithms,
+                           size_t threads = 0, bool pin_threads = false);
+    std::string StoreFilename(const std::string &zip_filename);
+    void ConvertToStore(const std::string &zip_filename, const std::string &store_filename);
+    bool IsPasswordStore(const std::string &filename);
+    bool LookupInStore(const std::string &store_filename, const std::string &password);
+    bool LookupInIndex(const std::string &index_filename, const std::string &password);
+    bool LookupDigest(const std::string &index_filename, std::string_view hex);
+    uint64_t LookupBatch(const std::string &filename, const std::string &queries_filename, size_t threads = 0,
+                         bool pin_threads = false);
+    void Serve(const std::string &index_filename, const std::string &socket_path, size_t threads = 0,
+               bool pin_threads = false);
+
+    // How one search records its hits. The command line sets these from its
+    // flags for every search, a Searcher per call.
+    struct ScanOptions
+    {
+        bool whole_line = false; // contexts are whole lines
+        bool count_only = false; // hits are counted but not recorded
+        uint64_t max_count = 0;  // 0 reports every occurrence
+        bool count_unique = false;
+        size_t prefetch_blocks = 0; // for the archives a search opens
+        bool stream_parts = false;  // report a split entry range by range, see ScanInputs
+    };
+
+    // What one worker spent its time on, for --stats.
+    struct WorkerStats
+    {
+        uint64_t tasks = 0;
+        uint64_t entries = 0;
+        uint64_t bytes_inflated = 0; // read or inflated from the archive
+        uint64_t bytes_scanned = 0;
+        double inflate_seconds = 0;
+        double search_seconds = 0;
+        double output_seconds = 0;    // formatting and handing to the sink
+        double lock_wait_seconds = 0; // state lock and sink backpressure
+    };
+
+    struct Occurrence
+    {
+        uint64_t line;
+        uint64_t col;
+        uint32_t context_offset; // into the contexts stored with it
+        uint32_t context_length;
+        uint32_t pattern; // index into the matcher's patterns
+    };
+
+    // The occurrences of an entry, or of its next ranges, as a search hands
+    // them over: Count() of them, each with its context.
+    class EntryReport
+    {
+    public:
+        explicit EntryReport(const FinishedEntry &entry) : entry_(entry)
+        {
+        }
+
+        std::string_view Name() const;
+        uint64_t Count() const;
+
+        // Calls handler(occurrence, context) for each of them in order.
+        void ForEachOccurrence(const std::function<void(const Occurrence &, std::string_view)> &handler) const;
+
+    private:
+        const FinishedEntry &entry_;
+    };
+
+    using EntryCallback = std::function<void(const EntryReport &)>;
+    using ErrorCallback = std::function<void(const std::string &, const std::exception &)>;
+
+    // Hands every line of a sorted index containing `needle` to on_found as
+    // one entry and returns how many there are. With a trigram index only
+    // candidate lines are verified; otherwise, or for needles shorter than a
+    // trigram, the whole index is scanned.
+    uint64_t FindInIndex(const std::string &index_filename, const std::string &needle,
+                         const EntryCallback &on_found = {});
+
+    // The matcher of a query: a keyword, a regex or whole lines, as for
+    // Searcher::Search, or every line of a patterns file in one pass.
+    class QueryMatcher
+    {
+    public:
+        QueryMatcher(std::string_view query, const QueryOptions &options);
+        QueryMatcher(std::vector<std::string> patterns, bool fold);
+        ~QueryMatcher();
+
+        QueryMatcher(const QueryMatcher &) = delete;
+        QueryMatcher &operator=(const QueryMatcher &) = delete;
+
+        size_t PatternCount() const;
+        std::string_view Pattern(size_t index) const;
+
+    private:
+        friend class InputScanner;
+        friend class Searcher;
+
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    struct ScanSummary
+    {
+        uint64_t reported = 0;     // occurrences handed over
+        bool stopped = false;      // at the max_count
+        uint64_t unique_lines = 0; // with count_unique
+    };
+
+    // The searches of the command line, which share one set of workers.
+    class InputScanner
+    {
+    public:
+        InputScanner(size_t threads, bool pin_threads);
+        ~InputScanner();
+
+        InputScanner(const InputScanner &) = delete;
+        InputScanner &operator=(const InputScanner &) = delete;
+
+        size_t WorkerCount() const;
+
+        // Searches every entry of the archives among `filenames`, and every
+        // text input as a whole, split at inflate checkpoints every
+        // `checkpoint_span` bytes unless it is 0; building them is announced
+        // on `status`. Each finished entry goes to on_entry on the worker that
+        // completed it, and an entry that could not be searched to on_error,
+        // one at a time. `stats` is empty or holds one slot per worker.
+        ScanSummary Scan(const std::vector<std::string> &filenames, const QueryMatcher &matcher,
+                         const ScanOptions &options, uint64_t checkpoint_span, std::ostream &status,
+                         std::span<WorkerStats> stats, const EntryCallback &on_entry,
+                         const ErrorCallback &on_error);
+
+    private:
+        std::unique_ptr<ThreadPool> pool_;
+    };
+
+#ifdef SEARCH_HAVE_BLAKE3
+    // Checks the inputs against their `.b3sum` files on a thread of its own
+    // while the search runs. It maps each file and hashes its compressed
+    // bytes front to back, so the search and the hash share one read of the
+    // file through the page cache. Inputs whose stamp shows they were
+    // verified before, unchanged, are not hashed again.
+    class InputVerifier
+    {
+    public:
+        explicit InputVerifier(const std::vector<std::string> &filenames);
+        ~InputVerifier();
+
+        InputVerifier(const InputVerifier &) = delete;
+        InputVerifier &operator=(const InputVerifier &) = delete;
+
+        // Waits for the remaining hashes, reports every input and returns
+        // false if any of them did not match its checksum. The inputs that
+        // did are listed on `status` unless it is null.
+        bool Finish(std::ostream *status);
+
+    private:
+        enum class Result
+        {
+            Match,
+            Unchanged,
+            Mismatch,
+            Failed,
+        };
+
+        struct VerifiedInput
+        {
+            std::string filename;
+            std::string digest;
+            bool skip;
+            Result result;
+            std::string error = {};
+        };
+
+        void HashInputs();
+        std::string HashFile(const std::string &filename);
+
+        std::vector<VerifiedInput> inputs_;
+        std::atomic<bool> cancelled_ = false;
+        std::thread thread_;
+    };
+#endif
+}
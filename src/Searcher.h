@@ -0,0 +1,100 @@
+// The search as a library: a Searcher keeps its inputs, and optionally a
+// sorted index or password store, open across queries and hands every
+// match to a callback instead of printing it. Link the libsearch target,
+// or the archive -DSEARCH_BUILD_LIBRARY=ON installs, to use it.
+//
+//   Search::Searcher searcher({"rockyou2024.zip"}, {.index_file = "rockyou2024.zip.idx"});
+//   bool leaked = searcher.Contains("hunter2");
+//   searcher.Search("hunter", {.case_insensitive = true}, [](const Search::Match &match)
+//                   { std::cout << match.context << '\n'; return true; });
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// libsearch is built with hidden visibility; Searcher is all it exports.
+#if defined(__GNUC__) || defined(__clang__)
+#define SEARCH_API __attribute__((visibility("default")))
+#else
+#define SEARCH_API
+#endif
+
+namespace Search
+{
+    // How a query matches: as a keyword anywhere in a line, as a regex
+    // (the command line's --regex), or against whole lines (--line).
+    enum class QueryKind
+    {
+        Keyword,
+        Regex,
+        LineExact,
+        LinePrefix,
+        LineSuffix,
+    };
+
+    struct QueryOptions
+    {
+        QueryKind kind = QueryKind::Keyword;
+        bool case_insensitive = false;
+        bool whole_line = false; // Match::context is the matching line
+        uint64_t max_count = 0;  // stop after this many matches; 0 for all
+        size_t min_length = 0;   // limits on the line length, for the Line kinds
+        size_t max_length = SIZE_MAX;
+    };
+
+    // One match. The views point into the searcher's buffers and are only
+    // valid during the callback.
+    struct Match
+    {
+        std::string_view entry; // archive entry or text file, "<zip_file>/<entry>" with several inputs
+        uint64_t line;
+        uint64_t column;
+        std::string_view context; // the bytes around the match, or its line
+    };
+
+    // Returns false to stop the search.
+    using MatchCallback = std::function<bool(const Match &)>;
+
+    struct SearcherOptions
+    {
+        size_t threads = 0; // 0 runs one worker per CPU the process may use
+        bool pin_threads = false;
+        uint64_t checkpoint_span = 0; // bytes between inflate checkpoints, 0 for none
+        uint64_t prefetch_size = 0;   // bytes of archive reads each worker keeps ahead of inflate, 0 for none
+        std::string index_file{};     // sorted index or password store for Contains
+    };
+
+    // Any number of threads may share one Searcher. Their searches take
+    // turns on its workers, while Contains runs on the calling thread.
+    class SEARCH_API Searcher
+    {
+    public:
+        explicit Searcher(const std::vector<std::string> &inputs, const SearcherOptions &options = {});
+        ~Searcher();
+
+        Searcher(const Searcher &) = delete;
+        Searcher &operator=(const Searcher &) = delete;
+
+        // Searches every input for `query` and returns how many matches were
+        // passed to on_match. The calls come one at a time from the worker
+        // threads, in order within an entry; a large entry is passed on
+        // range by range as it is searched, so other entries' matches may
+        // come in between. Throws std::runtime_error if an input could not
+        // be searched, once the others are done.
+        uint64_t Search(std::string_view query, const QueryOptions &options, const MatchCallback &on_match) const;
+
+        // Whether `password` is a line of the index_file; an index is
+        // checked against its Bloom filter first if there is one.
+        bool Contains(std::string_view password) const;
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+}
@@ -0,0 +1,38 @@
+// Uses libsearch the way an embedding project does: through the installed
+// Searcher.h and archive alone. Prints each input and its match count.
+//
+//   library_consumer <input> <keyword>
+
+#include <Searcher.h>
+
+#include <iostream>
+#include <map>
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <input> <keyword>\n";
+        return 1;
+    }
+    try
+    {
+        std::map<std::string, uint64_t> counts;
+        Search::Searcher searcher({argv[1]}, {.threads = 1});
+        searcher.Search(argv[2], {}, [&](const Search::Match &match)
+        {
+            counts[std::string(match.entry)]++;
+            return true;
+        });
+        for (const auto &[entry, count] : counts)
+        {
+            std::cout << entry << '\t' << count << '\n';
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
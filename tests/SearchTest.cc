@@ -0,0 +1,1130 @@
+// Regression tests over generated fixtures, run by ctest. The corpus has
+// lines of several megabytes across the range boundaries, and every path
+// that splits an entry into ranges must report the matches a plain scan
+// of the text finds, on the same lines. A small wordlist checks that
+// lookups in an index, a store and the digest tables find exactly the
+// lines they were built from, and that a rebuilt index is not answered
+// from files of its earlier build.
+//
+//   search_test          runs every test
+//   search_test ranges   runs one
+
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <regex>
+#include <set>
+
+#include "../src/Search.cc"
+
+namespace
+{
+
+    constexpr size_t kCorpusSize = 72 * 1024 * 1024;      // over two stored ranges, so a zip entry is split
+    constexpr size_t kLongLineSize = 3 * 1024 * 1024;     // longer than a chunk
+    constexpr uint64_t kCheckpointSpan = 4 * 1024 * 1024; // inflate checkpoints every 4 MB
+    constexpr size_t kZstdFrameSize = 1024 * 1024;        // 1 MB frames in the seekable zstd file
+    constexpr const char *kNeedle = "zqneedle";           // cannot overlap itself
+
+    int failures = 0;
+
+    void Check(bool condition, const std::string &what)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED: " << what << '\n';
+            ++failures;
+        }
+    }
+
+    // Short lines with the needle every few hundred, and a long line
+    // starting just before each multiple of the stored range size, with the
+    // needle at both ends, so its tail lies more than a chunk past the
+    // boundary.
+    std::string MakeCorpus()
+    {
+        std::mt19937_64 random(2024);
+        std::string text;
+        text.reserve(kCorpusSize + kLongLineSize);
+        uint64_t next_boundary = Search::kStoredRangeSize;
+        for (uint64_t line = 0; text.size() < kCorpusSize; ++line)
+        {
+            if (text.size() + 1000 >= next_boundary)
+            {
+                text += kNeedle;
+                text.append(kLongLineSize - 2 * std::strlen(kNeedle) - 100, 'a');
+                text += kNeedle;
+                text.append(100, 'b');
+                next_boundary += Search::kStoredRangeSize;
+            }
+            else if (line % 347 == 0)
+            {
+                text += "x" + std::to_string(random() % 1000) + kNeedle;
+            }
+            else
+            {
+                text += "word" + std::to_string(random() % 1000000);
+            }
+            text += '\n';
+        }
+        return text;
+    }
+
+    struct Position
+    {
+        uint64_t line;
+        uint64_t column;
+        auto operator<=>(const Position &) const = default;
+    };
+
+    std::vector<Position> FindInLines(std::string_view text)
+    {
+        std::vector<Position> positions;
+        uint64_t line = 1;
+        size_t line_start = 0;
+        for (size_t pos = text.find(kNeedle); pos != std::string_view::npos; pos = text.find(kNeedle, pos + 1))
+        {
+            for (size_t newline = text.find('\n', line_start); newline < pos; newline = text.find('\n', line_start))
+            {
+                line_start = newline + 1;
+                ++line;
+            }
+            positions.push_back({line, pos - line_start + 1});
+        }
+        return positions;
+    }
+
+    std::string Deflate(std::string_view text, int window_bits)
+    {
+        z_stream stream{};
+        if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            throw std::runtime_error("Error initializing deflate");
+        }
+        std::string compressed(deflateBound(&stream, static_cast<uLong>(text.size())), '\0');
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+        stream.avail_in = static_cast<uInt>(text.size());
+        stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+        stream.avail_out = static_cast<uInt>(compressed.size());
+        const int ret = deflate(&stream, Z_FINISH);
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+        if (ret != Z_STREAM_END)
+        {
+            throw std::runtime_error("Error deflating corpus");
+        }
+        return compressed;
+    }
+
+    void WriteFile(const std::string &filename, std::string_view data)
+    {
+        std::ofstream out(filename, std::ios::binary);
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!out)
+        {
+            throw std::runtime_error("Error writing " + filename);
+        }
+    }
+
+    void Put16(std::string &out, uint16_t value)
+    {
+        out += static_cast<char>(value);
+        out += static_cast<char>(value >> 8);
+    }
+
+    void Put32(std::string &out, uint32_t value)
+    {
+        Put16(out, static_cast<uint16_t>(value));
+        Put16(out, static_cast<uint16_t>(value >> 16));
+    }
+
+    // An archive with a stored and a deflated copy of `text`, without
+    // Zip64.
+    std::string MakeZip(std::string_view text, std::string_view compressed)
+    {
+        struct Entry
+        {
+            std::string name;
+            std::string_view data;
+            uint16_t method;
+            uint32_t offset;
+        };
+        std::vector<Entry> entries = {{"stored.txt", text, 0, 0}, {"deflated.txt", compressed, Z_DEFLATED, 0}};
+        const auto crc = static_cast<uint32_t>(
+            crc32(0, reinterpret_cast<const Bytef *>(text.data()), static_cast<uInt>(text.size())));
+
+        // The fields local and central headers share, from "version needed"
+        // to the file name length.
+        auto put_common = [&](std::string &out, const Entry &entry)
+        {
+            Put16(out, 20); // version needed
+            Put16(out, 0);  // flags
+            Put16(out, entry.method);
+            Put16(out, 0);    // time
+            Put16(out, 0x21); // date: 1980-01-01
+            Put32(out, crc);
+            Put32(out, static_cast<uint32_t>(entry.data.size()));
+            Put32(out, static_cast<uint32_t>(text.size()));
+            Put16(out, static_cast<uint16_t>(entry.name.size()));
+        };
+
+        std::string zip;
+        for (Entry &entry : entries)
+        {
+            entry.offset = static_cast<uint32_t>(zip.size());
+            Put32(zip, 0x04034b50);
+            put_common(zip, entry);
+            Put16(zip, 0); // extra field length
+            zip += entry.name;
+            zip += entry.data;
+        }
+        const auto directory_offset = static_cast<uint32_t>(zip.size());
+        for (const Entry &entry : entries)
+        {
+            Put32(zip, 0x02014b50);
+            Put16(zip, 20); // made by
+            put_common(zip, entry);
+            for (int field = 0; field < 4; ++field)
+                Put16(zip, 0); // extra and comment length, disk, internal attributes
+            Put32(zip, 0);     // external attributes
+            Put32(zip, entry.offset);
+            zip += entry.name;
+        }
+        const auto directory_size = static_cast<uint32_t>(zip.size()) - directory_offset;
+        Put32(zip, 0x06054b50);
+        Put32(zip, 0); // disk numbers
+        Put16(zip, static_cast<uint16_t>(entries.size()));
+        Put16(zip, static_cast<uint16_t>(entries.size()));
+        Put32(zip, directory_size);
+        Put32(zip, directory_offset);
+        Put16(zip, 0); // comment length
+        return zip;
+    }
+
+#ifdef SEARCH_HAVE_ZSTD
+    // Independent frames of kZstdFrameSize followed by a seek table.
+    std::string MakeSeekableZstd(std::string_view text)
+    {
+        std::string file;
+        std::string table;
+        uint32_t frames = 0;
+        for (size_t offset = 0; offset < text.size(); offset += kZstdFrameSize, ++frames)
+        {
+            const std::string_view frame_text = text.substr(offset, kZstdFrameSize);
+            std::string frame(ZSTD_compressBound(frame_text.size()), '\0');
+            const size_t size = ZSTD_compress(frame.data(), frame.size(), frame_text.data(), frame_text.size(), 1);
+            if (ZSTD_isError(size))
+            {
+                throw std::runtime_error("Error compressing corpus with zstd");
+            }
+            file.append(frame.data(), size);
+            Put32(table, static_cast<uint32_t>(size));
+            Put32(table, static_cast<uint32_t>(frame_text.size()));
+        }
+        Put32(file, 0x184d2a5e);
+        Put32(file, static_cast<uint32_t>(table.size() + 9));
+        file += table;
+        Put32(file, frames);
+        file += '\0'; // descriptor: no checksums
+        Put32(file, 0x8f92eab1);
+        return file;
+    }
+#endif
+
+    // A directory for the fixtures that goes away with the process.
+    std::string TempPath(const std::string &name)
+    {
+        struct Directory
+        {
+            std::filesystem::path path =
+                std::filesystem::temp_directory_path() / ("search_test." + std::to_string(getpid()));
+
+            Directory()
+            {
+                std::filesystem::create_directories(path);
+            }
+
+            ~Directory()
+            {
+                std::error_code error;
+                std::filesystem::remove_all(path, error);
+            }
+        };
+        static const Directory directory;
+        return (directory.path / name).string();
+    }
+
+    // The corpus written once as every kind of input.
+    struct Fixtures
+    {
+        std::string text;
+        std::vector<Position> expected;
+        std::string plain = TempPath("corpus.txt");
+        std::string zip = TempPath("corpus.zip");
+        std::string gzip = TempPath("corpus.txt.gz");
+        std::string zstd;
+
+        Fixtures()
+        {
+            text = MakeCorpus();
+            expected = FindInLines(text);
+            WriteFile(plain, text);
+            WriteFile(zip, MakeZip(text, Deflate(text, -MAX_WBITS)));
+            WriteFile(gzip, Deflate(text, MAX_WBITS + 16));
+#ifdef SEARCH_HAVE_ZSTD
+            zstd = TempPath("corpus.txt.zst");
+            WriteFile(zstd, MakeSeekableZstd(text));
+#endif
+        }
+    };
+
+    const Fixtures &GetFixtures()
+    {
+        static const Fixtures fixtures;
+        return fixtures;
+    }
+
+    // Every match of the needle in `filename`, by entry.
+    std::map<std::string, std::vector<Position>> Matches(const std::string &filename,
+                                                         const Search::SearcherOptions &options)
+    {
+        std::map<std::string, std::vector<Position>> matches;
+        Search::Searcher searcher({filename}, options);
+        searcher.Search(kNeedle, {}, [&](const Search::Match &match)
+                        {
+                            matches[std::string(match.entry)].push_back({match.line, match.column});
+                            return true;
+                        });
+        return matches;
+    }
+
+    void CheckMatches(const std::string &what, const std::string &filename, const Search::SearcherOptions &options,
+                      const std::vector<std::string> &entries)
+    {
+        const Fixtures &fixtures = GetFixtures();
+        const auto matches = Matches(filename, options);
+        Check(matches.size() == entries.size(), what + ": entries with matches");
+        for (const std::string &entry : entries)
+        {
+            const auto found = matches.find(entry);
+            if (found == matches.end())
+            {
+                Check(false, what + ": no matches in " + entry);
+                continue;
+            }
+            const std::vector<Position> &positions = found->second;
+            Check(positions.size() == fixtures.expected.size(),
+                  what + ": " + entry + " has " + std::to_string(positions.size()) + " matches, expected " +
+                      std::to_string(fixtures.expected.size()));
+            const auto mismatch = std::mismatch(positions.begin(), positions.end(), fixtures.expected.begin(),
+                                                fixtures.expected.end());
+            if (mismatch.first != positions.end() && mismatch.second != fixtures.expected.end())
+            {
+                Check(false, what + ": " + entry + " reports line " + std::to_string(mismatch.first->line) +
+                                 " column " + std::to_string(mismatch.first->column) + ", expected line " +
+                                 std::to_string(mismatch.second->line) + " column " +
+                                 std::to_string(mismatch.second->column));
+            }
+        }
+    }
+
+    // The same matches on the same lines from stored ranges of a text file
+    // and a zip entry, inflate checkpoints, a whole deflate stream, gzip and
+    // seekable zstd frames, with one thread and with several.
+    void TestRanges()
+    {
+        const Fixtures &fixtures = GetFixtures();
+        for (const size_t threads : {size_t{1}, size_t{4}})
+        {
+            const std::string suffix = " with " + std::to_string(threads) + " threads";
+            CheckMatches("text file" + suffix, fixtures.plain, {.threads = threads}, {fixtures.plain});
+            CheckMatches("zip" + suffix, fixtures.zip, {.threads = threads}, {"stored.txt", "deflated.txt"});
+            CheckMatches("zip with checkpoints" + suffix, fixtures.zip,
+                         {.threads = threads, .checkpoint_span = kCheckpointSpan}, {"stored.txt", "deflated.txt"});
+            CheckMatches("gzip" + suffix, fixtures.gzip, {.threads = threads}, {fixtures.gzip});
+#ifdef SEARCH_HAVE_ZSTD
+            CheckMatches("seekable zstd" + suffix, fixtures.zstd, {.threads = threads}, {fixtures.zstd});
+#endif
+        }
+    }
+
+    // With whole_line, a match in a long line across a range boundary
+    // carries its line up to the end. Lines longer than a chunk are
+    // searched in pieces, so the context of the needle at the end starts
+    // partway into the line.
+    void TestWholeLines()
+    {
+        const Fixtures &fixtures = GetFixtures();
+        const std::string tail = kNeedle + std::string(100, 'b');
+        std::vector<std::string> inputs = {fixtures.plain, fixtures.zip};
+#ifdef SEARCH_HAVE_ZSTD
+        inputs.push_back(fixtures.zstd);
+#endif
+        for (const std::string &input : inputs)
+        {
+            Search::Searcher searcher({input}, {.threads = 4});
+            uint64_t long_lines = 0;
+            searcher.Search(kNeedle, {.whole_line = true}, [&](const Search::Match &match)
+                            {
+                                if (match.context.find("aaaa") == std::string_view::npos)
+                                    return true;
+                                ++long_lines;
+                                const bool whole = (match.column == 1) ? match.context.starts_with(kNeedle)
+                                                                       : match.context.ends_with(tail);
+                                Check(whole, input + ": long line " + std::to_string(match.line) + " is cut off");
+                                return true;
+                            });
+            // Both needles of each long line, in every entry.
+            const uint64_t expected = 2 * (kCorpusSize / Search::kStoredRangeSize) * (input == fixtures.zip ? 2 : 1);
+            Check(long_lines == expected, input + ": " + std::to_string(long_lines) +
+                                              " matches in long lines, expected " + std::to_string(expected));
+        }
+    }
+
+    // With stream_parts the stored ranges of a text file are handed over
+    // run by run, one per range with a single worker, and without it all at
+    // once; either way they add up to the matches of a plain scan, on the
+    // same lines, also when --max-count cuts them short.
+    void TestStreaming()
+    {
+        const Fixtures &fixtures = GetFixtures();
+        const std::vector<Search::SearchInput> inputs = Search::OpenSearchInputs({fixtures.plain});
+        const Search::KeywordMatcher matcher(kNeedle);
+        const size_t ranges = (fixtures.text.size() + Search::kStoredRangeSize - 1) / Search::kStoredRangeSize;
+        for (const bool stream : {false, true})
+        {
+            for (const size_t threads : {1, 4})
+            {
+                for (const uint64_t limit : {uint64_t{0}, uint64_t{7}})
+                {
+                    Search::ThreadPool pool(threads);
+                    Search::HitCounter hits(limit);
+                    Search::ScanOptions options;
+                    options.max_count = limit;
+                    options.stream_parts = stream;
+                    std::mutex mutex;
+                    size_t handed_over = 0;
+                    std::vector<Position> positions;
+                    const uint64_t reported = Search::ScanInputs(
+                        inputs, matcher, options, pool, hits, {}, [&](const Search::FinishedEntry &entry)
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            ++handed_over;
+                            entry.ForEachOccurrence([&](const Search::Occurrence &occurrence, std::string_view)
+                                                    { positions.push_back({occurrence.line, occurrence.col}); });
+                        },
+                        [&](const std::string &name, const std::exception &e)
+                        { Check(false, name + ": " + e.what()); });
+
+                    const std::string what = std::string(stream ? "streamed" : "whole") + ", " +
+                                             std::to_string(threads) + " threads, limit " + std::to_string(limit);
+                    std::vector<Position> expected = fixtures.expected;
+                    if (limit > 0)
+                        expected.resize(limit);
+                    Check(positions == expected && reported == expected.size(),
+                          what + ": " + std::to_string(positions.size()) + " matches differ from a plain scan");
+                    if (limit == 0)
+                        Check(stream ? handed_over >= 1 && (threads > 1 || handed_over == ranges) : handed_over == 1,
+                              what + ": handed over in " + std::to_string(handed_over) + " runs");
+                }
+            }
+        }
+    }
+
+    // Every find kernel set the CPU can run, beginning with the scalar
+    // BoyerMoore and ending with the one SelectFindKernel prefers.
+    struct NamedFindKernels
+    {
+        const char *name;
+        Search::FindKernels kernels;
+    };
+
+    std::vector<NamedFindKernels> SupportedFindKernels()
+    {
+        [[maybe_unused]] constexpr auto kLengths = std::make_index_sequence<Search::kMaxShortPattern - 1>();
+        std::vector<NamedFindKernels> supported = {{"scalar", {}}};
+#if defined(SEARCH_X86)
+        const Search::CpuFeatures features = Search::DetectCpuFeatures();
+        if (features.sse2)
+            supported.push_back({"sse2", {Search::FindSse2, Search::ShortKernelsSse2(kLengths)}});
+        if (features.avx2)
+            supported.push_back({"avx2", {Search::FindAvx2, Search::ShortKernelsAvx2(kLengths)}});
+#elif defined(SEARCH_NEON)
+        supported.push_back({"neon", {Search::FindNeon, Search::ShortKernelsNeon(kLengths)}});
+#endif
+        return supported;
+    }
+
+    // ASCII letters lowered, as the kernels fold them.
+    std::string FoldAscii(std::string_view text)
+    {
+        std::string folded(text);
+        for (char &c : folded)
+        {
+            if (c >= 'A' && c <= 'Z')
+                c = static_cast<char>(c + ('a' - 'A'));
+        }
+        return folded;
+    }
+
+    // The generic and the short-pattern kernels of each supported ISA, and
+    // the one dispatch picks, against string_view::find at every pattern
+    // length up to 32, every text length through a few vector blocks and
+    // their tails, and every alignment of the text within 32 bytes. The
+    // text repeats the pattern with some letters flipped in case and some
+    // bytes replaced by ones that only differ from a letter in the fold bit,
+    // and goes on past the end of the view, so a kernel that reads too far
+    // reports a match there.
+    void TestKernels()
+    {
+        constexpr size_t kMaxPattern = 32;
+        constexpr size_t kExtraLength = 100;
+        constexpr size_t kAlignments = 32;
+        static constexpr std::string_view kPatternBytes = "abAB@`[{";
+        const std::vector<NamedFindKernels> supported = SupportedFindKernels();
+        std::mt19937_64 random(20);
+        for (size_t m = 1; m <= kMaxPattern; ++m)
+        {
+            std::string pattern;
+            for (size_t i = 0; i < m; ++i)
+            {
+                pattern += kPatternBytes[random() % kPatternBytes.size()];
+            }
+            std::string text;
+            for (size_t i = 0; i < m + kExtraLength + kAlignments; ++i)
+            {
+                char c = pattern[i % m];
+                if (random() % 4 == 0 && std::isalpha(static_cast<unsigned char>(c)))
+                    c = static_cast<char>(c ^ 0x20);
+                if (random() % (4 * m) == 0)
+                    c = kPatternBytes[random() % kPatternBytes.size()];
+                text += c;
+            }
+
+            const Search::FindKernels &preferred = supported.back().kernels;
+            const Search::FindFunction dispatched =
+                (m <= Search::kMaxShortPattern && preferred.short_patterns[m]) ? preferred.short_patterns[m]
+                                                                               : preferred.generic;
+            Check(Search::SelectFindKernel(m) == dispatched,
+                  "length " + std::to_string(m) + " is not dispatched to the " + supported.back().name + " kernel");
+
+            for (const bool fold : {false, true})
+            {
+                const std::string haystack = fold ? FoldAscii(text) : text;
+                const std::string needle = fold ? FoldAscii(pattern) : pattern;
+                std::vector<size_t> all;
+                for (size_t pos = 0; (pos = std::string_view(haystack).find(needle, pos)) != std::string::npos;
+                     ++pos)
+                {
+                    all.push_back(pos);
+                }
+
+                // The text copied behind each alignment of a 32-byte boundary.
+                alignas(32) char buffer[kAlignments + kMaxPattern + kExtraLength + kAlignments];
+                for (size_t alignment = 0; alignment < kAlignments; ++alignment)
+                {
+                    std::memcpy(buffer + alignment, text.data(), text.size());
+                    for (size_t n = 0; n <= m + kExtraLength; ++n)
+                    {
+                        const std::string_view view(buffer + alignment, n);
+                        std::vector<size_t> expected;
+                        for (const size_t pos : all)
+                        {
+                            if (pos + m <= n)
+                                expected.push_back(pos);
+                        }
+                        for (const NamedFindKernels &named : supported)
+                        {
+                            const Search::FindFunction shorter =
+                                (m <= Search::kMaxShortPattern) ? named.kernels.short_patterns[m] : nullptr;
+                            for (const Search::FindFunction find : {named.kernels.generic, shorter})
+                            {
+                                if (find && find(view, pattern, fold) != expected)
+                                {
+                                    Check(false, std::string(named.name) + (find == shorter ? " short" : "") +
+                                                     " kernel for length " + std::to_string(m) + (fold ? " -i" : "") +
+                                                     " on " + std::to_string(n) + " bytes at alignment " +
+                                                     std::to_string(alignment));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // A random pattern over a small alphabet, and the same pattern in the
+    // POSIX syntax of std::regex, which spells \d \w \s as classes.
+    struct GeneratedRegex
+    {
+        std::string pattern;
+        std::string reference;
+    };
+
+    void AppendRegex(std::mt19937_64 &random, int depth, GeneratedRegex &out);
+
+    void AppendRegexAtom(std::mt19937_64 &random, int depth, GeneratedRegex &out)
+    {
+        static const std::pair<const char *, const char *> kAtoms[] = {
+            {"a", "a"},           {"b", "b"},           {"A", "A"},
+            {"0", "0"},           {"_", "_"},           {"-", "-"},
+            {".", "."},           {"[ab]", "[ab]"},     {"[^a]", "[^a]"},
+            {"[a-c]", "[a-c]"},   {"[A-B_]", "[A-B_]"}, {"[^ab0]", "[^ab0]"},
+            {"\\d", "[0-9]"},     {"\\D", "[^0-9]"},    {"\\w", "[_[:alnum:]]"},
+            {"\\W", "[^_[:alnum:]]"}, {"\\s", "[[:space:]]"}, {"\\S", "[^[:space:]]"},
+        };
+        if (depth > 0 && random() % 4 == 0)
+        {
+            out.pattern += '(';
+            out.reference += '(';
+            AppendRegex(random, depth - 1, out);
+            out.pattern += ')';
+            out.reference += ')';
+        }
+        else
+        {
+            const auto &[pattern, reference] = kAtoms[random() % std::size(kAtoms)];
+            out.pattern += pattern;
+            out.reference += reference;
+        }
+        static const char *const kQuantifiers[] = {"*", "+", "?", "{2}", "{1,}", "{0,2}", "{1,3}"};
+        if (random() % 3 == 0)
+        {
+            const char *quantifier = kQuantifiers[random() % std::size(kQuantifiers)];
+            out.pattern += quantifier;
+            out.reference += quantifier;
+        }
+    }
+
+    // Alternatives of one to three atoms each, some anchored at either end.
+    void AppendRegex(std::mt19937_64 &random, int depth, GeneratedRegex &out)
+    {
+        const int alternatives = (random() % 4 == 0) ? 2 : 1;
+        for (int alternative = 0; alternative < alternatives; ++alternative)
+        {
+            if (alternative > 0)
+            {
+                out.pattern += '|';
+                out.reference += '|';
+            }
+            const bool start = random() % 6 == 0, end = random() % 6 == 0;
+            if (start)
+            {
+                out.pattern += '^';
+                out.reference += '^';
+            }
+            for (int atoms = 1 + static_cast<int>(random() % 3); atoms > 0; --atoms)
+            {
+                AppendRegexAtom(random, depth, out);
+            }
+            if (end)
+            {
+                out.pattern += '$';
+                out.reference += '$';
+            }
+        }
+    }
+
+    struct RegexHit
+    {
+        uint64_t line;
+        uint64_t column;
+        size_t length;
+        auto operator<=>(const RegexHit &) const = default;
+    };
+
+    // The leftmost-longest matches of each line, one line at a time, as
+    // RegexMatcher reports them: a '\r' ending the line is not part of it,
+    // and an empty match only counts on a line without other matches. Each
+    // start is tried with every end, longest first, as an exact match,
+    // since the leftmost-longest search of std::regex gets nested repeats
+    // wrong; the flags keep the anchors to the line's own ends.
+    std::vector<RegexHit> RegexReference(std::string_view text, const std::regex &regex)
+    {
+        std::vector<RegexHit> hits;
+        uint64_t number = 0;
+        for (size_t begin = 0; begin < text.size();)
+        {
+            const size_t end = std::min(text.find('\n', begin), text.size());
+            std::string_view line = text.substr(begin, end - begin);
+            begin = end + 1;
+            ++number;
+            if (line.ends_with('\r'))
+                line.remove_suffix(1);
+            auto matches = [&](size_t start, size_t stop)
+            {
+                auto flags = std::regex_constants::match_default;
+                if (start > 0)
+                    flags |= std::regex_constants::match_prev_avail;
+                if (stop < line.size())
+                    flags |= std::regex_constants::match_not_eol;
+                return std::regex_match(line.begin() + start, line.begin() + stop, regex, flags);
+            };
+            // End of the longest match starting at `start`, or npos.
+            auto longest = [&](size_t start)
+            {
+                for (size_t stop = line.size() + 1; stop-- > start;)
+                {
+                    if (matches(start, stop))
+                        return stop;
+                }
+                return std::string_view::npos;
+            };
+            size_t empty = std::string_view::npos;
+            bool reported = false;
+            for (size_t cursor = 0; cursor <= line.size();)
+            {
+                size_t start = cursor, stop = std::string_view::npos;
+                for (; start <= line.size(); ++start)
+                {
+                    if ((stop = longest(start)) != std::string_view::npos)
+                        break;
+                }
+                if (stop == std::string_view::npos)
+                    break;
+                if (stop == start)
+                {
+                    if (empty == std::string_view::npos)
+                        empty = start;
+                    cursor = start + 1;
+                    continue;
+                }
+                hits.push_back({number, start + 1, stop - start});
+                reported = true;
+                cursor = stop;
+            }
+            if (!reported && empty != std::string_view::npos)
+                hits.push_back({number, empty + 1, 0});
+        }
+        return hits;
+    }
+
+    // Short lines over the pattern alphabet, some ending in "\r\n".
+    std::string MakeRegexLines(std::mt19937_64 &random, size_t count)
+    {
+        static constexpr std::string_view kAlphabet = "abcAB01_- x";
+        std::string text;
+        for (size_t line = 0; line < count; ++line)
+        {
+            for (size_t length = random() % 11; length > 0; --length)
+            {
+                text += kAlphabet[random() % kAlphabet.size()];
+            }
+            text += (random() % 8 == 0) ? "\r\n" : "\n";
+        }
+        return text;
+    }
+
+    // RegexMatcher, with its literal prefilter and lazy DFAs, against
+    // std::regex on generated patterns with and without case folding, and
+    // then through a Searcher on a text file and a gzip stream whose lines
+    // cross the chunk boundaries.
+    void TestRegex()
+    {
+        constexpr size_t kPatterns = 400;
+        constexpr size_t kChunkPatterns = 6;
+        std::mt19937_64 random(21);
+        const std::string text = MakeRegexLines(random, 300);
+        std::vector<size_t> line_starts = {0};
+        for (size_t pos = 0; (pos = text.find('\n', pos)) != std::string::npos; ++pos)
+        {
+            line_starts.push_back(pos + 1);
+        }
+
+        struct Checked
+        {
+            GeneratedRegex regex;
+            bool fold;
+            std::vector<RegexHit> expected;
+        };
+        std::vector<Checked> chunk_cases;
+        for (size_t i = 0; i < kPatterns; ++i)
+        {
+            GeneratedRegex regex;
+            AppendRegex(random, 2, regex);
+            for (const bool fold : {false, true})
+            {
+                const auto flags = std::regex::extended | (fold ? std::regex::icase : std::regex::flag_type{});
+                std::vector<RegexHit> expected = RegexReference(text, std::regex(regex.reference, flags));
+                std::vector<RegexHit> hits;
+                Search::RegexMatcher(regex.pattern, fold).ForEachMatch(text, [&](size_t pos, size_t length, size_t)
+                {
+                    const auto line = std::upper_bound(line_starts.begin(), line_starts.end(), pos) - 1;
+                    hits.push_back({static_cast<uint64_t>(line - line_starts.begin()) + 1, pos - *line + 1, length});
+                });
+                const std::string what = "regex '" + regex.pattern + "'" + (fold ? " -i" : "");
+                const auto mismatch = std::mismatch(hits.begin(), hits.end(), expected.begin(), expected.end());
+                if (mismatch.first != hits.end() || mismatch.second != expected.end())
+                {
+                    const RegexHit &hit = (mismatch.second != expected.end()) ? *mismatch.second : *mismatch.first;
+                    Check(false, what + ": " + std::to_string(hits.size()) + " matches, expected " +
+                                     std::to_string(expected.size()) + "; first difference on line " +
+                                     std::to_string(hit.line) + " column " + std::to_string(hit.column));
+                }
+                if (chunk_cases.size() < kChunkPatterns && !expected.empty() && expected.front().length > 0)
+                    chunk_cases.push_back({regex, fold, std::move(expected)});
+            }
+        }
+
+        // The lines repeated past two chunks, so the repeats start at
+        // varying offsets of a window.
+        const size_t lines = line_starts.size() - 1;
+        const size_t repeats = 2 * Search::kChunkSize / text.size() + 2;
+        std::string repeated;
+        for (size_t i = 0; i < repeats; ++i)
+        {
+            repeated += text;
+        }
+        const std::string plain = TempPath("regex.txt");
+        const std::string gzip = TempPath("regex.txt.gz");
+        WriteFile(plain, repeated);
+        WriteFile(gzip, Deflate(repeated, MAX_WBITS + 16));
+        for (const Checked &checked : chunk_cases)
+        {
+            std::vector<Position> expected;
+            for (size_t i = 0; i < repeats; ++i)
+            {
+                for (const RegexHit &hit : checked.expected)
+                {
+                    expected.push_back({hit.line + i * lines, hit.column});
+                }
+            }
+            for (const std::string &input : {plain, gzip})
+            {
+                std::vector<Position> positions;
+                Search::Searcher({input}).Search(checked.regex.pattern,
+                                                 {.kind = Search::QueryKind::Regex, .case_insensitive = checked.fold},
+                                                 [&](const Search::Match &match)
+                                                 {
+                                                     positions.push_back({match.line, match.column});
+                                                     return true;
+                                                 });
+                Check(positions == expected, input + ": regex '" + checked.regex.pattern + "' finds " +
+                                                 std::to_string(positions.size()) + " matches, expected " +
+                                                 std::to_string(expected.size()));
+            }
+        }
+    }
+
+    // A small wordlist with repeated lines, CRLF endings, empty lines and
+    // lines too long for a single digest block, archived twice, and its
+    // distinct lines as build-index stores them.
+    struct Wordlist
+    {
+        std::string zip = TempPath("wordlist.zip");
+        std::string index = zip + ".idx";
+        std::string store = zip + ".store";
+        std::set<std::string> lines;
+
+        Wordlist()
+        {
+            std::mt19937_64 random(7);
+            std::string text = "password\n123456\nhunter2\r\n\n\ndragon\r\npassword\n";
+            text += std::string(100, 'x') + "\n";
+            for (int i = 0; i < 20000; ++i)
+            {
+                text += "pw" + std::to_string(random() % 5000) + (i % 7 == 0 ? "\r\n" : "\n");
+            }
+            text += "last line without a newline";
+            WriteFile(zip, MakeZip(text, Deflate(text, -MAX_WBITS)));
+
+            for (size_t start = 0; start < text.size();)
+            {
+                size_t end = std::min(text.find('\n', start), text.size());
+                const size_t next = end + 1;
+                if (end > start && text[end - 1] == '\r')
+                    end--;
+                if (end > start)
+                    lines.insert(text.substr(start, end - start));
+                start = next;
+            }
+
+            Search::BuildIndex(zip, index, Search::kDefaultFalsePositiveRate, false);
+            Search::BuildDigestTables(index, {Search::kDigestAlgorithms.begin(), Search::kDigestAlgorithms.end()});
+            Search::ConvertToStore(zip, store);
+        }
+    };
+
+    const Wordlist &GetWordlist()
+    {
+        static const Wordlist wordlist;
+        return wordlist;
+    }
+
+    const std::vector<std::string> kAbsent = {"", "pw5000", "passwor", "password ", "dragon\r", "zzz"};
+
+    // Every distinct line, and nothing else, from the index, its filter and
+    // the password store, directly and through a Searcher.
+    void TestLookup()
+    {
+        const Wordlist &wordlist = GetWordlist();
+        const Search::SortedIndex index(wordlist.index);
+        const Search::BlockedBloomFilter filter(Search::FilterFilename(wordlist.index));
+        const Search::PasswordStore store(wordlist.store);
+        const Search::Searcher index_searcher({}, {.index_file = wordlist.index});
+        const Search::Searcher store_searcher({}, {.index_file = wordlist.store});
+
+        Check(index.LineCount() == wordlist.lines.size(),
+              "index has " + std::to_string(index.LineCount()) + " lines, expected " +
+                  std::to_string(wordlist.lines.size()));
+        uint64_t number = 0;
+        for (const std::string &line : wordlist.lines)
+        {
+            Check(index.LineByNumber(number) == line, "index line " + std::to_string(number) + " is not " + line);
+            ++number;
+            Check(index.Contains(line) && filter.MayContain(line) && index_searcher.Contains(line),
+                  "index lookup misses " + line);
+            Check(store.Contains(line) && store_searcher.Contains(line), "store lookup misses " + line);
+        }
+        for (const std::string &line : kAbsent)
+        {
+            Check(!index.Contains(line) && !index_searcher.Contains(line), "index finds '" + line + "'");
+            Check(!store.Contains(line) && !store_searcher.Contains(line), "store finds '" + line + "'");
+        }
+
+        // Sized for the distinct lines, not for every line of both entries.
+        const Search::BlockedBloomFilter sized(wordlist.lines.size(), Search::kDefaultFalsePositiveRate);
+        Check(filter.SizeInBytes() == sized.SizeInBytes(), "filter is not sized for the distinct lines");
+    }
+
+    // Rebuilding an index under any name replaces the files derived from
+    // it, and a file left over from the earlier build is refused.
+    void TestRebuilds()
+    {
+        const Wordlist &wordlist = GetWordlist();
+        const std::string other = TempPath("other.zip");
+        const std::string other_text = "alpha\ngamma\nletmein\n";
+        WriteFile(other, MakeZip(other_text, Deflate(other_text, -MAX_WBITS)));
+
+        const std::string index = TempPath("custom.idx");
+        const std::string filter = Search::FilterFilename(index);
+        const std::string stale_filter = index + ".old";
+        Search::BuildIndex(wordlist.zip, index, Search::kDefaultFalsePositiveRate, false);
+        Check(Search::OpenIndexFilter(index, Search::SortedIndex(index)) != nullptr,
+              "no filter for an index not named after its archive");
+        std::filesystem::copy_file(filter, stale_filter);
+
+        Search::BuildIndex(other, index, Search::kDefaultFalsePositiveRate, false);
+        const Search::Searcher searcher({}, {.index_file = index});
+        Check(searcher.Contains("letmein") && !searcher.Contains("hunter2"), "rebuilt index answers from the old filter");
+
+        std::filesystem::copy_file(stale_filter, filter, std::filesystem::copy_options::overwrite_existing);
+        bool refused = false;
+        try
+        {
+            Search::OpenIndexFilter(index, Search::SortedIndex(index));
+        }
+        catch (const std::runtime_error &)
+        {
+            refused = true;
+        }
+        Check(refused, "stale filter is trusted");
+
+        // The same for the trigram index, which a build without --trigrams
+        // removes.
+        const std::string trigrams = Search::TrigramFilename(index);
+        const std::string stale_trigrams = index + ".tri.old";
+        Search::BuildIndex(wordlist.zip, index, Search::kDefaultFalsePositiveRate, true);
+        std::filesystem::copy_file(trigrams, stale_trigrams);
+        Search::BuildIndex(other, index, Search::kDefaultFalsePositiveRate, false);
+        Check(!std::filesystem::exists(trigrams), "rebuild without trigrams keeps the old trigram index");
+        Check(Search::FindInIndex(index, "amm") == 1, "find misses 'amm' in the rebuilt index");
+
+        Search::BuildIndex(other, index, Search::kDefaultFalsePositiveRate, true);
+        Check(Search::FindInIndex(index, "amm") == 1, "find misses 'amm' through the trigram index");
+        std::filesystem::copy_file(stale_trigrams, trigrams, std::filesystem::copy_options::overwrite_existing);
+        refused = false;
+        try
+        {
+            Search::OpenTrigramIndex(index, Search::SortedIndex(index));
+        }
+        catch (const std::runtime_error &)
+        {
+            refused = true;
+        }
+        Check(refused, "stale trigram index is trusted");
+    }
+
+    // A checkpoint file cut short or with any field overwritten is
+    // rejected, or still describes its entry, and never throws on load.
+    void TestCheckpoints()
+    {
+        constexpr uint64_t kSpan = 16 * 1024;
+        std::mt19937_64 random(5);
+        std::string text;
+        while (text.size() < 40 * kSpan)
+        {
+            text += "line" + std::to_string(random() % 100000) + '\n';
+        }
+        const std::string zip = TempPath("checkpoints.zip");
+        WriteFile(zip, MakeZip(text, Deflate(text, -MAX_WBITS)));
+        const Search::CheckpointIndex built = Search::LoadOrBuildCheckpoints(zip, Search::CreateZipIndex(zip), kSpan);
+        Check(built.size() == 1 && built.begin()->second.points.size() > 1, "no checkpoints built");
+
+        const std::string filename = Search::CheckpointFilename(zip);
+        std::string original(std::filesystem::file_size(filename), '\0');
+        std::ifstream(filename, std::ios::binary).read(original.data(), static_cast<std::streamsize>(original.size()));
+
+        auto load = [&](std::string_view contents, const std::string &what)
+        {
+            WriteFile(filename, contents);
+            Search::CheckpointIndex checkpoints;
+            try
+            {
+                const bool loaded = Search::LoadCheckpoints(zip, kSpan, checkpoints);
+                Check(loaded || checkpoints.empty(), what + ": rejected file leaves checkpoints");
+                for (const auto &[name, entry] : checkpoints)
+                {
+                    bool valid = !entry.points.empty() && entry.points.front().out_offset == 0 &&
+                                 entry.points.front().in_offset == 0;
+                    for (size_t i = 0; valid && i < entry.points.size(); ++i)
+                    {
+                        const Search::InflateCheckpoint &point = entry.points[i];
+                        valid = (i == 0 || point.out_offset > entry.points[i - 1].out_offset) &&
+                                point.out_offset <= entry.size && point.in_offset <= entry.compressed_size &&
+                                point.bits <= 7 && (point.bits == 0 || point.in_offset > 0);
+                    }
+                    Check(valid, what + ": accepted checkpoints lie outside " + name);
+                }
+                return loaded;
+            }
+            catch (const std::exception &e)
+            {
+                Check(false, what + ": " + e.what());
+                return false;
+            }
+        };
+
+        Check(load(original, "intact file"), "intact checkpoint file is rejected");
+        for (size_t size = 0; size < original.size(); size += (size < 512) ? 1 : 997)
+        {
+            Check(!load(std::string_view(original).substr(0, size), "truncated to " + std::to_string(size)),
+                  "checkpoint file truncated to " + std::to_string(size) + " bytes is accepted");
+        }
+
+        // Sizes and offsets sit in the first bytes and around each window.
+        const uint64_t kValues[] = {1, 8, 0x8000, 0xffffffff, uint64_t{1} << 40, UINT64_MAX};
+        for (size_t offset = 0; offset + sizeof(uint64_t) <= original.size(); offset += (offset < 512) ? 8 : 1021)
+        {
+            for (const uint64_t value : kValues)
+            {
+                std::string corrupt = original;
+                std::memcpy(corrupt.data() + offset, &value, sizeof(value));
+                load(corrupt, "word at " + std::to_string(offset) + " set to " + std::to_string(value));
+            }
+        }
+        WriteFile(filename, original);
+    }
+
+    std::vector<uint8_t> FromHex(std::string_view hex)
+    {
+        std::vector<uint8_t> bytes;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2)
+        {
+            bytes.push_back(static_cast<uint8_t>(std::stoi(std::string(hex.substr(i, 2)), nullptr, 16)));
+        }
+        return bytes;
+    }
+
+    // Published digests of a few passwords lead back to their lines, and so
+    // does the digest of every line, computed one block at a time rather
+    // than in the SIMD lanes that built the tables.
+    void TestDigests()
+    {
+        const Wordlist &wordlist = GetWordlist();
+        const Search::SortedIndex index(wordlist.index);
+        using Search::DigestAlgorithm;
+        const struct
+        {
+            DigestAlgorithm algorithm;
+            const char *password;
+            const char *hex;
+        } kKnown[] = {
+            {DigestAlgorithm::Md5, "password", "5f4dcc3b5aa765d61d8327deb882cf99"},
+            {DigestAlgorithm::Md5, "hunter2", "2ab96390c7dbe3439de74d0c9b0b1767"},
+            {DigestAlgorithm::Sha1, "password", "5baa61e4c9b93f3f0682250b6cf8331b7ee68fd8"},
+            {DigestAlgorithm::Sha1, "123456", "7c4a8d09ca3762af61e59520943dc26494f8941b"},
+            {DigestAlgorithm::Ntlm, "password", "8846f7eaee8fb117ad06bdd830b7586c"},
+            {DigestAlgorithm::Ntlm, "123456", "32ed87bdb5fdc5e9cba88547376818d4"},
+        };
+        for (const auto &known : kKnown)
+        {
+            const Search::DigestTable table(Search::DigestTableFilename(wordlist.index, known.algorithm));
+            uint64_t line_number = 0;
+            Check(table.Find(FromHex(known.hex), line_number) && index.LineByNumber(line_number) == known.password,
+                  std::string(Search::DigestName(known.algorithm)) + " of " + known.password + " not found");
+        }
+
+        for (const DigestAlgorithm algorithm : Search::kDigestAlgorithms)
+        {
+            const Search::DigestTable table(Search::DigestTableFilename(wordlist.index, algorithm));
+            uint64_t found = 0;
+            std::string message;
+            for (const std::string &line : wordlist.lines)
+            {
+                message.clear();
+                Search::AppendDigestMessage(algorithm, line, message);
+                Search::PadDigestMessage(algorithm, message);
+                uint8_t digest[20];
+                Search::DigestMessage(algorithm, message, digest);
+                uint64_t line_number = 0;
+                found += table.Find({digest, Search::DigestSize(algorithm)}, line_number) &&
+                         index.LineByNumber(line_number) == line;
+            }
+            Check(found == wordlist.lines.size(), std::string(Search::DigestName(algorithm)) + " finds " +
+                                                      std::to_string(found) + " of " +
+                                                      std::to_string(wordlist.lines.size()) + " lines");
+            uint64_t line_number = 0;
+            Check(!table.Find(std::vector<uint8_t>(Search::DigestSize(algorithm), 0), line_number),
+                  std::string(Search::DigestName(algorithm)) + " finds a digest of zeros");
+        }
+    }
+
+    struct Test
+    {
+        const char *name;
+        void (*run)();
+    };
+
+    constexpr Test kTests[] = {
+        {"ranges", TestRanges},
+        {"whole_lines", TestWholeLines},
+        {"streaming", TestStreaming},
+        {"kernels", TestKernels},
+        {"regex", TestRegex},
+        {"lookup", TestLookup},
+        {"digests", TestDigests},
+        {"rebuilds", TestRebuilds},
+        {"checkpoints", TestCheckpoints},
+    };
+
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        bool found = false;
+        for (const Test &test : kTests)
+        {
+            if (argc > 1 && std::string_view(argv[1]) != test.name)
+                continue;
+            found = true;
+            const int before = failures;
+            test.run();
+            std::cout << (failures == before ? "ok   " : "FAIL ") << test.name << '\n';
+        }
+        if (!found)
+        {
+            std::cerr << "Unknown test: " << argv[1] << '\n';
+            return 1;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return failures == 0 ? 0 : 1;
+}